@@ -22,6 +22,20 @@
 #include "Mamba.h"
 #include <ostream>
 #include <iostream>
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <new>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 namespace mamba {
 
@@ -32,10 +46,13 @@ namespace mamba {
  ** create, collect and send all midi events to jack_midi out buffer
  */
 
-MidiMessenger::MidiMessenger() {
+MidiMessenger::MidiMessenger()
+    : link(NULL) {
     channel = 0;
     for (int i = 0; i < max_midi_cc_cnt; i++) {
         send_cc[i] = false;
+        post_usec[i] = 0;
+        ui_usec[i] = -1;
     }
 }
 
@@ -58,8 +75,27 @@ void MidiMessenger::fill(unsigned char *midi_send, int i) noexcept {
 }
 
 bool MidiMessenger::send_midi_cc(uint8_t _cc, const uint8_t _pg, const uint8_t _bgn,
-                                const uint8_t _num, const bool have_channel) noexcept {
+                                const uint8_t _num, const bool have_channel,
+                                const unsigned long xtime) noexcept {
     if (!have_channel && channel < 16) _cc |=channel;
+    EngineLink *l = link.load(std::memory_order_acquire);
+    if (l) {
+        ScheduledMidi e;
+        // the jack thread of the engine send it in the cycle it takes it
+        e.frame = 0;
+        e.num = _num;
+        e.buffer[0] = _cc;
+        e.buffer[1] = _pg;
+        e.buffer[2] = _bgn;
+        return l->midi.push(e);
+    }
+    int64_t now = xtime ? now_usec() : 0;
+    int64_t ui = -1;
+    if (xtime) {
+        // X timestamps are server milliseconds on a 32 bit clock
+        uint32_t d = (uint32_t)(now / 1000) - (uint32_t)xtime;
+        if (d < 10000) ui = (int64_t)d * 1000;
+    }
     for(int i = 0; i < max_midi_cc_cnt; i++) {
         if (send_cc[i].load(std::memory_order_acquire)) {
             if (cc_num[i] == _cc && pg_num[i] == _pg &&
@@ -70,6 +106,8 @@ bool MidiMessenger::send_midi_cc(uint8_t _cc, const uint8_t _pg, const uint8_t _
             pg_num[i] = _pg;
             bg_num[i] = _bgn;
             me_num[i] = _num;
+            post_usec[i] = now;
+            ui_usec[i] = ui;
             send_cc[i].store(true, std::memory_order_release);
             return true;
         }
@@ -78,6 +116,749 @@ bool MidiMessenger::send_midi_cc(uint8_t _cc, const uint8_t _pg, const uint8_t _
 }
 
 
+/****************************************************************
+ ** class Reactor
+ **
+ ** one epoll loop in a extra thread for all non realtime work
+ ** 
+ */
+
+Reactor::Reactor()
+    : _execute(false) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) fprintf(stderr, "Reactor: epoll_create1 failed\n");
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        fprintf(stderr, "Reactor: eventfd failed\n");
+    } else if (epfd >= 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+    }
+}
+
+Reactor::~Reactor() {
+    if( _execute.load(std::memory_order_acquire) ) {
+        stop();
+    };
+    for (auto const& h : handlers) {
+        if (h.second->kind != FD) close(h.first);
+    }
+    if (wake_fd >= 0) close(wake_fd);
+    if (epfd >= 0) close(epfd);
+}
+
+bool Reactor::add(int fd, int kind, uint32_t events, std::function<void(uint32_t)> func) {
+    if (fd < 0 || epfd < 0) return false;
+    std::shared_ptr<Handler> h = std::make_shared<Handler>();
+    h->kind = kind;
+    h->func = func;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        handlers[fd] = h;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "Reactor: couldn't watch fd %i\n", fd);
+        std::lock_guard<std::mutex> lk(m);
+        handlers.erase(fd);
+        return false;
+    }
+    return true;
+}
+
+bool Reactor::add_fd(int fd, uint32_t events, std::function<void(uint32_t)> func) {
+    return add(fd, FD, events, func);
+}
+
+int Reactor::add_timer(int interval, std::function<void(void)> func) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Reactor: timerfd_create failed\n");
+        return -1;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval / 1000;
+    its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    timerfd_settime(fd, 0, &its, NULL);
+    if (!add(fd, TIMER, EPOLLIN, [func] (uint32_t) {func();})) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int Reactor::add_event(std::function<void(void)> func) {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Reactor: eventfd failed\n");
+        return -1;
+    }
+    if (!add(fd, EVENT, EPOLLIN, [func] (uint32_t) {func();})) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int Reactor::add_signals(const sigset_t *set, std::function<void(int)> func) {
+    int fd = signalfd(-1, set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Reactor: signalfd failed\n");
+        return -1;
+    }
+    // the signal number is passed through the events argument
+    if (!add(fd, SIGNAL, EPOLLIN, [func] (uint32_t sig) {func((int)sig);})) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void Reactor::remove(int fd) {
+    if (fd < 0) return;
+    std::shared_ptr<Handler> h;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = handlers.find(fd);
+        if (it == handlers.end()) return;
+        h = it->second;
+        handlers.erase(it);
+    }
+    if (epfd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    // wait for a dispatch which may have found the handler before
+    if (_thd.joinable() && std::this_thread::get_id() != _thd.get_id()) {
+        std::lock_guard<std::mutex> lk(run);
+    }
+    if (h->kind != FD) close(fd);
+}
+
+// static
+void Reactor::notify(int efd) noexcept {
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Reactor: notify failed\n");
+}
+
+void Reactor::dispatch(int fd, uint32_t events) {
+    // hold run from the lookup on, so a handler is never called
+    // once remove() has returned
+    std::lock_guard<std::mutex> lk_run(run);
+    std::shared_ptr<Handler> h;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = handlers.find(fd);
+        if (it == handlers.end()) return;
+        h = it->second;
+    }
+    if (h->kind == TIMER || h->kind == EVENT) {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) return;
+    } else if (h->kind == SIGNAL) {
+        struct signalfd_siginfo si;
+        if (read(fd, &si, sizeof(si)) != sizeof(si)) return;
+        events = si.ssi_signo;
+    }
+    h->func(events);
+}
+
+void Reactor::start() {
+    if( _execute.load(std::memory_order_acquire) ) {
+        stop();
+    };
+    if (epfd < 0) return;
+    _execute.store(true, std::memory_order_release);
+    _thd = std::thread([this]() {
+        struct epoll_event events[16];
+        while (_execute.load(std::memory_order_acquire)) {
+            int n = epoll_wait(epfd, events, 16, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "Reactor: epoll_wait failed\n");
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.fd == wake_fd) {
+                    uint64_t count;
+                    if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                        fprintf(stderr, "Reactor: wake up failed\n");
+                    continue;
+                }
+                dispatch(events[i].data.fd, events[i].events);
+            }
+        }
+    });
+}
+
+void Reactor::stop() {
+    _execute.store(false, std::memory_order_release);
+    if (wake_fd >= 0) notify(wake_fd);
+    if (_thd.joinable()) {
+        _thd.join();
+    }
+}
+
+bool Reactor::is_running() const noexcept {
+    return ( _execute.load(std::memory_order_acquire) && 
+             _thd.joinable() );
+}
+
+
+/****************************************************************
+ ** realtime memory helpers
+ */
+
+// with MCL_FUTURE every later allocation, the sound-font samples as well,
+// count against the memlock limit and fail beyond it. so it is only used
+// when the limit is unlimited or large, else only the pages mapped now
+// are locked and the realtime data get prefaulted
+bool lock_memory() noexcept {
+    static const rlim_t future_limit = (rlim_t)1 << 30;
+    rlimit rl;
+    int flags = MCL_CURRENT;
+    std::string limit = "unknown";
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0) {
+        if (rl.rlim_cur == RLIM_INFINITY) {
+            limit = "unlimited";
+            flags |= MCL_FUTURE;
+        } else {
+            limit = std::to_string(rl.rlim_cur >> 10) + " kB";
+            if (rl.rlim_cur >= future_limit) flags |= MCL_FUTURE;
+        }
+    }
+    if (mlockall(flags) == 0) {
+        fprintf(stderr, "memory locked, %s, memlock limit %s\n",
+            flags & MCL_FUTURE ? "current and future pages" : "current pages only", limit.c_str());
+        return true;
+    }
+    fprintf(stderr, "Couldn't lock memory (memlock limit %s): %s", limit.c_str(), strerror(errno));
+    if (errno == EPERM || errno == ENOMEM)
+        fprintf(stderr, ", check the memlock limit for your user (ulimit -l)");
+    fprintf(stderr, "\n");
+    return false;
+}
+
+void prefault(void *p, size_t size) noexcept {
+    if (!p || !size) return;
+    const long page = sysconf(_SC_PAGESIZE);
+    char *c = (char*)p;
+    // a read alone could map the shared zero page, so add 0 atomically,
+    // other threads may already use the memory
+    for (size_t i = 0; i < size; i += page) __atomic_fetch_add(&c[i], 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c[size-1], 0, __ATOMIC_RELAXED);
+}
+
+
+/****************************************************************
+ ** class StateExport
+ **
+ ** place the engine state block in POSIX shared memory
+ ** 
+ */
+
+// map the shared memory object name, with size bytes when create is set,
+// else it must hold at least size bytes
+static void *map_shared(const std::string& name, size_t size, bool create, const char *who) {
+    int fd = shm_open(name.c_str(), create ? O_CREAT | O_RDWR : O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: shm_open %s failed: %s\n", who, name.c_str(), strerror(errno));
+        return NULL;
+    }
+    if (create && ftruncate(fd, size) < 0) {
+        fprintf(stderr, "%s: ftruncate failed: %s\n", who, strerror(errno));
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return NULL;
+    }
+    struct stat st;
+    if (!create && (fstat(fd, &st) < 0 || (size_t)st.st_size < size)) {
+        fprintf(stderr, "%s: %s is no engine link\n", who, name.c_str());
+        ::close(fd);
+        return NULL;
+    }
+    void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap failed: %s\n", who, strerror(errno));
+        if (create) shm_unlink(name.c_str());
+        return NULL;
+    }
+    return m;
+}
+
+StateExport::StateExport()
+    : mem(NULL) {
+}
+
+StateExport::~StateExport() {
+    close();
+}
+
+SeqLock<EngineState> *StateExport::open(const std::string& name) {
+    close();
+    shm_name = name[0] == '/' ? name : "/" + name;
+    mem = map_shared(shm_name, sizeof(SeqLock<EngineState>), true, "StateExport");
+    if (!mem) return NULL;
+    return new (mem) SeqLock<EngineState>();
+}
+
+void StateExport::close() {
+    if (!mem) return;
+    munmap(mem, sizeof(SeqLock<EngineState>));
+    shm_unlink(shm_name.c_str());
+    mem = NULL;
+}
+
+
+/****************************************************************
+ ** class EngineLink
+ **
+ ** the shared memory block of a engine process and its GUI
+ */
+
+EngineLink::EngineLink()
+    : state(),
+    layout(engine_link_layout),
+    engine_pid(getpid()),
+    gui_pid(0) {
+}
+
+static bool process_alive(int32_t pid) noexcept {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+bool EngineLink::engine_alive() const noexcept {
+    return process_alive(engine_pid.load(std::memory_order_acquire));
+}
+
+bool EngineLink::attach_gui() noexcept {
+    const int32_t me = getpid();
+    int32_t gui = gui_pid.load(std::memory_order_acquire);
+    do {
+        if (gui != me && process_alive(gui)) return false;
+    } while (!gui_pid.compare_exchange_weak(gui, me, std::memory_order_acq_rel));
+    // drop the notes played while no GUI was attached
+    EngineEvent ev;
+    while (jack_keys.pop(&ev)) {}
+    while (alsa_keys.pop(&ev)) {}
+    return true;
+}
+
+void EngineLink::detach_gui() noexcept {
+    int32_t me = getpid();
+    gui_pid.compare_exchange_strong(me, 0, std::memory_order_acq_rel);
+}
+
+
+/****************************************************************
+ ** class SharedLink
+ **
+ ** place a EngineLink in POSIX shared memory
+ */
+
+SharedLink::SharedLink()
+    : mem(NULL),
+    owner(false) {
+}
+
+SharedLink::~SharedLink() {
+    close();
+}
+
+EngineLink *SharedLink::create(const std::string& name) {
+    close();
+    shm_name = name[0] == '/' ? name : "/" + name;
+    mem = map_shared(shm_name, sizeof(EngineLink), true, "SharedLink");
+    if (!mem) return NULL;
+    owner = true;
+    return new (mem) EngineLink();
+}
+
+EngineLink *SharedLink::open(const std::string& name) {
+    close();
+    shm_name = name[0] == '/' ? name : "/" + name;
+    mem = map_shared(shm_name, sizeof(EngineLink), false, "SharedLink");
+    if (!mem) return NULL;
+    EngineLink *l = (EngineLink*)mem;
+    if (l->layout != engine_link_layout || !l->engine_alive()) {
+        fprintf(stderr, "SharedLink: no engine runs for %s\n", shm_name.c_str());
+        close();
+        return NULL;
+    }
+    return l;
+}
+
+void SharedLink::close() {
+    if (!mem) return;
+    munmap(mem, sizeof(EngineLink));
+    if (owner) shm_unlink(shm_name.c_str());
+    mem = NULL;
+    owner = false;
+}
+
+
+// the file has a line per event, the loops are split by [CHANNELn] lines
+bool read_loops(const std::string& file, std::vector<MidiEvent> *play) {
+    std::ifstream vinfile(file);
+    if (!vinfile.is_open()) return false;
+    std::string line;
+    MidiEvent ev;
+    int word = 0;
+    double time = 0;
+    std::getline(vinfile, line);
+    for (int j = 0; j < 16; j++) {
+        while (std::getline(vinfile, line)) {
+            std::istringstream buf(line);
+            if(line.find("CHANNEL") != std::string::npos) break;
+            buf >> word;
+            ev.buffer[0] = word;
+            buf >> word;
+            ev.buffer[1] = word;
+            buf >> word;
+            ev.buffer[2] = word;
+            buf >> word;
+            ev.num = word;
+            // the delta time is kept in the file for older versions
+            buf >> time;
+            buf >> time;
+            ev.tick = MidiEvent::to_tick(time);
+            play[j].push_back(ev);
+        }
+    }
+    vinfile.close();
+    return true;
+}
+
+
+/****************************************************************
+ ** class ThreadSched
+ **
+ ** scheduling policy, priority and cpu affinity per thread class
+ ** 
+ */
+
+static const struct {
+    const char *name;
+    int policy;
+} sched_policies[] = {
+    {"other", SCHED_OTHER},
+    {"fifo", SCHED_FIFO},
+    {"rr", SCHED_RR},
+    {"batch", SCHED_BATCH},
+    {"idle", SCHED_IDLE},
+};
+
+static const char *policy_name(int policy) noexcept {
+    for (auto& p : sched_policies)
+        if (p.policy == policy) return p.name;
+    return "?";
+}
+
+// "2-3,5" into a cpu set
+static bool parse_cpus(const std::string& list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    std::istringstream buf(list);
+    std::string range;
+    while (std::getline(buf, range, ',')) {
+        int first = 0;
+        int last = 0;
+        char dash = 0;
+        std::istringstream r(range);
+        if (!(r >> first)) return false;
+        last = first;
+        if (r >> dash && !(dash == '-' && r >> last)) return false;
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (int c = first; c <= last; c++) CPU_SET(c, cpus);
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+static std::string cpus_to_string(const cpu_set_t *cpus) {
+    std::string list;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, cpus)) continue;
+        int last = c;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) last++;
+        if (!list.empty()) list += ",";
+        list += std::to_string(c);
+        if (last > c) list += "-" + std::to_string(last);
+        c = last;
+    }
+    return list;
+}
+
+ThreadSched::ThreadSched() {
+    for (int i = 0; i < CLASSES; i++) {
+        setting[i].policy = -1;
+        setting[i].priority = 0;
+        CPU_ZERO(&setting[i].cpus);
+        setting[i].has_cpus = false;
+    }
+    // threads inherit the mask of their creator, keep the one to reset to
+    CPU_ZERO(&all_cpus);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &all_cpus) || !CPU_COUNT(&all_cpus))
+        for (int c = 0; c < CPU_SETSIZE; c++) CPU_SET(c, &all_cpus);
+}
+
+// static
+const char *ThreadSched::class_name(int cls) noexcept {
+    static const char *names[CLASSES] = {"jack", "reactor", "gui", "worker", "alsa"};
+    return cls >= 0 && cls < CLASSES ? names[cls] : "?";
+}
+
+bool ThreadSched::parse(int cls, const std::string& value) {
+    if (cls < 0 || cls >= CLASSES) return false;
+    Setting s;
+    s.policy = -1;
+    s.priority = 0;
+    s.has_cpus = false;
+    CPU_ZERO(&s.cpus);
+    std::istringstream buf(value);
+    std::string policy;
+    std::string priority;
+    std::string cpus;
+    buf >> policy;
+    buf >> priority;
+    buf >> cpus;
+    if (!priority.empty() && priority != "-") {
+        char *end = NULL;
+        s.priority = strtol(priority.c_str(), &end, 10);
+        if (*end) {
+            fprintf(stderr, "sched: invalid priority %s for the %s thread\n", priority.c_str(), class_name(cls));
+            return false;
+        }
+    }
+    if (policy != "-") {
+        for (auto& p : sched_policies)
+            if (policy == p.name) s.policy = p.policy;
+        if (s.policy < 0) {
+            fprintf(stderr, "sched: unknown policy %s for the %s thread\n", policy.c_str(), class_name(cls));
+            return false;
+        }
+        if (s.priority < sched_get_priority_min(s.policy) ||
+                s.priority > sched_get_priority_max(s.policy)) {
+            fprintf(stderr, "sched: priority %d out of range for %s\n", s.priority, policy.c_str());
+            return false;
+        }
+    }
+    if (!cpus.empty() && cpus != "-") {
+        if (!parse_cpus(cpus, &s.cpus)) {
+            fprintf(stderr, "sched: invalid cpu list %s for the %s thread\n", cpus.c_str(), class_name(cls));
+            return false;
+        }
+        s.has_cpus = true;
+    }
+    setting[cls] = s;
+    return true;
+}
+
+std::string ThreadSched::to_string(int cls) const {
+    const Setting& s = setting[cls];
+    if (s.policy < 0 && !s.has_cpus) return std::string();
+    std::string value = s.policy < 0 ? "-" : policy_name(s.policy);
+    value += " " + std::to_string(s.priority) + " ";
+    value += s.has_cpus ? cpus_to_string(&s.cpus) : "-";
+    return value;
+}
+
+void ThreadSched::apply(int cls, pthread_t t) const {
+    const Setting& s = setting[cls];
+    int ret = 0;
+    if (s.policy >= 0) {
+        if (cls == JACK) {
+            fprintf(stderr, "sched: the jack thread policy is set by jackd, only the cpus are used\n");
+        } else {
+            sched_param param;
+            param.sched_priority = s.priority;
+            if ((ret = pthread_setschedparam(t, s.policy, &param)))
+                fprintf(stderr, "sched: couldn't set %s %d for the %s thread: %s\n",
+                    policy_name(s.policy), s.priority, class_name(cls), strerror(ret));
+        }
+    }
+    if ((ret = pthread_setaffinity_np(t, sizeof(cpu_set_t), s.has_cpus ? &s.cpus : &all_cpus)))
+        fprintf(stderr, "sched: couldn't set the cpus for the %s thread: %s\n",
+            class_name(cls), strerror(ret));
+
+    // report what is in effect now
+    int policy = 0;
+    sched_param param;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (pthread_getschedparam(t, &policy, &param) == 0 &&
+            pthread_getaffinity_np(t, sizeof(cpu_set_t), &cpus) == 0) {
+        fprintf(stderr, "sched: %s thread %s %d cpus %s\n", class_name(cls),
+            policy_name(policy), param.sched_priority, cpus_to_string(&cpus).c_str());
+    }
+}
+
+
+/****************************************************************
+ ** class LatencyHistogram
+ **
+ ** log2 histogram of the delay from X key/button event to midi out
+ ** 
+ */
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::reset() noexcept {
+    for (int s = 0; s < STAGES; s++) {
+        for (int b = 0; b < buckets; b++) {
+            count[s][b].store(0, std::memory_order_relaxed);
+        }
+        sum[s].store(0, std::memory_order_relaxed);
+        num[s].store(0, std::memory_order_relaxed);
+        peak[s].store(0, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::add_stage(const int stage, int64_t usec) noexcept {
+    if (usec < 0) usec = 0;
+    int b = 0;
+    while (b < buckets-1 && usec >= ((int64_t)1 << b)) b++;
+    count[stage][b].fetch_add(1, std::memory_order_relaxed);
+    sum[stage].fetch_add((uint64_t)usec, std::memory_order_relaxed);
+    num[stage].fetch_add(1, std::memory_order_relaxed);
+    if (usec > peak[stage].load(std::memory_order_relaxed))
+        peak[stage].store(usec, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::add(const int64_t ui, const int64_t queue, const int64_t cycle) noexcept {
+    add_stage(QUEUE, queue);
+    add_stage(CYCLE, cycle);
+    if (ui >= 0) {
+        add_stage(UI, ui);
+        add_stage(TOTAL, ui + queue + cycle);
+    }
+}
+
+// upper bound of the bucket holding the p-th fraction of events
+int64_t LatencyHistogram::percentile(const int stage, const double p) const noexcept {
+    uint32_t n = num[stage].load(std::memory_order_relaxed);
+    if (!n) return 0;
+    uint32_t want = (uint32_t)std::ceil(p * n);
+    uint32_t seen = 0;
+    for (int b = 0; b < buckets; b++) {
+        seen += count[stage][b].load(std::memory_order_relaxed);
+        if (seen >= want) return (int64_t)1 << b;
+    }
+    return (int64_t)1 << (buckets-1);
+}
+
+std::string LatencyHistogram::summary(const char nl) const {
+    static const char *names[STAGES] = {"UI", "Queue", "Cycle", "Total", "Process"};
+    std::string s;
+    char line[128];
+    for (int i = 0; i < PROCESS; i++) {
+        uint32_t n = num[i].load(std::memory_order_relaxed);
+        double avg = n ? (double)sum[i].load(std::memory_order_relaxed)/n/1000.0 : 0.0;
+        snprintf(line, 127, "%-5s n %u  avg %.2f ms  p50 < %.2f ms  p99 < %.2f ms  max %.2f ms",
+            names[i], n, avg, percentile(i, 0.5)/1000.0, percentile(i, 0.99)/1000.0,
+            peak[i].load(std::memory_order_relaxed)/1000.0);
+        s += line;
+        s += nl;
+    }
+    // the process callback takes some usec only, so show that in usec
+    uint32_t n = num[PROCESS].load(std::memory_order_relaxed);
+    snprintf(line, 127, "%-5s n %u  avg %.1f us  p50 < %lld us  p99 < %lld us  max %lld us",
+        names[PROCESS], n, n ? (double)sum[PROCESS].load(std::memory_order_relaxed)/n : 0.0,
+        (long long)percentile(PROCESS, 0.5), (long long)percentile(PROCESS, 0.99),
+        (long long)peak[PROCESS].load(std::memory_order_relaxed));
+    s += line;
+    s += nl;
+    return s;
+}
+
+std::string LatencyHistogram::dump() const {
+    std::string s = summary('\n');
+    char line[128];
+    snprintf(line, 127, "%12s %10s %10s %10s %10s %10s\n", "< usec", "UI", "Queue", "Cycle", "Total", "Process");
+    s += line;
+    for (int b = 0; b < buckets; b++) {
+        snprintf(line, 127, "%12lld %10u %10u %10u %10u %10u\n", (long long)1 << b,
+            count[UI][b].load(std::memory_order_relaxed),
+            count[QUEUE][b].load(std::memory_order_relaxed),
+            count[CYCLE][b].load(std::memory_order_relaxed),
+            count[TOTAL][b].load(std::memory_order_relaxed),
+            count[PROCESS][b].load(std::memory_order_relaxed));
+        s += line;
+    }
+    return s;
+}
+
+
+/****************************************************************
+ ** class MidiMonitor
+ **
+ ** log the midi events passing the jack and alsa in/outputs
+ ** 
+ */
+
+MidiMonitor::MidiMonitor() {
+    enabled = false;
+    for (int i = 0; i < SOURCES; i++) {
+        head[i] = 0;
+        tail[i] = 0;
+        nevents[i] = 0;
+        nbytes[i] = 0;
+        ndropped[i] = 0;
+    }
+}
+
+// only the thread owning the source write here
+void MidiMonitor::log_event(const int source, const uint8_t *midi, const uint32_t num) noexcept {
+    nevents[source].store(nevents[source].load(std::memory_order_relaxed) + 1,
+                                                std::memory_order_relaxed);
+    nbytes[source].store(nbytes[source].load(std::memory_order_relaxed) + num,
+                                                std::memory_order_relaxed);
+    const uint32_t h = head[source].load(std::memory_order_relaxed);
+    if (h - tail[source].load(std::memory_order_acquire) >= ring_size) {
+        ndropped[source].store(ndropped[source].load(std::memory_order_relaxed) + 1,
+                                                std::memory_order_relaxed);
+        return;
+    }
+    Entry& e = ring[source][h & (ring_size - 1)];
+    e.usec = now_usec();
+    e.source = (uint8_t)source;
+    e.num = num > 255 ? 255 : (uint8_t)num;
+    for (uint32_t i = 0; i < 3; i++) e.buffer[i] = i < num ? midi[i] : 0;
+    head[source].store(h + 1, std::memory_order_release);
+}
+
+size_t MidiMonitor::take(std::vector<Entry> *out) {
+    const size_t first = out->size();
+    for (int i = 0; i < SOURCES; i++) {
+        const uint32_t h = head[i].load(std::memory_order_acquire);
+        uint32_t t = tail[i].load(std::memory_order_relaxed);
+        for (; t != h; t++) out->push_back(ring[i][t & (ring_size - 1)]);
+        tail[i].store(t, std::memory_order_release);
+    }
+    std::stable_sort(out->begin() + first, out->end(),
+                    [](const Entry& lhs, const Entry& rhs) {
+        return lhs.usec < rhs.usec;
+    });
+    return out->size() - first;
+}
+
+uint64_t MidiMonitor::events(const int source) const noexcept {
+    return nevents[source].load(std::memory_order_relaxed);
+}
+
+uint64_t MidiMonitor::bytes(const int source) const noexcept {
+    return nbytes[source].load(std::memory_order_relaxed);
+}
+
+uint64_t MidiMonitor::dropped(const int source) const noexcept {
+    return ndropped[source].load(std::memory_order_relaxed);
+}
+
+
 /****************************************************************
  ** class MidiLoad
  **
@@ -88,7 +869,6 @@ bool MidiMessenger::send_midi_cc(uint8_t _cc, const uint8_t _pg, const uint8_t _
 MidiLoad::MidiLoad() {
     smf = NULL;
     smf_event = NULL;
-    deltaTime = 0.0;
     absoluteTime = 0.0;
 }
 
@@ -98,7 +878,6 @@ MidiLoad::~MidiLoad() {
 
 bool MidiLoad::load_file(std::vector<MidiEvent> *play, int *song_bpm, const char* file_name) {
     smf = smf_new();
-    deltaTime = 0.0;
     if(!(smf = smf_load(file_name))) return false;
     // fprintf(stderr, "ppqn = %i\n", smf->ppqn);
     // fprintf(stderr, "length = %f sec\n", smf_get_length_seconds(smf));
@@ -125,10 +904,9 @@ bool MidiLoad::load_file(std::vector<MidiEvent> *play, int *song_bpm, const char
             continue;
         }
         ev = {{smf_event->midi_buffer[0], smf_event->midi_buffer[1], smf_event->midi_buffer[2]},
-                                        smf_event->midi_buffer_length, smf_event->time_seconds - deltaTime,
-                                                                    smf_event->time_seconds + absoluteTime};
+                (uint8_t)(smf_event->midi_buffer_length > 3 ? 3 : smf_event->midi_buffer_length),
+                MidiEvent::to_tick(smf_event->time_seconds + absoluteTime)};
         play->push_back(ev);
-        deltaTime = smf_event->time_seconds;
         count++;
         //fprintf(stderr,"%d: %f seconds, %d pulses, %d delta pulses\n", smf_event->event_number,
         //    smf_event->time_seconds, smf_event->time_pulses, smf_event->delta_time_pulses);
@@ -154,7 +932,7 @@ bool MidiLoad::add_from_file(std::vector<MidiEvent> *play, int *song_bpm, const
     if (!positions.size()) positions.push_back(0);
     if (play->size()) {
         const mamba::MidiEvent ev = play[0][play->size()-1];
-        absoluteTime = ev.absoluteTime;
+        absoluteTime = ev.absoluteTime();
     } else {
         absoluteTime = 0.0;
     }
@@ -165,6 +943,10 @@ void MidiLoad::remove_file(std::vector<MidiEvent> *play, int f) {
     if (!((int)positions.size()>f)) return;
     int stamp = positions[f];
     int stamp2 = positions[f+1];
+    if (stamp2 <= stamp) return;
+    // the files following the removed one move up by its length
+    const uint32_t before = stamp ? play[0][stamp-1].tick : 0;
+    const uint32_t span = play[0][stamp2-1].tick - before;
     play[0].erase(play[0].begin()+stamp,play[0].begin()+stamp2);
 
     for(std::vector<int>::iterator i = positions.begin()+f+1;
@@ -173,11 +955,9 @@ void MidiLoad::remove_file(std::vector<MidiEvent> *play, int f) {
     }
     positions.erase(positions.begin()+f+1);
     
-    double aTime = 0.0;
-    for(std::vector<MidiEvent>::iterator i = play[0].begin();
+    for(std::vector<MidiEvent>::iterator i = play[0].begin()+stamp;
                                     i != play[0].end(); ++i) {
-        (*i).absoluteTime = (*i).deltaTime + aTime;
-        aTime = (*i).absoluteTime;
+        (*i).tick -= span;
     }
 }
 
@@ -239,7 +1019,7 @@ double MidiSave::get_max_time(std::vector<MidiEvent> *play) noexcept {
     for (int j = 0; j<16;j++) {
         if (!play[j].size()) continue;
         const MidiEvent ev = play[j][play[j].size()-1];
-        if (ev.absoluteTime > ret) ret = ev.absoluteTime;
+        if (ev.absoluteTime() > ret) ret = ev.absoluteTime();
     }
     return ret;
 }
@@ -256,8 +1036,9 @@ void MidiSave::save_to_file(std::vector<MidiEvent> *play, const char* file_name)
 
             channel = smf_event->midi_buffer[0] & 0x0F;
 
-            smf_track_add_event_seconds(tracks[channel], smf_event,(*i).deltaTime + t[j]);
-            t[j] += (*i).deltaTime;
+            const double deltaTime = MidiEvent::deltaTime(play[j], i - play[j].begin());
+            smf_track_add_event_seconds(tracks[channel], smf_event, deltaTime + t[j]);
+            t[j] += deltaTime;
             if (!freewheel) {
                 if (t[j]<max_time && i == play[j].end()-1) {
                     i = play[j].begin();
@@ -289,73 +1070,493 @@ void MidiSave::save_to_file(std::vector<MidiEvent> *play, const char* file_name)
 }
 
 
+/****************************************************************
+ ** class PackedLoop
+ **
+ ** delta time varint coded loop
+ ** 
+ */
+
+void PackedLoop::pack(const std::vector<MidiEvent>& loop) {
+    data.clear();
+    data.reserve(loop.size() * 4);
+    count = loop.size();
+    uint32_t last = 0;
+    unsigned char status = 0;
+    uint8_t num = 0;
+    for (size_t i = 0; i < loop.size(); i++) {
+        const MidiEvent& ev = loop[i];
+        const uint8_t n = ev.num > 3 ? 3 : ev.num;
+        const bool running = i && ev.buffer[0] == status && n == num;
+        // the lowest bit flag running status
+        uint64_t v = ((uint64_t)(uint32_t)(ev.tick - last) << 1) | (running ? 1 : 0);
+        last = ev.tick;
+        while (v >= 0x80) {
+            data.push_back((uint8_t)(v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        data.push_back((uint8_t)v);
+        if (!running) {
+            status = ev.buffer[0];
+            num = n;
+            data.push_back(status);
+            data.push_back(num);
+        }
+        for (int k = 1; k < n; k++) data.push_back(ev.buffer[k]);
+    }
+    data.shrink_to_fit();
+}
+
+void PackedLoop::unpack(std::vector<MidiEvent> *loop) const {
+    loop->clear();
+    loop->reserve(count);
+    uint32_t tick = 0;
+    unsigned char status = 0;
+    uint8_t num = 0;
+    size_t p = 0;
+    for (uint32_t i = 0; i < count && p < data.size(); i++) {
+        uint64_t v = 0;
+        int shift = 0;
+        while (p < data.size()) {
+            const uint8_t b = data[p++];
+            v |= (uint64_t)(b & 0x7f) << shift;
+            shift += 7;
+            if (!(b & 0x80)) break;
+        }
+        tick += (uint32_t)(v >> 1);
+        if (!(v & 1) && p + 1 < data.size()) {
+            status = data[p++];
+            num = data[p++];
+        }
+        MidiEvent ev = {{status, 0, 0}, num, tick};
+        for (int k = 1; k < num && p < data.size(); k++) ev.buffer[k] = data[p++];
+        loop->push_back(ev);
+    }
+}
+
+/****************************************************************
+ ** class LoopLibrary
+ **
+ ** packed takes and scenes
+ ** 
+ */
+
+int LoopLibrary::store_take(int channel, const std::vector<MidiEvent>& loop) {
+    takes.push_back(Take());
+    takes.back().channel = channel;
+    takes.back().loop.pack(loop);
+    return takes.size()-1;
+}
+
+int LoopLibrary::store_scene(const std::vector<MidiEvent> *play) {
+    scenes.push_back(std::vector<PackedLoop>(16));
+    for (int i = 0; i < 16; i++) scenes.back()[i].pack(play[i]);
+    return scenes.size()-1;
+}
+
+bool LoopLibrary::recall_take(int take, int channel, std::vector<MidiEvent> *play) const {
+    if (take < 0 || take >= (int)takes.size()) return false;
+    if (channel < 0) channel = takes[take].channel;
+    if (channel > 15) return false;
+    takes[take].loop.unpack(&play[channel]);
+    return true;
+}
+
+bool LoopLibrary::recall_scene(int scene, std::vector<MidiEvent> *play) const {
+    if (scene < 0 || scene >= (int)scenes.size()) return false;
+    for (int i = 0; i < 16; i++) scenes[scene][i].unpack(&play[i]);
+    return true;
+}
+
+int LoopLibrary::take_channel(int take) const noexcept {
+    if (take < 0 || take >= (int)takes.size()) return -1;
+    return takes[take].channel;
+}
+
+size_t LoopLibrary::bytes() const noexcept {
+    size_t b = 0;
+    for (auto const& t : takes) b += t.loop.bytes();
+    for (auto const& s : scenes)
+        for (auto const& l : s) b += l.bytes();
+    return b;
+}
+
+void LoopLibrary::clear() {
+    takes.clear();
+    scenes.clear();
+}
+
+/****************************************************************
+ ** class LoopHistory
+ **
+ ** undo/redo steps for the loops
+ ** 
+ */
+
+void LoopHistory::push(const LoopBuffer *loops, unsigned int mask) {
+    redo_steps.clear();
+    while (undo_steps.size() >= max_steps) undo_steps.pop_front();
+    undo_steps.emplace_back();
+    Step& s = undo_steps.back();
+    s.mask = mask & 0xffff;
+    s.packed = false;
+    for (int c = 0; c < 16; c++) {
+        if (s.mask & (1<<c)) s.loop[c] = loops[c];
+    }
+    cool_down();
+}
+
+// expand a packed step and swap its loops with the current ones
+void LoopHistory::swap_in(Step& s, LoopBuffer *loops) {
+    for (int c = 0; c < 16; c++) {
+        if (!(s.mask & (1<<c))) continue;
+        if (s.packed) {
+            std::vector<MidiEvent> loop;
+            s.cold[c].unpack(&loop);
+            s.loop[c] = std::make_shared<const std::vector<MidiEvent> >(std::move(loop));
+            s.cold[c] = PackedLoop();
+        }
+        loops[c].swap(s.loop[c]);
+    }
+    s.packed = false;
+}
+
+// pack the steps which are far away from the current state
+void LoopHistory::cool_down() {
+    if (undo_steps.size() <= hot_steps) return;
+    for (size_t i = undo_steps.size() - hot_steps; i-- > 0;) {
+        Step& s = undo_steps[i];
+        if (s.packed) break;
+        for (int c = 0; c < 16; c++) {
+            if (!(s.mask & (1<<c))) continue;
+            s.cold[c].pack(*s.loop[c]);
+            s.loop[c].reset();
+        }
+        s.packed = true;
+    }
+}
+
+unsigned int LoopHistory::undo(LoopBuffer *loops) {
+    if (undo_steps.empty()) return 0;
+    redo_steps.push_back(std::move(undo_steps.back()));
+    undo_steps.pop_back();
+    swap_in(redo_steps.back(), loops);
+    return redo_steps.back().mask;
+}
+
+unsigned int LoopHistory::redo(LoopBuffer *loops) {
+    if (redo_steps.empty()) return 0;
+    undo_steps.push_back(std::move(redo_steps.back()));
+    redo_steps.pop_back();
+    swap_in(undo_steps.back(), loops);
+    cool_down();
+    return undo_steps.back().mask;
+}
+
+void LoopHistory::clear() {
+    undo_steps.clear();
+    redo_steps.clear();
+}
+
 /****************************************************************
  ** class MidiRecord
  **
- ** record the keyboard input in a extra thread
+ ** merge the recorded keyboard input into the loops, in the reactor thread
  ** 
  */
 
 MidiRecord::MidiRecord()
     : _execute(false),
+    reactor(NULL),
+    event_fd(-1),
+    rt_cycles(0),
+    rt_running(false),
+    dub_boundary(false),
+    dub_length(0),
+    lane_count(0),
+    overdub(false),
+    dub_channel(0),
+    omni(false),
+    omni_end(0),
     is_sorted(false) {
     st = NULL;
     channel = 0;
+    for (int i = 0; i < 16; i++) {
+        loops[i] = std::make_shared<const std::vector<MidiEvent> >();
+        live[i].store(loops[i].get(), std::memory_order_release);
+        generation[i] = 0;
+    }
 }
 
 MidiRecord::~MidiRecord() {
     if( _execute.load(std::memory_order_acquire) ) {
         stop();
     };
+    if (reactor) reactor->remove(event_fd);
+}
+
+void MidiRecord::set_reactor(Reactor *reactor_) {
+    reactor = reactor_;
+    event_fd = reactor->add_event([this] () {
+        // wake up from jack that the record vector is ready
+        if (!_execute.load(std::memory_order_acquire)) return;
+        std::unique_lock<std::mutex> lk(m);
+        merge();
+    });
+}
+
+// m must be held
+void MidiRecord::merge() {
+    if (omni.load(std::memory_order_acquire)) {
+        // the loops on all channels are recorded, so not played
+        MidiEvent e;
+        for (int c = 0; c < 16; c++) {
+            std::vector<MidiEvent>& t = omni_take[c];
+            const size_t n = t.size();
+            while (lane[c].pop(&e)) t.push_back(e);
+            if (n == t.size()) continue;
+            std::inplace_merge(t.begin(), t.begin() + n, t.end(),
+                [] (const MidiEvent& lhs, const MidiEvent& rhs) {
+                    return lhs.tick < rhs.tick;
+            });
+        }
+        return;
+    }
+    if (overdub.load(std::memory_order_acquire)) {
+        // the playing loop belong to the jack thread, collect the pass
+        dub.insert(dub.end(), st->begin(), st->end());
+        st->clear();
+        if (dub_boundary.exchange(false, std::memory_order_acq_rel)) publish_dub();
+        return;
+    }
+    // push recorded vector to the take, the take is sorted already,
+    // so only the new batch is sorted and merged in
+    auto order = [this](const MidiEvent& lhs, const MidiEvent& rhs) {
+        if (lhs.tick > rhs.tick)
+            is_sorted.store(true, std::memory_order_release);
+        return lhs.tick < rhs.tick;
+    };
+    const size_t n = take.size();
+    take.insert(take.end(), st->begin(), st->end());
+    st->clear();
+    std::sort(take.begin() + n, take.end(), order);
+    std::inplace_merge(take.begin(), take.begin() + n, take.end(), order);
+    publish(channel, take);
+}
+
+// m must be held, fold the pass into a copy of the loop
+void MidiRecord::publish_dub() {
+    if (dub.empty()) return;
+    std::vector<MidiEvent> next(*loops[dub_channel]);
+    next.reserve(next.size() + dub.size());
+    for (auto ev : dub) {
+        ev.tick %= dub_length;
+        next.push_back(ev);
+    }
+    dub.clear();
+    // the loop end stay last, all takes are folded before it
+    std::stable_sort(next.begin(), next.end(),
+            [] (const MidiEvent& lhs, const MidiEvent& rhs) {
+        return lhs.tick < rhs.tick;
+    });
+    publish(dub_channel, next);
+}
+
+// m must be held. the jack thread may still play the old loop in the
+// running cycle, so it is freed only after a later cycle finished
+void MidiRecord::publish(int c, LoopBuffer loop) {
+    reclaim();
+    retired.emplace_back(0, std::move(loops[c]));
+    loops[c] = std::move(loop);
+    // the pages may not be locked, see lock_memory()
+    prefault((void*)loops[c]->data(), loops[c]->capacity() * sizeof(MidiEvent));
+    live[c].store(loops[c].get(), std::memory_order_seq_cst);
+    retired.back().first = rt_cycles.load(std::memory_order_seq_cst);
+    generation[c].fetch_add(1, std::memory_order_release);
+}
+
+void MidiRecord::publish(int c, const std::vector<MidiEvent>& loop) {
+    publish(c, std::make_shared<const std::vector<MidiEvent> >(loop));
+}
+
+// m must be held
+void MidiRecord::reclaim() {
+    const uint32_t done = rt_cycles.load(std::memory_order_seq_cst);
+    const bool rt = rt_running.load(std::memory_order_acquire);
+    retired.erase(std::remove_if(retired.begin(), retired.end(),
+        [done, rt] (const std::pair<uint32_t, LoopBuffer>& r) {
+            return !rt || r.first != done;
+        }), retired.end());
+}
+
+void MidiRecord::set_realtime(bool running) noexcept {
+    rt_running.store(running, std::memory_order_release);
+    if (running) return;
+    std::unique_lock<std::mutex> lk(m);
+    retired.clear();
 }
 
 void MidiRecord::stop() {
+    if (!_execute.load(std::memory_order_acquire)) return;
     _execute.store(false, std::memory_order_release);
-    if (_thd.joinable()) {
-        cv.notify_one();
-        _thd.join();
+    std::unique_lock<std::mutex> lk(m);
+    // merge the last record vector,
+    // the delta times follow from the sorted vector
+    merge();
+    std::vector<MidiEvent>().swap(take);
+    if (omni.load(std::memory_order_acquire)) {
+        // all loops of the take share the start and the length. events
+        // played after the end was taken are dropped, their note offs
+        // move to the end so no note hangs
+        for (int c = 0; c < 16; c++) {
+            std::vector<MidiEvent>& t = omni_take[c];
+            if (t.empty()) continue;
+            auto end = std::lower_bound(t.begin(), t.end(), omni_end,
+                [] (const MidiEvent& ev, uint32_t tick) {
+                    return ev.tick < tick;
+            });
+            auto keep = end;
+            for (auto i = end; i != t.end(); ++i) {
+                const int status = i->buffer[0] & 0xf0;
+                if (status == 0x80 || (status == 0x90 && !i->buffer[2])) {
+                    *keep = *i;
+                    keep->tick = omni_end;
+                    ++keep;
+                }
+            }
+            t.erase(keep, t.end());
+            t.push_back({{0x80, 0, 0}, 3, omni_end});
+            publish(c, std::make_shared<const std::vector<MidiEvent> >(std::move(t)));
+            t.clear();
+        }
+        omni.store(false, std::memory_order_release);
+    }
+    if (overdub.load(std::memory_order_acquire)) {
+        publish_dub();
+        overdub.store(false, std::memory_order_release);
+    }
+}
+
+bool MidiRecord::start_omni() {
+    if( _execute.load(std::memory_order_acquire) ) {
+        stop();
+    };
+    std::unique_lock<std::mutex> lk(m);
+    history.push(loops, 0xffff);
+    for (int c = 0; c < 16; c++) publish(c, std::vector<MidiEvent>());
+    // events left over from the last take
+    MidiEvent e;
+    for (int c = 0; c < 16; c++) {
+        while (lane[c].pop(&e)) {}
+        omni_take[c].clear();
     }
+    omni.store(true, std::memory_order_release);
+    _execute.store(true, std::memory_order_release);
+    return true;
+}
+
+bool MidiRecord::start_overdub(uint32_t length) {
+    if( _execute.load(std::memory_order_acquire) ) {
+        stop();
+    };
+    std::unique_lock<std::mutex> lk(m);
+    // the last event mark the loop end
+    const std::vector<MidiEvent>& loop = *loops[channel];
+    if (loop.empty() || !loop.back().tick) return false;
+    dub_length = length ? length : loop.back().tick;
+    dub_channel = channel;
+    dub.clear();
+    dub_boundary.store(false, std::memory_order_release);
+    history.push(loops, 1<<channel);
+    overdub.store(true, std::memory_order_release);
+    _execute.store(true, std::memory_order_release);
+    return true;
 }
 
 void MidiRecord::start() {
     if( _execute.load(std::memory_order_acquire) ) {
         stop();
     };
+    std::unique_lock<std::mutex> lk(m);
+    take = *loops[channel];
     _execute.store(true, std::memory_order_release);
-    _thd = std::thread([this]() {
-        while (_execute.load(std::memory_order_acquire)) {
-            std::unique_lock<std::mutex> lk(m);
-            // wait for signal from jack that record vector is ready
-            cv.wait(lk);
-            // reserve space in play vector to push the recorded vector into
-            play[channel].reserve(play[channel].size() + st->size());
-
-            // push recorded vector to play vector
-            for (unsigned int i=0; i<st->size(); i++) 
-                play[channel].push_back((*st)[i]);
-            st->clear();
-
-            // sort vector ascending to absolute time in loop
-            std::sort( play[channel].begin(), play[channel].end(),
-                    [this](const MidiEvent& lhs, const MidiEvent& rhs) {
-                if (lhs.absoluteTime > rhs.absoluteTime)
-                    is_sorted.store(true, std::memory_order_release);
-                return lhs.absoluteTime < rhs.absoluteTime;
-            });
-        }
-        // when record stop, recalculate the delta time for sorted vector
-        double aTime = 0.0;
-        for(std::vector<MidiEvent>::iterator i = play[channel].begin();
-                                        i != play[channel].end(); ++i) {
-            (*i).deltaTime = (*i).absoluteTime - aTime;
-            aTime = (*i).absoluteTime;
-        }
-    });
 }
 
 bool MidiRecord::is_running() const noexcept {
-    return ( _execute.load(std::memory_order_acquire) && 
-             _thd.joinable() );
+    return _execute.load(std::memory_order_acquire);
+}
+
+LoopBuffer MidiRecord::loop(int c) const {
+    std::unique_lock<std::mutex> lk(m);
+    return loops[c];
+}
+
+void MidiRecord::snapshot(std::vector<MidiEvent> *play) const {
+    std::unique_lock<std::mutex> lk(m);
+    for (int c = 0; c < 16; c++) play[c] = *loops[c];
+}
+
+double MidiRecord::max_loop_time() const {
+    std::unique_lock<std::mutex> lk(m);
+    double t = 0.0;
+    for (int c = 0; c < 16; c++) {
+        if (loops[c]->empty()) continue;
+        t = std::max<double>(t, loops[c]->back().absoluteTime());
+    }
+    return t;
+}
+
+void MidiRecord::keep(unsigned int mask) {
+    std::unique_lock<std::mutex> lk(m);
+    history.push(loops, mask);
+    for (int c = 0; c < 16; c++) {
+        if (mask & (1<<c)) publish(c, std::vector<MidiEvent>());
+    }
+}
+
+void MidiRecord::replace(int c, std::vector<MidiEvent>& loop) {
+    std::unique_lock<std::mutex> lk(m);
+    history.push(loops, 1<<c);
+    publish(c, std::make_shared<const std::vector<MidiEvent> >(std::move(loop)));
+}
+
+void MidiRecord::replace(unsigned int mask, std::vector<MidiEvent> *play) {
+    std::unique_lock<std::mutex> lk(m);
+    history.push(loops, mask);
+    for (int c = 0; c < 16; c++) {
+        if (mask & (1<<c))
+            publish(c, std::make_shared<const std::vector<MidiEvent> >(std::move(play[c])));
+    }
+}
+
+void MidiRecord::set_loops(std::vector<MidiEvent> *play) {
+    std::unique_lock<std::mutex> lk(m);
+    for (int c = 0; c < 16; c++)
+        publish(c, std::make_shared<const std::vector<MidiEvent> >(std::move(play[c])));
+}
+
+unsigned int MidiRecord::undo() {
+    if (is_running()) return 0;
+    std::unique_lock<std::mutex> lk(m);
+    LoopBuffer next[16];
+    for (int c = 0; c < 16; c++) next[c] = loops[c];
+    unsigned int mask = history.undo(next);
+    for (int c = 0; c < 16; c++) {
+        if (mask & (1<<c)) publish(c, next[c]);
+    }
+    return mask;
+}
+
+unsigned int MidiRecord::redo() {
+    if (is_running()) return 0;
+    std::unique_lock<std::mutex> lk(m);
+    LoopBuffer next[16];
+    for (int c = 0; c < 16; c++) next[c] = loops[c];
+    unsigned int mask = history.redo(next);
+    for (int c = 0; c < 16; c++) {
+        if (mask & (1<<c)) publish(c, next[c]);
+    }
+    return mask;
 }
 
 } //  namespace mamba
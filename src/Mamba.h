@@ -30,11 +30,22 @@ extern "C++" {
 
 #include <atomic>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <cmath>
+#include <chrono>
+#include <string>
+#include <functional>
+#include <memory>
+#include <map>
+#include <cstring>
+
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 
 #pragma once
 
@@ -47,40 +58,575 @@ namespace mamba {
 /****************************************************************
  ** struct MidiEvent
  **
- ** store midi events in a vector
+ ** store midi events in a vector, packed to 8 bytes.
+ ** only the time from the loop start is stored, in micro seconds,
+ ** the delta time is the distance to the previous event in the vector
  ** 
  */
 
-typedef struct {
+struct MidiEvent {
     unsigned char buffer[3];
-    int num;
-    double deltaTime;
-    double absoluteTime;
-} MidiEvent;
+    uint8_t num;
+    uint32_t tick;
+
+    static constexpr double ticks_per_second = 1000000.0;
+
+    static inline uint32_t to_tick(double seconds) noexcept {
+        if (seconds <= 0.0) return 0;
+        if (seconds >= 4294.0) return 4294000000u;
+        return (uint32_t)(seconds * ticks_per_second + 0.5);
+    }
+
+    inline double absoluteTime() const noexcept {
+        return tick / ticks_per_second;
+    }
+
+    // delta time in seconds of the event at pos in a sorted vector
+    static inline double deltaTime(const std::vector<MidiEvent>& v, size_t pos) noexcept {
+        const uint32_t prev = pos ? v[pos-1].tick : 0;
+        return (v[pos].tick - prev) / ticks_per_second;
+    }
+};
+
+static_assert(sizeof(MidiEvent) == 8, "MidiEvent should stay packed");
 
 
+class EngineLink;
+
 /****************************************************************
  ** class MidiMessenger
  **
- ** create, collect and send all midi events to jack_midi out buffer
+ ** create, collect and send all midi events to jack_midi out buffer,
+ ** or to the engine process when the GUI is attached to one
  */
 
 class MidiMessenger {
 private:
     static const int max_midi_cc_cnt = 25;
+    std::atomic<EngineLink*> link;
     std::atomic<bool> send_cc[max_midi_cc_cnt];
     uint8_t cc_num[max_midi_cc_cnt];
     uint8_t pg_num[max_midi_cc_cnt];
     uint8_t bg_num[max_midi_cc_cnt];
     uint8_t me_num[max_midi_cc_cnt];
+    int64_t post_usec[max_midi_cc_cnt];
+    int64_t ui_usec[max_midi_cc_cnt];
 public:
     MidiMessenger();
     int channel;
     bool send_midi_cc(uint8_t _cc, const uint8_t _pg, const uint8_t _bgn,
-                    const uint8_t _num, const bool have_channel) noexcept;
+                    const uint8_t _num, const bool have_channel,
+                    const unsigned long xtime = 0) noexcept;
     int next(int i = -1) const noexcept;
     inline uint8_t size(const int i)  const noexcept { return me_num[i]; }
+    // time the event was queued, 0 when it didn't come from a X event
+    inline int64_t posted(const int i) const noexcept { return post_usec[i]; }
+    // X event to queue delay, -1 when the X clock isn't comparable
+    inline int64_t ui_delay(const int i) const noexcept { return ui_usec[i]; }
     void fill(unsigned char *midi_send, const int i) noexcept;
+    // send everything to the jack thread of a engine process,
+    // the ring there has one producer, so only the GUI thread may send then
+    void set_link(EngineLink *l) noexcept { link.store(l, std::memory_order_release); }
+};
+
+/****************************************************************
+ ** class SpscRing
+ **
+ ** lock free single producer, single consumer ring of plain structs,
+ ** it never allocate and hold no pointers, so it could be placed
+ ** in shared memory to talk to a other process
+ */
+
+template <typename T, uint32_t N>
+class SpscRing {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value, "ring entries must be plain data");
+public:
+    SpscRing() : head(0), tail(0), ndropped(0) {}
+    // producer side, false when the ring is full
+    inline bool push(const T& e) noexcept {
+        const uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= N) {
+            ndropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        ring[h & (N - 1)] = e;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    // consumer side, false when the ring is empty
+    inline bool pop(T *e) noexcept {
+        const uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        *e = ring[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    uint32_t dropped() const noexcept { return ndropped.load(std::memory_order_relaxed); }
+
+private:
+    T ring[N];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> ndropped;
+};
+
+/****************************************************************
+ ** struct EngineEvent
+ **
+ ** events the engine report to the GUI through a SpscRing
+ */
+
+typedef struct {
+    enum {
+        KEY_ON,
+        KEY_OFF
+    };
+    uint8_t type;
+    uint8_t channel;
+    uint8_t key;
+} EngineEvent;
+
+/****************************************************************
+ ** struct ScheduledMidi
+ **
+ ** a midi event to send at a given jack frame time
+ */
+
+typedef struct {
+    uint32_t frame;
+    uint8_t num;
+    uint8_t buffer[3];
+} ScheduledMidi;
+
+/****************************************************************
+ ** class CaptureRing
+ **
+ ** keep the last N midi events with the jack frame they came in.
+ ** the single writer never wait, it overwrite the oldest entry.
+ ** readers copy the ring and drop the entries which were
+ ** overwritten while they read
+ */
+
+typedef struct {
+    uint32_t frame;
+    uint8_t num;
+    uint8_t buffer[3];
+} CapturedMidi;
+
+template <uint32_t N>
+class CaptureRing {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+public:
+    CaptureRing() : head(0) {}
+    // writer side, one slot write per event
+    inline void push(uint32_t frame, const uint8_t *midi, uint32_t num) noexcept {
+        const uint32_t h = head.load(std::memory_order_relaxed);
+        CapturedMidi& e = ring[h & (N - 1)];
+        e.frame = frame;
+        e.num = num > 3 ? 3 : num;
+        for (uint32_t i = 0; i < 3; i++) e.buffer[i] = i < num ? midi[i] : 0;
+        head.store(h + 1, std::memory_order_release);
+    }
+    // copy the events of the last frames before now, oldest first
+    void copy(std::vector<CapturedMidi> *out, uint32_t now, uint32_t frames) const {
+        out->clear();
+        const uint32_t h = head.load(std::memory_order_acquire);
+        const uint32_t first = h > N ? h - N : 0;
+        out->reserve(h - first);
+        for (uint32_t i = first; i != h; i++) out->push_back(ring[i & (N - 1)]);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint32_t h2 = head.load(std::memory_order_relaxed);
+        // the slot of entry h2 - N may be half written already
+        const uint32_t valid = h2 >= N ? h2 - N + 1 : 0;
+        size_t skip = valid > first ? valid - first : 0;
+        if (skip > out->size()) skip = out->size();
+        while (skip < out->size() && now - (*out)[skip].frame > frames) skip++;
+        out->erase(out->begin(), out->begin() + skip);
+    }
+
+private:
+    CapturedMidi ring[N];
+    std::atomic<uint32_t> head;
+};
+
+/****************************************************************
+ ** class SeqLock
+ **
+ ** publish a plain struct from a single writer, readers copy it
+ ** without locks and retry when they overlap a write.
+ ** The data is kept in atomic words, so it could live in shared memory
+ */
+
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "seqlock data must be plain data");
+public:
+    SeqLock() : seq(0) {
+        for (size_t i = 0; i < nwords; i++) words[i].store(0, std::memory_order_relaxed);
+    }
+    void write(const T& v) noexcept {
+        uint64_t buf[nwords] = {};
+        memcpy(buf, &v, sizeof(T));
+        const uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < nwords; i++) words[i].store(buf[i], std::memory_order_relaxed);
+        seq.store(s + 2, std::memory_order_release);
+    }
+    // false when a write was in progress
+    bool try_read(T *v) const noexcept {
+        uint64_t buf[nwords];
+        const uint32_t s = seq.load(std::memory_order_acquire);
+        if (s & 1) return false;
+        for (size_t i = 0; i < nwords; i++) buf[i] = words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) != s) return false;
+        memcpy(v, buf, sizeof(T));
+        return true;
+    }
+    // the writer is never blocked, so spinning is short
+    void read(T *v) const noexcept { while (!try_read(v)) {} }
+
+private:
+    static const size_t nwords = (sizeof(T) + 7) / 8;
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> words[nwords];
+};
+
+/****************************************************************
+ ** struct EngineState
+ **
+ ** transport and looper state, published by the jack thread
+ ** every cycle through a SeqLock
+ */
+
+typedef struct {
+    // bumped when the layout change, for external readers
+    uint32_t layout;
+    uint32_t sample_rate;
+    uint64_t cycle;
+    uint32_t frame;
+    int32_t transport;
+    uint32_t bpm;
+    int32_t record;
+    int32_t play;
+    uint32_t stPlay;
+    uint32_t stStart;
+    uint32_t rcStart;
+    double loop_time;
+} EngineState;
+
+static const uint32_t engine_state_layout = 1;
+
+/****************************************************************
+ ** class StateExport
+ **
+ ** place a SeqLock<EngineState> in POSIX shared memory,
+ ** so monitoring tools could read the engine state
+ */
+
+class StateExport {
+public:
+    StateExport();
+    ~StateExport();
+    // create the shared memory object name, NULL on failure
+    SeqLock<EngineState> *open(const std::string& name);
+    void close();
+
+private:
+    std::string shm_name;
+    void *mem;
+};
+
+/****************************************************************
+ ** struct EngineCommand
+ **
+ ** looper commands the GUI send to a engine process,
+ ** value is the on/off flag, channel or BPM
+ */
+
+typedef struct {
+    enum {
+        RECORD,
+        OVERDUB,
+        OMNI,
+        PLAY,
+        CLEAR,
+        BPM,
+        CHANNEL,
+        FREEWHEEL,
+        CAPTURE,
+        UNDO,
+        REDO
+    };
+    int32_t type;
+    int32_t value;
+} EngineCommand;
+
+/****************************************************************
+ ** class EngineLink
+ **
+ ** the shared memory block of a engine process (mamba-engine) and
+ ** the GUI attached to it. Every ring has one producer and one consumer:
+ ** the GUI thread send midi to the jack thread and commands to the
+ ** engine reactor, the jack and the alsa thread report the notes they
+ ** play for the keyboard. The state is the first member, so readers
+ ** of a exported state find it at the same place
+ */
+
+static const uint32_t engine_link_layout = 1;
+
+class EngineLink {
+public:
+    EngineLink();
+    SeqLock<EngineState> state;
+    uint32_t layout;
+    std::atomic<int32_t> engine_pid;
+    std::atomic<int32_t> gui_pid;
+    SpscRing<ScheduledMidi, 1024> midi;
+    SpscRing<EngineCommand, 256> commands;
+    SpscRing<EngineEvent, 1024> jack_keys;
+    SpscRing<EngineEvent, 1024> alsa_keys;
+
+    bool engine_alive() const noexcept;
+    // take the GUI side, false while a other GUI which still runs has it.
+    // the GUI of a crashed process is replaced, so a GUI could be restarted
+    bool attach_gui() noexcept;
+    void detach_gui() noexcept;
+};
+
+/****************************************************************
+ ** class SharedLink
+ **
+ ** create the EngineLink of a engine process in POSIX shared memory,
+ ** or map the one of a running engine into the GUI
+ */
+
+class SharedLink {
+public:
+    SharedLink();
+    ~SharedLink();
+    // engine side, create the shared memory object name, NULL on failure
+    EngineLink *create(const std::string& name);
+    // GUI side, NULL when no engine with this name is running
+    EngineLink *open(const std::string& name);
+    void close();
+
+private:
+    std::string shm_name;
+    void *mem;
+    bool owner;
+};
+
+// read the loops saved with the config into play[16]
+bool read_loops(const std::string& file, std::vector<MidiEvent> *play);
+
+// monotonic clock in usec, X server and jack use the same clock source
+inline int64_t now_usec() noexcept {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// lock the pages in RAM, future ones too when the memlock limit is large,
+// false when not permitted
+bool lock_memory() noexcept;
+// touch every page of p, so the realtime thread never page faults on it
+void prefault(void *p, size_t size) noexcept;
+template <typename T>
+inline void prefault(std::vector<T>& v) noexcept {
+    prefault(v.data(), v.capacity() * sizeof(T));
+}
+
+
+/****************************************************************
+ ** class Reactor
+ **
+ ** one epoll loop in a extra thread for all non realtime work,
+ ** file descriptors, timers (timerfd), wake ups (eventfd) and
+ ** signals (signalfd) call their handler from this thread
+ */
+
+class Reactor {
+public:
+    Reactor();
+    ~Reactor();
+    // call func with the epoll events when fd is ready
+    bool add_fd(int fd, uint32_t events, std::function<void(uint32_t)> func);
+    // call func every interval ms, return the timer fd or -1
+    int add_timer(int interval, std::function<void(void)> func);
+    // call func after notify(), return the event fd or -1
+    int add_event(std::function<void(void)> func);
+    // call func for the signals in set, they must be blocked in all threads
+    int add_signals(const sigset_t *set, std::function<void(int)> func);
+    // remove a handler, a fd created by the reactor is closed,
+    // when called from a other thread, wait until the handler is done
+    void remove(int fd);
+    // wake up a add_event() handler, safe to call from the jack thread
+    static void notify(int efd) noexcept;
+    void start();
+    void stop();
+    bool is_running() const noexcept;
+    pthread_t thread_id() noexcept { return _thd.native_handle(); }
+
+private:
+    enum {
+        FD,
+        TIMER,
+        EVENT,
+        SIGNAL
+    };
+    typedef struct {
+        int kind;
+        std::function<void(uint32_t)> func;
+    } Handler;
+    int epfd;
+    int wake_fd;
+    std::atomic<bool> _execute;
+    std::thread _thd;
+    // guard the handler map
+    std::mutex m;
+    // held while a handler runs
+    std::mutex run;
+    std::map<int, std::shared_ptr<Handler> > handlers;
+    bool add(int fd, int kind, uint32_t events, std::function<void(uint32_t)> func);
+    void dispatch(int fd, uint32_t events);
+};
+
+
+/****************************************************************
+ ** class ThreadSched
+ **
+ ** scheduling policy, priority and cpu affinity per thread class,
+ ** read from the config as "[sched_<class>] <policy> <priority> <cpus>",
+ ** for example "[sched_reactor] fifo 40 2-3", "-" keep the default
+ */
+
+class ThreadSched {
+public:
+    enum {
+        JACK,
+        REACTOR,
+        GUI,
+        WORKER,
+        ALSA,
+        CLASSES
+    };
+    typedef struct {
+        // -1 keep the inherited policy
+        int policy;
+        int priority;
+        cpu_set_t cpus;
+        bool has_cpus;
+    } Setting;
+
+    ThreadSched();
+    static const char *class_name(int cls) noexcept;
+    // parse the value part of a config line, false when invalid
+    bool parse(int cls, const std::string& value);
+    // config value, empty when the class use the defaults
+    std::string to_string(int cls) const;
+    // apply the setting to thread t and report what is in effect,
+    // a class without cpus get all cpus the process started with
+    void apply(int cls, pthread_t t) const;
+    // the config set a policy for the class
+    bool has_policy(int cls) const noexcept { return setting[cls].policy >= 0; }
+
+private:
+    Setting setting[CLASSES];
+    cpu_set_t all_cpus;
+};
+
+
+/****************************************************************
+ ** class LatencyHistogram
+ **
+ ** log2 histogram of the delay from X key/button event to midi out,
+ ** split into UI handling, queue wait and cycle placement,
+ ** and of the time the jack process callback runs each cycle
+ ** written from the jack process thread, read from the GUI thread
+ */
+
+class LatencyHistogram {
+public:
+    enum {
+        UI,
+        QUEUE,
+        CYCLE,
+        TOTAL,
+        PROCESS,
+        STAGES
+    };
+    // bucket b counts delays below 2^b usec, the last one all above
+    static const int buckets = 24;
+
+    LatencyHistogram();
+    void add(const int64_t ui, const int64_t queue, const int64_t cycle) noexcept;
+    // time spent in one jack process cycle
+    void add_process(const int64_t usec) noexcept { add_stage(PROCESS, usec); }
+    void reset() noexcept;
+    // summary for the info dialog, lines are split by nl
+    std::string summary(const char nl) const;
+    // full bucket table
+    std::string dump() const;
+
+private:
+    std::atomic<uint32_t> count[STAGES][buckets];
+    std::atomic<uint64_t> sum[STAGES];
+    std::atomic<uint32_t> num[STAGES];
+    std::atomic<int64_t> peak[STAGES];
+    void add_stage(const int stage, int64_t usec) noexcept;
+    int64_t percentile(const int stage, const double p) const noexcept;
+};
+
+
+/****************************************************************
+ ** class MidiMonitor
+ **
+ ** log the midi events passing the jack and alsa in/outputs,
+ ** every source owns a single writer ring, so the writing threads
+ ** never wait, the GUI thread takes the entries from all rings
+ */
+
+class MidiMonitor {
+public:
+    enum {
+        JACK_IN,
+        JACK_OUT,
+        ALSA_IN,
+        ALSA_OUT,
+        SOURCES
+    };
+    typedef struct {
+        int64_t usec;
+        uint8_t source;
+        uint8_t num;
+        uint8_t buffer[3];
+    } Entry;
+    // entries per source, must be a power of two
+    static const uint32_t ring_size = 2048;
+
+    MidiMonitor();
+    // writers do nothing while the monitor isn't shown
+    std::atomic<bool> enabled;
+    inline void log(const int source, const uint8_t *midi, const uint32_t num) noexcept {
+        if (enabled.load(std::memory_order_relaxed)) log_event(source, midi, num);
+    }
+    // append all pending entries, ordered by time, return the count taken
+    size_t take(std::vector<Entry> *out);
+    uint64_t events(const int source) const noexcept;
+    uint64_t bytes(const int source) const noexcept;
+    // entries lost because the ring was full
+    uint64_t dropped(const int source) const noexcept;
+
+private:
+    Entry ring[SOURCES][ring_size];
+    std::atomic<uint32_t> head[SOURCES];
+    std::atomic<uint32_t> tail[SOURCES];
+    std::atomic<uint64_t> nevents[SOURCES];
+    std::atomic<uint64_t> nbytes[SOURCES];
+    std::atomic<uint64_t> ndropped[SOURCES];
+    void log_event(const int source, const uint8_t *midi, const uint32_t num) noexcept;
 };
 
 
@@ -98,7 +644,6 @@ private:
     smf_event_t *smf_event;
     MidiEvent ev;
     void reset_smf();
-    double deltaTime;
     double absoluteTime;
     bool load_file(std::vector<MidiEvent> *play, int *song_bpm, const char* file_name);
 
@@ -137,31 +682,208 @@ public:
 };
 
 
+/****************************************************************
+ ** class PackedLoop
+ **
+ ** cold storage for a loop which isn't playing, the events are
+ ** delta time varint coded with running status, like in a SMF track.
+ ** a note event takes 3 - 4 bytes instead of 8
+ ** 
+ */
+
+class PackedLoop {
+private:
+    std::vector<uint8_t> data;
+    uint32_t count;
+
+public:
+    PackedLoop() : count(0) {}
+    void pack(const std::vector<MidiEvent>& loop);
+    // expand into the hot format, loop is replaced
+    void unpack(std::vector<MidiEvent> *loop) const;
+    size_t size() const noexcept { return count; }
+    size_t bytes() const noexcept { return data.size(); }
+    bool empty() const noexcept { return !count; }
+};
+
+
+/****************************************************************
+ ** class LoopLibrary
+ **
+ ** keep stored takes and scenes (all 16 loops) packed in memory,
+ ** they are expanded only when recalled
+ ** 
+ */
+
+class LoopLibrary {
+private:
+    typedef struct {
+        int channel;
+        PackedLoop loop;
+    } Take;
+    std::vector<Take> takes;
+    std::vector<std::vector<PackedLoop> > scenes;
+
+public:
+    // return the index of the stored take or scene
+    int store_take(int channel, const std::vector<MidiEvent>& loop);
+    int store_scene(const std::vector<MidiEvent> *play);
+    // channel -1 recall the take to the channel it was recorded on
+    bool recall_take(int take, int channel, std::vector<MidiEvent> *play) const;
+    bool recall_scene(int scene, std::vector<MidiEvent> *play) const;
+    int take_channel(int take) const noexcept;
+    size_t num_takes() const noexcept { return takes.size(); }
+    size_t num_scenes() const noexcept { return scenes.size(); }
+    size_t bytes() const noexcept;
+    void clear();
+};
+
+
+/****************************************************************
+ ** class LoopHistory
+ **
+ ** undo/redo steps for the loops. the loops are immutable buffers,
+ ** so a step only hold a reference to the buffers it replaced, for the
+ ** channels which changed. undo and redo swap the references with the
+ ** current ones, so they are O(1). steps older than hot_steps are
+ ** packed, like the LoopLibrary
+ ** 
+ */
+
+typedef std::shared_ptr<const std::vector<MidiEvent> > LoopBuffer;
+
+class LoopHistory {
+private:
+    struct Step {
+        unsigned int mask;
+        bool packed;
+        LoopBuffer loop[16];
+        PackedLoop cold[16];
+    };
+    std::deque<Step> undo_steps;
+    std::deque<Step> redo_steps;
+    void swap_in(Step& s, LoopBuffer *loops);
+    void cool_down();
+
+public:
+    static const size_t max_steps = 64;
+    static const size_t hot_steps = 8;
+    // keep the loops in mask, before they get replaced
+    void push(const LoopBuffer *loops, unsigned int mask);
+    // return the mask of the channels which changed, 0 when nothing to do
+    unsigned int undo(LoopBuffer *loops);
+    unsigned int redo(LoopBuffer *loops);
+    bool can_undo() const noexcept { return !undo_steps.empty(); }
+    bool can_redo() const noexcept { return !redo_steps.empty(); }
+    void clear();
+};
+
+
 /****************************************************************
  ** class MidiRecord
  **
- ** record the keyboard input in a extra thread
+ ** merge the recorded keyboard input into the loops, in the reactor thread.
+ ** owns the loops, a changed loop is published to the jack thread as a
+ ** new buffer, the old one is freed once the jack thread finished the
+ ** cycle which could still play it
  ** 
  */
 
 class MidiRecord {
 private:
     std::atomic<bool> _execute;
-    std::thread _thd;
-    std::mutex m;
+    Reactor *reactor;
+    int event_fd;
+    mutable std::mutex m;
+    LoopHistory history;
+    // the current loops, guarded by m
+    LoopBuffer loops[16];
+    // what the jack thread play, always loops[c].get()
+    std::atomic<const std::vector<MidiEvent>*> live[16];
+    // jack cycles finished, buffers replaced before are safe to free
+    std::atomic<uint32_t> rt_cycles;
+    std::atomic<bool> rt_running;
+    std::vector<std::pair<uint32_t, LoopBuffer> > retired;
+    // the take on channel, owned by the record thread
+    std::vector<MidiEvent> take;
+    // overdub, the takes of a pass are merged with the loop
+    // at each loop end and published as a new loop
+    std::atomic<bool> dub_boundary;
+    uint32_t dub_length;
+    std::vector<MidiEvent> dub;
+    // omni record, one lane per channel filled by the jack thread,
+    // collected in omni_take and published when the take stop
+    SpscRing<MidiEvent, 2048> lane[16];
+    std::vector<MidiEvent> omni_take[16];
+    uint32_t lane_count;
+    void merge();
+    void publish_dub();
+    void publish(int channel, LoopBuffer loop);
+    void publish(int channel, const std::vector<MidiEvent>& loop);
+    void reclaim();
 
 public:
     MidiRecord();
     ~MidiRecord();
     int channel;
+    void set_reactor(Reactor *reactor);
     void stop();
     void start();
+    // overdub the loop on channel, false when there is no loop to play
+    // length in ticks to fold the takes to, 0 for the loop length
+    bool start_overdub(uint32_t length);
+    std::atomic<bool> overdub;
+    int dub_channel;
+    // record all channels at once into their own loops
+    bool start_omni();
+    std::atomic<bool> omni;
+    // the loop end of a omni take, set before stop()
+    uint32_t omni_end;
+    // demux a recorded event by its channel, called from the jack thread
+    inline void lane_push(const MidiEvent& ev) noexcept {
+        const int c = ev.buffer[0] < 0xf0 ? ev.buffer[0] & 0x0f : channel;
+        lane[c].push(ev);
+        if (!(++lane_count & 127)) notify();
+    }
+    // the overdubbed loop wrapped, called from the jack thread
+    inline void dub_pass() noexcept {
+        dub_boundary.store(true, std::memory_order_release);
+        notify();
+    }
+    // the record vector is ready to merge, called from the jack thread
+    inline void notify() noexcept { if (event_fd >= 0) Reactor::notify(event_fd); }
+    // the loop the jack thread should play, load it once per cycle
+    inline const std::vector<MidiEvent>* live_loop(int c) const noexcept {
+        return live[c].load(std::memory_order_seq_cst);
+    }
+    // the jack thread doesn't use a loaded loop anymore, end of each cycle
+    inline void cycle_done() noexcept {
+        rt_cycles.fetch_add(1, std::memory_order_seq_cst);
+    }
+    // while the jack thread doesn't run, replaced buffers are freed at once
+    void set_realtime(bool running) noexcept;
     std::atomic<bool> is_sorted;
+    // bumped whenever the loop on a channel was replaced
+    std::atomic<unsigned int> generation[16];
     bool is_running() const noexcept;
-    std::condition_variable cv;
+    // the loop on channel, for the non realtime threads
+    LoopBuffer loop(int channel) const;
+    // copy of all loops, for saving them
+    void snapshot(std::vector<MidiEvent> *play) const;
+    // length of the longest loop in seconds
+    double max_loop_time() const;
+    // empty the loops in mask, the old ones are kept for undo
+    void keep(unsigned int mask);
+    // replace the loop on channel with loop, the old one is kept for undo
+    void replace(int channel, std::vector<MidiEvent>& loop);
+    // replace the loops in mask with the ones from play
+    void replace(unsigned int mask, std::vector<MidiEvent> *play);
+    // replace all loops without a undo step, on start up
+    void set_loops(std::vector<MidiEvent> *play);
+    unsigned int undo();
+    unsigned int redo();
     MidiEvent ev;
     std::vector<MidiEvent> *st;
-    std::vector<MidiEvent> play[16];
 };
 
 
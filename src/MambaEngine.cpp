@@ -0,0 +1,299 @@
+/*
+ *                           0BSD
+ *
+ *                    BSD Zero Clause License
+ *
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <sigc++/sigc++.h>
+
+#ifdef ENABLE_NLS
+#include <libintl.h>
+#include <clocale>
+#define _(S) gettext(S)
+#else
+#define _(S) S
+#endif
+
+#include "Mamba.h"
+#include "XJack.h"
+#include "XAlsa.h"
+#include "XSynth.h"
+#include "XOsc.h"
+#include "XAllocCheck.h"
+
+
+namespace mambaengine {
+
+
+/****************************************************************
+ ** class EngineControl
+ **
+ ** the settings the engine take from the Mamba config and
+ ** the quit request from the signals, OSC and jack
+ */
+
+class EngineControl : public sigc::trackable {
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    bool quit_requested;
+
+public:
+    EngineControl();
+    std::string config_file;
+    std::string soundfont;
+    int mchannel;
+    int volume;
+    int song_bpm;
+    mamba::ThreadSched sched;
+
+    // the lines of the GUI config the engine use, the rest is left to the GUI
+    void read_config(xsynth::XSynth *xsynth);
+    void quit();
+    void wait_quit();
+};
+
+EngineControl::EngineControl()
+    : quit_requested(false),
+    mchannel(0),
+    volume(63),
+    song_bpm(120) {
+    if (getenv("XDG_CONFIG_HOME")) {
+        config_file = std::string(getenv("XDG_CONFIG_HOME")) + "/Mamba.conf";
+    } else {
+        config_file = std::string(getenv("HOME")) + "/.config/Mamba.conf";
+    }
+}
+
+void EngineControl::read_config(xsynth::XSynth *xsynth) {
+    std::ifstream infile(config_file);
+    if (!infile.is_open()) return;
+    std::string line;
+    std::string key;
+    std::string value;
+    while (std::getline(infile, line)) {
+        std::istringstream buf(line);
+        buf >> key;
+        buf >> value;
+        if (key.compare("[mchannel]") == 0) mchannel = std::stoi(value);
+        else if (key.compare("[volume]") == 0) volume = std::stoi(value);
+        else if (key.compare("[soundfont]") == 0) soundfont = line.substr(key.size() + 1);
+        else if (key.compare("[reverb_on]") == 0) xsynth->reverb_on = std::stoi(value);
+        else if (key.compare("[reverb_level]") == 0) xsynth->reverb_level = std::stof(value);
+        else if (key.compare("[reverb_width]") == 0) xsynth->reverb_width = std::stof(value);
+        else if (key.compare("[reverb_damp]") == 0) xsynth->reverb_damp = std::stof(value);
+        else if (key.compare("[reverb_roomsize]") == 0) xsynth->reverb_roomsize = std::stof(value);
+        else if (key.compare("[chorus_on]") == 0) xsynth->chorus_on = std::stoi(value);
+        else if (key.compare("[chorus_type]") == 0) xsynth->chorus_type = std::stoi(value);
+        else if (key.compare("[chorus_depth]") == 0) xsynth->chorus_depth = std::stof(value);
+        else if (key.compare("[chorus_speed]") == 0) xsynth->chorus_speed = std::stof(value);
+        else if (key.compare("[chorus_level]") == 0) xsynth->chorus_level = std::stof(value);
+        else if (key.compare("[chorus_voices]") == 0) xsynth->chorus_voices = std::stoi(value);
+        else if (key.compare("[channel_instruments]") == 0) {
+            for (int i = 0; i < 15; i++) {
+                xsynth->channel_instrument[i] = std::stoi(value);
+                buf >> value;
+            }
+            xsynth->channel_instrument[15] = std::stoi(value);
+        } else if (key.compare(0, 7, "[sched_") == 0) {
+            for (int c = 0; c < mamba::ThreadSched::CLASSES; c++) {
+                std::string sk = std::string("[sched_") + mamba::ThreadSched::class_name(c) + "]";
+                if (key.compare(sk) == 0) sched.parse(c, line.substr(sk.size() + 1));
+            }
+        }
+        key.clear();
+        value.clear();
+    }
+    infile.close();
+}
+
+void EngineControl::quit() {
+    std::lock_guard<std::mutex> lk(m);
+    quit_requested = true;
+    cv.notify_all();
+}
+
+void EngineControl::wait_quit() {
+    std::unique_lock<std::mutex> lk(m);
+    cv.wait(lk, [this] {return quit_requested;});
+}
+
+} // namespace mambaengine
+
+
+/****************************************************************
+ ** main
+ **
+ ** run jack, alsa, the looper and fluidsynth without X11,
+ ** a Mamba GUI started with --engine attach to it
+ **
+ **   mamba-engine [--name client] [--osc-port port] [--soundfont file]
+ **                [--channel n] [--bpm n] [file.mid]
+ */
+
+int main (int argc, char *argv[]) {
+
+#ifdef ENABLE_NLS
+    std::setlocale (LC_MESSAGES, "");
+    std::setlocale (LC_CTYPE, "C");
+    bindtextdomain(GETTEXT_PACKAGE, LOCAL_DIR);
+    bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+    textdomain(GETTEXT_PACKAGE);
+#endif
+
+    alloccheck::init();
+
+    mambaengine::EngineControl control;
+    xsynth::XSynth xsynth;
+    control.read_config(&xsynth);
+
+    std::string client_name = "Mamba";
+    const char *osc_port = "7700";
+    const char *midi_file = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--name") == 0 && i+1 < argc) client_name = argv[++i];
+        else if (strcmp(argv[i], "--osc-port") == 0 && i+1 < argc) osc_port = argv[++i];
+        else if (strcmp(argv[i], "--soundfont") == 0 && i+1 < argc) control.soundfont = argv[++i];
+        else if (strcmp(argv[i], "--channel") == 0 && i+1 < argc) control.mchannel = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bpm") == 0 && i+1 < argc) control.song_bpm = std::max(1, atoi(argv[++i]));
+        else if (!midi_file) midi_file = argv[i];
+    }
+
+    // block the signals before the reactor threads are created,
+    // every later thread inherit the mask
+    sigset_t waitset;
+    sigemptyset(&waitset);
+    sigaddset(&waitset, SIGINT);
+    sigaddset(&waitset, SIGQUIT);
+    sigaddset(&waitset, SIGTERM);
+    sigaddset(&waitset, SIGHUP);
+    sigprocmask(SIG_BLOCK, &waitset, NULL);
+
+    mamba::Reactor reactor;
+    int signal_fd = reactor.add_signals(&waitset, [&control] (int sig) {
+        fprintf(stderr, "Quit by signal %i\n", sig);
+        control.quit();});
+    if (signal_fd < 0) fprintf(stderr, "Couldn't watch for posix signals\n");
+    reactor.start();
+    control.sched.apply(mamba::ThreadSched::REACTOR, reactor.thread_id());
+    mamba::Reactor midi_reactor;
+    midi_reactor.start();
+
+    mamba::MidiMessenger mmessage;
+    xalsa::XAlsa xalsa([&mmessage]
+        (int _cc, int _pg, int _bgn, int _num, bool have_channel) noexcept
+        {mmessage.send_midi_cc( _cc, _pg, _bgn, _num, have_channel);}, &midi_reactor);
+    xjack::XJack xjack(&mmessage,
+        [&xalsa] (const uint8_t* m ,uint8_t n ) noexcept {xalsa.xalsa_output_notify(m,n);},
+        &reactor);
+    xalsa.xalsa_set_monitor(&xjack.monitor);
+    xjack.client_name = client_name;
+    xjack.signal_trigger_quit_by_jack().connect(
+        sigc::mem_fun(control, &mambaengine::EngineControl::quit));
+
+    std::vector<mamba::MidiEvent> loops[16];
+    if (mamba::read_loops(control.config_file + "vec", loops)) xjack.rec.set_loops(loops);
+
+    if (!xjack.open_jack()) {
+        midi_reactor.stop();
+        reactor.stop();
+        exit (1);
+    }
+    // jack may have renamed the client, the GUI look for the shm by this name
+    xjack.client_name = jack_get_client_name(xjack.client);
+    mamba::SharedLink shared;
+    mamba::EngineLink *link = shared.create("mamba-" + xjack.client_name);
+    if (!link) {
+        jack_client_close (xjack.client);
+        midi_reactor.stop();
+        reactor.stop();
+        exit (1);
+    }
+    xjack.attach_link(link);
+
+    if (xalsa.xalsa_init("Mamba", "input", "output") >= 0) {
+        xalsa.xalsa_start([link] (int channel, int key, bool set) {
+            link->alsa_keys.push(mamba::EngineEvent{
+                uint8_t(set ? mamba::EngineEvent::KEY_ON : mamba::EngineEvent::KEY_OFF),
+                uint8_t(channel & 0x0f), uint8_t(key)});});
+    } else {
+        fprintf(stderr, _("Couldn't open a alsa port, is the alsa sequencer running?\n"));
+    }
+
+    if (xjack.activate_jack()) {
+        control.sched.apply(mamba::ThreadSched::JACK, jack_client_thread_id(xjack.client));
+        if (!control.sched.has_policy(mamba::ThreadSched::ALSA) && xjack.rt_priority() > 2)
+            xalsa.xalsa_set_priority(xjack.rt_priority());
+        control.sched.apply(mamba::ThreadSched::ALSA, midi_reactor.thread_id());
+
+        std::future<void> synth_loader;
+        if (!control.soundfont.empty()) {
+            synth_loader = std::async(std::launch::async, [&] () {
+                control.sched.apply(mamba::ThreadSched::WORKER, pthread_self());
+                if (xsynth.load(xjack.SampleRate, control.soundfont.c_str())) {
+                    fprintf(stderr, _("Couldn't load soundfont %s\n"), control.soundfont.c_str());
+                    return;
+                }
+                xjack.connect_synth();
+                mmessage.send_midi_cc(0xB0, 7, control.volume, 3, false);
+            });
+        }
+
+        xosc::OscControl osc(&xjack, &xsynth, &mmessage, &reactor);
+        if (osc.init(osc_port, control.mchannel, control.song_bpm)) {
+            osc.signal_trigger_quit_by_osc().connect(
+                sigc::mem_fun(control, &mambaengine::EngineControl::quit));
+            if (midi_file) osc.load_file(midi_file);
+        }
+        osc.attach_link(link);
+        fprintf(stderr, _("engine %s running, attach the GUI with: mamba --engine %s\n"),
+                        xjack.client_name.c_str(), xjack.client_name.c_str());
+
+        control.wait_quit();
+
+        osc.close();
+        if (synth_loader.valid()) synth_loader.wait();
+        // the jack thread notify the alsa output until the client is gone
+        jack_client_close (xjack.client);
+        xalsa.xalsa_stop();
+        xsynth.unload_synth();
+    } else {
+        jack_client_close (xjack.client);
+        xalsa.xalsa_stop();
+    }
+    // a attached GUI see the engine is gone
+    link->engine_pid.store(0, std::memory_order_release);
+    shared.close();
+    reactor.remove(signal_fd);
+    midi_reactor.stop();
+    reactor.stop();
+    exit (0);
+}
@@ -30,44 +30,114 @@ namespace midikeyboard {
 /****************************************************************
  ** class AnimatedKeyBoard
  **
- ** animate midi input from jack on the keyboard in a extra thread
+ ** animate midi input from jack on the keyboard with a timer in the reactor
  ** 
  */
 
-AnimatedKeyBoard::AnimatedKeyBoard() 
-    :_execute(false) {
+AnimatedKeyBoard::AnimatedKeyBoard(mamba::Reactor *reactor_) 
+    : reactor(reactor_),
+    timer_fd(-1) {
 }
 
 AnimatedKeyBoard::~AnimatedKeyBoard() {
-    if( _execute.load(std::memory_order_acquire) ) {
-        stop();
-    };
+    stop();
 }
 
 void AnimatedKeyBoard::stop() {
-    _execute.store(false, std::memory_order_release);
-    if (_thd.joinable()) {
-        _thd.join();
-    }
+    reactor->remove(timer_fd.exchange(-1, std::memory_order_acq_rel));
 }
 
 void AnimatedKeyBoard::start(int interval, std::function<void(void)> func) {
-    if( _execute.load(std::memory_order_acquire) ) {
-        stop();
-    };
-    _execute.store(true, std::memory_order_release);
-    _thd = std::thread([this, interval, func]() {
-        while (_execute.load(std::memory_order_acquire)) {
-            func();                   
-            std::this_thread::sleep_for(
-                std::chrono::milliseconds(interval));
-        }
-    });
+    stop();
+    timer_fd.store(reactor->add_timer(interval, func), std::memory_order_release);
 }
 
 bool AnimatedKeyBoard::is_running() const noexcept {
-    return ( _execute.load(std::memory_order_acquire) && 
-             _thd.joinable() );
+    return timer_fd.load(std::memory_order_acquire) >= 0;
+}
+
+
+/****************************************************************
+ ** class UiCommandQueue
+ **
+ ** post redraw commands from any thread to the GUI thread
+ ** 
+ */
+
+UiCommandQueue::UiCommandQueue()
+    : pending(0),
+    wake_dpy(NULL),
+    main_dpy(NULL),
+    target(0),
+    frame_atom(None) {
+}
+
+UiCommandQueue::~UiCommandQueue() {
+    close();
+}
+
+void UiCommandQueue::init(Display *dpy, Window w) {
+    {
+        std::lock_guard<std::mutex> lk(wake_mutex);
+        main_dpy = dpy;
+        target = w;
+        frame_atom = XInternAtom(dpy, "_MAMBA_UI_FRAME", False);
+        wake_dpy = XOpenDisplay(DisplayString(dpy));
+        if (!wake_dpy)
+            fprintf(stderr, "UiCommandQueue: couldn't open wake connection, use main Display\n");
+    }
+    // commands posted before the GUI exists are still pending
+    if (pending.load(std::memory_order_acquire)) wake();
+}
+
+void UiCommandQueue::close() {
+    std::lock_guard<std::mutex> lk(wake_mutex);
+    if (wake_dpy) XCloseDisplay(wake_dpy);
+    wake_dpy = NULL;
+    main_dpy = NULL;
+}
+
+void UiCommandQueue::post(unsigned int cmd) {
+    // only the post which turns the queue non empty needs to wake the GUI
+    if (pending.fetch_or(cmd, std::memory_order_acq_rel) == 0) wake();
+}
+
+unsigned int UiCommandQueue::take() noexcept {
+    return pending.exchange(0, std::memory_order_acq_rel);
+}
+
+bool UiCommandQueue::is_frame_event(XEvent *xev) const noexcept {
+    return xev->type == ClientMessage && frame_atom != None &&
+            xev->xclient.message_type == frame_atom;
+}
+
+unsigned int UiCommandQueue::wait() {
+    std::unique_lock<std::mutex> lk(wake_mutex);
+    wake_cv.wait(lk, [this] () {return pending.load(std::memory_order_acquire) != 0;});
+    return take();
+}
+
+void UiCommandQueue::wake() {
+    std::lock_guard<std::mutex> lk(wake_mutex);
+    if (!main_dpy) {
+        wake_cv.notify_all();
+        return;
+    }
+    XEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.xclient.type = ClientMessage;
+    ev.xclient.window = target;
+    ev.xclient.message_type = frame_atom;
+    ev.xclient.format = 32;
+    if (wake_dpy) {
+        XSendEvent(wake_dpy, target, False, NoEventMask, &ev);
+        XFlush(wake_dpy);
+    } else {
+        XLockDisplay(main_dpy);
+        XSendEvent(main_dpy, target, False, NoEventMask, &ev);
+        XFlush(main_dpy);
+        XUnlockDisplay(main_dpy);
+    }
 }
 
 
@@ -103,7 +173,15 @@ XKeyBoard::XKeyBoard(xjack::XJack *xjack_, xalsa::XAlsa *xalsa_, xsynth::XSynth
         keymap_file =  path +"/.config/Mamba.keymap";
         multikeymap_file =  path +"/.config/Mamba.multikeymap";
     }
+    win = NULL;
+    link = NULL;
+    engine_lost = false;
+    memset(&last_state, 0, sizeof(last_state));
     fs_instruments = NULL;
+    fs_soundfont = NULL;
+    instruments_dirty = true;
+    soundfonts_dirty = true;
+    synth_loading = false;
     soundfontpath = getenv("HOME");
     has_config = false;
     main_x = 0;
@@ -121,8 +199,12 @@ XKeyBoard::XKeyBoard(xjack::XJack *xjack_, xalsa::XAlsa *xalsa_, xsynth::XSynth
     octave = 2;
     mchannel = 0;
     freewheel = 0;
+    overdub = 0;
+    omni = 0;
     lchannels = 0;
     run_one_more = 0;
+    time_line_skip = 8;
+    win_event_loop = NULL;
     need_save = false;
     pitch_scroll = false;
     view_has_changed = false;
@@ -151,9 +233,6 @@ XKeyBoard::XKeyBoard(xjack::XJack *xjack_, xalsa::XAlsa *xalsa_, xsynth::XSynth
     xsig.signal_trigger_kill_by_posix().connect(
         sigc::mem_fun(this, &XKeyBoard::exit_handle));
 
-    xjack->signal_trigger_get_midi_in().connect(
-        sigc::mem_fun(this, &XKeyBoard::get_midi_in));
-
     xjack->signal_trigger_quit_by_jack().connect(
         sigc::mem_fun(this, &XKeyBoard::quit_by_jack));
 }
@@ -187,6 +266,8 @@ void XKeyBoard::set_config(const char *name, const char *client_id, bool op_gui)
     try_path += ".config";
     if (access(try_path.c_str(), F_OK) == -1 ) {
         read_config();
+        std::vector<mamba::MidiEvent> loops[16];
+        if (read_loops(loops)) xjack->rec.set_loops(loops);
     }
     path = name;
     config_file = path + ".config";
@@ -222,6 +303,8 @@ void XKeyBoard::read_config() {
             else if (key.compare("[octave]") == 0) octave = std::stoi(value);
             else if (key.compare("[volume]") == 0) volume = std::stoi(value);
             else if (key.compare("[freewheel]") == 0) freewheel = std::stoi(value);
+            else if (key.compare("[overdub]") == 0) overdub = std::stoi(value);
+            else if (key.compare("[omni]") == 0) omni = std::stoi(value);
             else if (key.compare("[lchannels]") == 0) lchannels = std::stoi(value);
             else if (key.compare("[soundfontpath]") == 0) soundfontpath = remove_sub(line, "[soundfontpath] ");
             else if (key.compare("[soundfont]") == 0) soundfont = remove_sub(line, "[soundfont] ");
@@ -244,6 +327,12 @@ void XKeyBoard::read_config() {
                 xsynth->channel_instrument[15] = std::stoi(value);
             } else if (key.compare("[recent_files]") == 0) recent_files.push_back(remove_sub(line, "[recent_files] "));
             else if (key.compare("[recent_sfonts]") == 0) recent_sfonts.push_back(remove_sub(line, "[recent_sfonts] "));
+            else if (key.compare(0, 7, "[sched_") == 0) {
+                for (int c = 0; c < mamba::ThreadSched::CLASSES; c++) {
+                    std::string sk = std::string("[sched_") + mamba::ThreadSched::class_name(c) + "]";
+                    if (key.compare(sk) == 0) sched.parse(c, remove_sub(line, sk + " "));
+                }
+            }
             key.clear();
             value.clear();
         }
@@ -251,33 +340,6 @@ void XKeyBoard::read_config() {
         has_config = true;
     }
 
-    std::ifstream vinfile(config_file+"vec");
-    if (vinfile.is_open()) {
-        mamba::MidiEvent ev;
-        int word = 0;
-        double time = 0;
-        std::getline(vinfile, line);
-        for (int j = 0; j < 16; j++) {
-            while (std::getline(vinfile, line)) {
-                std::istringstream buf(line);
-                if(line.find("CHANNEL") != std::string::npos) break;
-                buf >> word;
-                ev.buffer[0] = word;
-                buf >> word;
-                ev.buffer[1] = word;
-                buf >> word;
-                ev.buffer[2] = word;
-                buf >> word;
-                ev.num = word;
-                buf >> time;
-                ev.deltaTime = time;
-                buf >> time;
-                ev.absoluteTime = time;
-                xjack->rec.play[j].push_back(ev);
-            }
-        }
-        vinfile.close();
-    }
     // convert old custom keymap to new format when needed
     if( access(keymap_file.data(), F_OK ) != -1 ) {
         fprintf(stderr, "old keymap file found %s\n", keymap_file.data());
@@ -320,6 +382,12 @@ void XKeyBoard::read_config() {
     }
 }
 
+// read the loops saved with the config into play[16],
+// doesn't touch anything else, so it could run in a worker thread
+bool XKeyBoard::read_loops(std::vector<mamba::MidiEvent> *play) {
+    return mamba::read_loops(config_file+"vec", play);
+}
+
 void XKeyBoard::save_config() {
     if(nsmsig.nsm_session_control)
         XLockDisplay(win->app->dpy);
@@ -340,6 +408,8 @@ void XKeyBoard::save_config() {
          outfile << "[octave] " << octave << std::endl;
          outfile << "[volume] " << volume << std::endl;
          outfile << "[freewheel] " << freewheel << std::endl;
+         outfile << "[overdub] " << overdub << std::endl;
+         outfile << "[omni] " << omni << std::endl;
          outfile << "[lchannels] " << lchannels << std::endl;
          outfile << "[soundfontpath] " << soundfontpath << std::endl;
          outfile << "[soundfont] " << soundfont << std::endl;
@@ -365,16 +435,25 @@ void XKeyBoard::save_config() {
          for (auto i : recent_sfonts) {
              outfile << "[recent_sfonts] "  << i << std::endl;
          }
+         for (int c = 0; c < mamba::ThreadSched::CLASSES; c++) {
+             std::string value = sched.to_string(c);
+             if (!value.empty())
+                 outfile << "[sched_" << mamba::ThreadSched::class_name(c) << "] " << value << std::endl;
+         }
          outfile.close();
     }
-    if (need_save ) {
+    // the loops of a engine process stay with it, save them over OSC
+    if (need_save && !link) {
         std::ofstream outfile(config_file+"vec");
         if (outfile.is_open()) {
             for (int j = 0; j < 16; j++) {
                 outfile << "[CHANNEL" << j << "]"  << std::endl;
-                for(std::vector<mamba::MidiEvent>::const_iterator i = xjack->rec.play[j].begin(); i != xjack->rec.play[j].end(); ++i) {
-                    outfile << (int)(*i).buffer[0] << " " << (int)(*i).buffer[1] << " " 
-                        << (int)(*i).buffer[2] << " " << (*i).num << " " << (*i).deltaTime << " " << (*i).absoluteTime << std::endl;
+                const mamba::LoopBuffer loop = xjack->rec.loop(j);
+                const std::vector<mamba::MidiEvent>& play = *loop;
+                for(size_t i = 0; i < play.size(); ++i) {
+                    outfile << (int)play[i].buffer[0] << " " << (int)play[i].buffer[1] << " " 
+                        << (int)play[i].buffer[2] << " " << (int)play[i].num << " "
+                        << mamba::MidiEvent::deltaTime(play, i) << " " << play[i].absoluteTime() << std::endl;
                 }
             }
             outfile.close();
@@ -390,20 +469,11 @@ inline void dummy_callback(void *w_, void* user_data) {
 }
 
 void XKeyBoard::nsm_show_ui() {
-    XLockDisplay(win->app->dpy);
-    widget_show_all(win);
-    XFlush(win->app->dpy);
-    XMoveWindow(win->app->dpy,win->widget, main_x, main_y);
-    nsmsig.trigger_nsm_gui_is_shown();
-    XUnlockDisplay(win->app->dpy);
+    uiq.post(UI_SHOW);
 }
 
 void XKeyBoard::nsm_hide_ui() {
-    XLockDisplay(win->app->dpy);
-    widget_hide(win);
-    XFlush(win->app->dpy);
-    nsmsig.trigger_nsm_gui_is_hidden();
-    XUnlockDisplay(win->app->dpy);
+    uiq.post(UI_HIDE);
 }
 
 void XKeyBoard::show_ui(int present) {
@@ -421,17 +491,50 @@ void XKeyBoard::show_ui(int present) {
     }
 }
 
-void XKeyBoard::get_midi_in(int c, int n, bool on) {
+void XKeyBoard::get_midi_in() {
     MidiKeyboard *keys = (MidiKeyboard*)wid->parent_struct;
-    set_key_in_matrix(keys->in_key_matrix[c], n, on);
+    mamba::EngineEvent ev;
+    while (xjack->pop_key(&ev)) {
+        set_key_in_channel(&keys->in_key_matrix, ev.channel, ev.key,
+                                ev.type == mamba::EngineEvent::KEY_ON);
+    }
 }
 
 void XKeyBoard::quit_by_jack() {
     fprintf (stderr, "Quit by jack \n");
-    XLockDisplay(win->app->dpy);
-    quit(win);
-    XFlush(win->app->dpy);
-    XUnlockDisplay(win->app->dpy);
+    uiq.post(UI_QUIT);
+}
+
+void XKeyBoard::quit_by_osc() {
+    fprintf (stderr, "Quit by OSC \n");
+    uiq.post(UI_QUIT);
+}
+
+void XKeyBoard::quit_by_engine() {
+    fprintf (stderr, "Quit, the engine is gone \n");
+    uiq.post(UI_QUIT);
+}
+
+void XKeyBoard::attach_engine(mamba::EngineLink *l) {
+    link = l;
+    xjack->attach_link(l);
+    mmessage->set_link(l);
+    to_engine(mamba::EngineCommand::CHANNEL, mchannel > 15 ? 0 : mchannel);
+}
+
+bool XKeyBoard::to_engine(int type, int value) noexcept {
+    if (!link) return false;
+    if (!link->commands.push(mamba::EngineCommand{type, value}))
+        fprintf(stderr, "engine command queue full, drop command\n");
+    return true;
+}
+
+bool XKeyBoard::engine_owns() {
+    if (!link) return false;
+    Widget_t *dia = open_message_dialog(win, INFO_BOX, _("Mamba engine"),
+        _("This runs in the engine process, use its OSC control"), NULL);
+    XSetTransientForHint(win->app->dpy, dia->widget, win->widget);
+    return true;
 }
 
 // static
@@ -825,7 +928,8 @@ void XKeyBoard::init_ui(Xputty *app) {
     win = create_window(app, DefaultRootWindow(app->dpy), 0, 0, 700, 265);
     XSelectInput(win->app->dpy, win->widget,StructureNotifyMask|ExposureMask|KeyPressMask 
                     |EnterWindowMask|LeaveWindowMask|ButtonReleaseMask|KeyReleaseMask
-                    |ButtonPressMask|Button1MotionMask|PointerMotionMask);
+                    |ButtonPressMask|Button1MotionMask|PointerMotionMask
+                    |FocusChangeMask);
     widget_set_icon_from_png(win,icon,LDVAR(midikeyboard_png));
     std::string tittle = client_name + _(" - Virtual Midi Keyboard");
     widget_set_title(win, tittle.c_str());
@@ -976,12 +1080,27 @@ void XKeyBoard::init_ui(Xputty *app) {
     free_wheel->func.value_changed_callback = freewheel_callback;
     menu_add_entry(looper,_("Clear All Channels"));
     menu_add_entry(looper,_("Clear Current Channel"));
+    menu_add_entry(looper,_("Piano Roll"));
+    menu_add_entry(looper,_("Undo"));
+    menu_add_entry(looper,_("Redo"));
+    menu_add_entry(looper,_("Capture Last Played"));
+    overdub_mode = menu_add_check_entry(looper,_("Overdub"));
+    overdub_mode->func.value_changed_callback = overdub_callback;
+    omni_mode = menu_add_check_entry(looper,_("Omni Record"));
+    omni_mode->func.value_changed_callback = omni_callback;
     looper->func.value_changed_callback = clear_loops_callback;
     looper->func.key_press_callback = key_press;
     looper->func.key_release_callback = key_release;
 
     info = menubar_add_menu(menubar,_("_Info"));
     menu_add_entry(info,_("_About"));
+    // latency and midi traffic are only seen in the engine process
+    if (!link) {
+        menu_add_entry(info,_("_Latency"));
+        menu_add_entry(info,_("Dump Latency"));
+        menu_add_entry(info,_("Reset Latency"));
+        menu_add_entry(info,_("_MIDI Monitor"));
+    }
     info->flags |= NO_AUTOREPEAT | NO_PROPAGATE;
     info->func.key_press_callback = key_press;
     info->func.key_release_callback = key_release;
@@ -1176,6 +1295,8 @@ void XKeyBoard::init_ui(Xputty *app) {
     adj_set_value(w[6]->adj, velocity);
     adj_set_value(w[5]->adj, volume);
     adj_set_value(free_wheel->adj, freewheel);
+    adj_set_value(overdub_mode->adj, overdub);
+    adj_set_value(omni_mode->adj, omni);
 
     // set window to saved size
     XResizeWindow (win->app->dpy, win->widget, main_w, main_h);
@@ -1186,6 +1307,12 @@ void XKeyBoard::init_ui(Xputty *app) {
     build_sfont_menu();
 
     init_synth_ui(win);
+    proll.init(win, &xjack->rec);
+    mmonitor.init(win, &xjack->monitor);
+    // all drawing is done in the GUI thread, other threads post to uiq
+    uiq.init(win->app->dpy, win->widget);
+    win_event_loop = win->event_callback;
+    win->event_callback = win_event_callback;
     // start the timeout thread for keyboard animation
     animidi->start(30, std::bind(animate_midi_keyboard,(void*)wid));
 }
@@ -1195,74 +1322,153 @@ void XKeyBoard::animate_midi_keyboard(void *w_) {
     Widget_t *w = (Widget_t*)w_;
     MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
-
-    if (xjmkb->xjack->transport_state_changed.load(std::memory_order_acquire)) {
-        xjmkb->xjack->transport_state_changed.store(false, std::memory_order_release);
-        XLockDisplay(w->app->dpy);
-        xjmkb->play->func.adj_callback = dummy_callback;
-        adj_set_value(xjmkb->play->adj,
-            (float)xjmkb->xjack->transport_set.load(std::memory_order_acquire));
-        expose_widget(xjmkb->play);
-        XFlush(w->app->dpy);
-        xjmkb->play->func.adj_callback = set_play_label;
-        XUnlockDisplay(w->app->dpy);
-    }
-
-    if (xjmkb->xjack->bpm_changed.load(std::memory_order_acquire)) {
-        xjmkb->xjack->bpm_changed.store(false, std::memory_order_release);
-        XLockDisplay(w->app->dpy);
-        xjmkb->bpm->func.adj_callback = dummy_callback;
-        adj_set_value(xjmkb->bpm->adj,
-            (float)xjmkb->xjack->bpm_set.load(std::memory_order_acquire));
-        expose_widget(xjmkb->bpm);
-        XFlush(w->app->dpy);
-        xjmkb->bpm->func.adj_callback = transparent_draw;
-        XUnlockDisplay(w->app->dpy);
-    }
-
-    if ((xjmkb->xjack->record || xjmkb->xjack->play) && !xjmkb->xjack->freewheel) {
-        static int scip = 8;
-        if (scip >= 8) {
-            XLockDisplay(w->app->dpy);
-            if ( xjmkb->xjack->play && xjmkb->xjack->get_max_loop_time() > 0.0) {
-                snprintf(xjmkb->time_line->input_label, 31,"%.2f sec", 
-                    xjmkb->xjack->get_max_loop_time() -
-                    (double)((xjmkb->xjack->stPlay - xjmkb->xjack->stStart)/(double)xjmkb->xjack->SampleRate));
-            } else if (xjmkb->xjack->record && xjmkb->xjack->play) {
-                snprintf(xjmkb->time_line->input_label, 31, "%.2f sec",
-                    (double)((xjmkb->xjack->stPlay - xjmkb->xjack->rcStart)/(double)xjmkb->xjack->SampleRate));
-            } else {
-                snprintf(xjmkb->time_line->input_label, 31, "%.2f sec", xjmkb->xjack->get_max_loop_time());
-            }
-            xjmkb->time_line->label = xjmkb->time_line->input_label;
-            expose_widget(xjmkb->time_line);
-            XFlush(w->app->dpy);
-            XUnlockDisplay(w->app->dpy);
-            scip = 0;
+    unsigned int cmd = 0;
+
+    mamba::EngineState s;
+    xjmkb->xjack->get_state(&s);
+    if (s.cycle) {
+        if (s.transport != xjmkb->last_state.transport) cmd |= UI_TRANSPORT;
+        if (s.bpm != xjmkb->last_state.bpm) cmd |= UI_BPM;
+        // a engine process end the take by itself, there is no record_off to see
+        if (xjmkb->link && xjmkb->last_state.record && !s.record) cmd |= UI_RECORD_OFF;
+        xjmkb->last_state = s;
+    }
+    if (xjmkb->link && !xjmkb->engine_lost && !xjmkb->link->engine_alive()) {
+        xjmkb->engine_lost = true;
+        xjmkb->quit_by_engine();
+    }
+
+    if ((s.record || s.play) && !xjmkb->xjack->freewheel) {
+        if (xjmkb->time_line_skip >= 8) {
+            cmd |= UI_TIME_LINE;
+            xjmkb->time_line_skip = 0;
         }
-        scip++;
+        xjmkb->time_line_skip++;
         if (xjmkb->xjack->record_off.load(std::memory_order_acquire)) {
             xjmkb->xjack->record_off.store(false, std::memory_order_release);
-            XLockDisplay(w->app->dpy);
-            xjmkb->record->func.adj_callback = dummy_callback;
-            adj_set_value(xjmkb->record->adj, 0.0);
-            expose_widget(xjmkb->record);
-            XFlush(w->app->dpy);
-            xjmkb->record->func.adj_callback = transparent_draw;
-            XUnlockDisplay(w->app->dpy);
+            cmd |= UI_RECORD_OFF;
         }
     }
 
+    // the piano roll only rebuild channels when a loop has changed
+    if (xjmkb->proll.is_visible()) {
+        cmd |= UI_PIANO_ROLL;
+    }
+
+    // the monitor limit its redraw rate itself
+    if (xjmkb->mmonitor.is_visible()) {
+        cmd |= UI_MIDI_MONITOR;
+    }
+
+    xjmkb->get_midi_in();
     bool repeat = need_redraw(keys);
-    if ((repeat || xjmkb->run_one_more) && xjmkb->xjack->client) {
-        XLockDisplay(w->app->dpy);
-        expose_widget(w);
-        XFlush(w->app->dpy);
-        XUnlockDisplay(w->app->dpy);
+    if ((repeat || xjmkb->run_one_more) && (xjmkb->xjack->client || xjmkb->link)) {
+        cmd |= UI_KEYS;
         if (repeat)
             xjmkb->run_one_more = 10;
     }
     xjmkb->run_one_more = max(0,xjmkb->run_one_more-1);
+
+    if (cmd) xjmkb->uiq.post(cmd);
+}
+
+// run all pending commands in the GUI thread and flush once per frame
+void XKeyBoard::render_frame() {
+    unsigned int cmd = uiq.take();
+    if (!cmd) return;
+
+    if (cmd & UI_QUIT) {
+        quit(win);
+        XFlush(win->app->dpy);
+        return;
+    }
+
+    if (cmd & UI_SHOW) {
+        widget_show_all(win);
+        XMoveWindow(win->app->dpy,win->widget, main_x, main_y);
+        nsmsig.trigger_nsm_gui_is_shown();
+    }
+
+    if (cmd & UI_HIDE) {
+        widget_hide(win);
+        nsmsig.trigger_nsm_gui_is_hidden();
+    }
+
+    mamba::EngineState s;
+    xjack->get_state(&s);
+
+    if (cmd & UI_TRANSPORT) {
+        play->func.adj_callback = dummy_callback;
+        adj_set_value(play->adj, (float)s.transport);
+        expose_widget(play);
+        play->func.adj_callback = set_play_label;
+    }
+
+    if (cmd & UI_BPM) {
+        bpm->func.adj_callback = dummy_callback;
+        adj_set_value(bpm->adj, (float)s.bpm);
+        expose_widget(bpm);
+        bpm->func.adj_callback = transparent_draw;
+    }
+
+    if (cmd & UI_TIME_LINE) {
+        if (!s.cycle) {
+            // nothing published yet
+            snprintf(time_line->input_label, 31, "%.2f sec", xjack->get_max_loop_time());
+        } else if ( s.play && s.loop_time > 0.0) {
+            snprintf(time_line->input_label, 31,"%.2f sec", 
+                s.loop_time - (double)((s.stPlay - s.stStart)/(double)s.sample_rate));
+        } else if (s.record && s.play) {
+            snprintf(time_line->input_label, 31, "%.2f sec",
+                (double)((s.stPlay - s.rcStart)/(double)s.sample_rate));
+        } else {
+            snprintf(time_line->input_label, 31, "%.2f sec", s.loop_time);
+        }
+        time_line->label = time_line->input_label;
+        expose_widget(time_line);
+    }
+
+    if (cmd & UI_RECORD_OFF) {
+        record->func.adj_callback = dummy_callback;
+        adj_set_value(record->adj, 0.0);
+        expose_widget(record);
+        record->func.adj_callback = transparent_draw;
+    }
+
+    if (cmd & UI_KEYS) {
+        expose_widget(wid);
+    }
+
+    if (cmd & UI_PIANO_ROLL) {
+        proll.update();
+    }
+
+    if (cmd & UI_MIDI_MONITOR) {
+        mmonitor.update();
+    }
+
+    if (cmd & UI_SYNTH) {
+        synth_ready();
+    }
+
+    XFlush(win->app->dpy);
+}
+
+// static
+void XKeyBoard::win_event_callback(void *w_, void* event, Xputty *main, void* user_data) {
+    XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
+    if (xjmkb->uiq.is_frame_event((XEvent*)event)) {
+        xjmkb->render_frame();
+        return;
+    }
+    // a key released after the focus moved away never reaches us
+    XEvent *xev = (XEvent*)event;
+    if (xev->type == FocusOut && xev->xfocus.detail != NotifyInferior
+                              && xev->xfocus.detail != NotifyPointer) {
+        keyboard_release_keys(xjmkb->wid);
+        expose_widget(xjmkb->wid);
+    }
+    xjmkb->win_event_loop(w_, event, main, user_data);
 }
 
 // static
@@ -1468,6 +1674,7 @@ void XKeyBoard::get_alsa_port_menu() {
 // static
 void XKeyBoard::make_connection_menu(void *w_, void* button, void* user_data) {
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
+    if (xjmkb->engine_owns()) return;
     xjmkb->get_port_entrys(xjmkb->outputs, xjmkb->xjack->out_port, JackPortIsInput);
     xjmkb->get_port_entrys(xjmkb->inputs, xjmkb->xjack->in_port, JackPortIsOutput);
     if (xjmkb->xalsa->is_running()) xjmkb->get_alsa_port_menu();
@@ -1549,7 +1756,9 @@ void XKeyBoard::alsa_oconnection_callback(void *w_, void* user_data) {
 void XKeyBoard::map_callback(void *w_, void* user_data) {
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
     xjmkb->visible = 1;
-    if(!xjmkb->nsmsig.nsm_session_control)
+    keyboard_set_mapped(xjmkb->wid, true);
+    // the ports of a engine process aren't listed, and this isn't a user action
+    if(!xjmkb->nsmsig.nsm_session_control && !xjmkb->link)
         make_connection_menu(xjmkb->connection, NULL, NULL);
     xevfunc store = xjmkb->view_proc->func.value_changed_callback;
     xjmkb->view_proc->func.value_changed_callback = dummy_callback;
@@ -1567,15 +1776,17 @@ void XKeyBoard::map_callback(void *w_, void* user_data) {
 void XKeyBoard::unmap_callback(void *w_, void* user_data) noexcept{
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
     xjmkb->visible = 0;
+    keyboard_set_mapped(xjmkb->wid, false);
 }
 
 // static
 void XKeyBoard::get_note(Widget_t *w, const int *key, const bool on_off) noexcept{
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
+    MidiKeyboard *keys = (MidiKeyboard*)xjmkb->wid->parent_struct;
     if (on_off) {
-        xjmkb->mmessage->send_midi_cc(0x90, (*key),xjmkb->velocity, 3, false);
+        xjmkb->mmessage->send_midi_cc(0x90, (*key),xjmkb->velocity, 3, false, keys->event_time);
     } else {
-        xjmkb->mmessage->send_midi_cc(0x80, (*key),xjmkb->velocity, 3, false);
+        xjmkb->mmessage->send_midi_cc(0x80, (*key),xjmkb->velocity, 3, false, keys->event_time);
     }
 }
 
@@ -1622,6 +1833,7 @@ void XKeyBoard::recent_file_manager(const char* file_) {
 // static
 void XKeyBoard::dialog_load_response(void *w_, void* user_data) {
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
+    if (xjmkb->engine_owns()) return;
     if(user_data !=NULL) {
 
 #ifdef __XDG_MIME_H__
@@ -1635,15 +1847,15 @@ void XKeyBoard::dialog_load_response(void *w_, void* user_data) {
         float play = adj_get_value(xjmkb->play->adj);
         adj_set_value(xjmkb->play->adj,0.0);
         adj_set_value(xjmkb->record->adj,0.0);
-        if (!xjmkb->load.load_from_file(&xjmkb->xjack->rec.play[0], &xjmkb->song_bpm, *(const char**)user_data)) {
+        std::vector<mamba::MidiEvent> loops[16];
+        if (!xjmkb->load.load_from_file(&loops[0], &xjmkb->song_bpm, *(const char**)user_data)) {
             Widget_t *dia = open_message_dialog(xjmkb->win, ERROR_BOX, *(const char**)user_data, 
             _("Couldn't load file, is that a MIDI file?"),NULL);
             XSetTransientForHint(xjmkb->win->app->dpy, dia->widget, xjmkb->win->widget);
         } else {
+            xjmkb->xjack->rec.replace(0xffff, loops);
             xjmkb->recent_file_manager(*(char**)user_data);
             std::string file(basename(*(char**)user_data));
-            for(int i = 1;i<16;i++)
-                xjmkb->xjack->rec.play[i].clear();
             xjmkb->file_names.clear();
             xjmkb->file_names.push_back(file);
             xjmkb->filepath = dirname(*(char**)user_data);
@@ -1665,6 +1877,7 @@ void XKeyBoard::dialog_load_response(void *w_, void* user_data) {
 // static
 void XKeyBoard::dialog_add_response(void *w_, void* user_data) {
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
+    if (xjmkb->engine_owns()) return;
     if(user_data !=NULL) {
 
 #ifdef __XDG_MIME_H__
@@ -1678,11 +1891,13 @@ void XKeyBoard::dialog_add_response(void *w_, void* user_data) {
         //float play = adj_get_value(xjmkb->play->adj);
         //adj_set_value(xjmkb->play->adj,0.0);
         adj_set_value(xjmkb->record->adj,0.0);
-        if (!xjmkb->load.add_from_file(&xjmkb->xjack->rec.play[0], &xjmkb->song_bpm, *(const char**)user_data)) {
+        std::vector<mamba::MidiEvent> loop(*xjmkb->xjack->rec.loop(0));
+        if (!xjmkb->load.add_from_file(&loop, &xjmkb->song_bpm, *(const char**)user_data)) {
             Widget_t *dia = open_message_dialog(xjmkb->win, ERROR_BOX, *(const char**)user_data, 
             _("Couldn't load file, is that a MIDI file?"),NULL);
             XSetTransientForHint(xjmkb->win->app->dpy, dia->widget, xjmkb->win->widget);
         } else {
+            xjmkb->xjack->rec.replace(0, loop);
             xjmkb->recent_file_manager(*(char**)user_data);
             std::string file(basename(*(char**)user_data));
             xjmkb->file_names.push_back(file);
@@ -1705,6 +1920,7 @@ void XKeyBoard::dialog_add_response(void *w_, void* user_data) {
 // static
 void XKeyBoard::dialog_save_response(void *w_, void* user_data) {
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
+    if (xjmkb->engine_owns()) return;
     if(user_data !=NULL) {
         std::string filename = *(const char**)user_data;
         std::string::size_type idx;
@@ -1720,7 +1936,9 @@ void XKeyBoard::dialog_save_response(void *w_, void* user_data) {
         const char* fn = filename.data();
         adj_set_value(xjmkb->play->adj,0.0);
         adj_set_value(xjmkb->record->adj,0.0);
-        xjmkb->save.save_to_file(xjmkb->xjack->rec.play, fn);
+        std::vector<mamba::MidiEvent> loops[16];
+        xjmkb->xjack->rec.snapshot(loops);
+        xjmkb->save.save_to_file(loops, fn);
     }
 }
 
@@ -1757,7 +1975,9 @@ void XKeyBoard::file_remove_callback(void *w_, void* user_data) {
     //float play = adj_get_value(xjmkb->play->adj);
     //adj_set_value(xjmkb->play->adj,0.0);
     adj_set_value(xjmkb->record->adj,0.0);
-    xjmkb->load.remove_file(&xjmkb->xjack->rec.play[0], value);
+    std::vector<mamba::MidiEvent> loop(*xjmkb->xjack->rec.loop(0));
+    xjmkb->load.remove_file(&loop, value);
+    xjmkb->xjack->rec.replace(0, loop);
     snprintf(xjmkb->time_line->input_label, 31,"%.2f sec", xjmkb->xjack->get_max_loop_time());
     xjmkb->time_line->label = xjmkb->time_line->input_label;
     expose_widget(xjmkb->time_line);
@@ -1883,6 +2103,9 @@ void XKeyBoard::recent_sfont_manager(const char* file_) {
 // static
 void XKeyBoard::synth_load_response(void *w_, void* user_data) {
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w_);
+    if (xjmkb->engine_owns()) return;
+    // the soundfont from the config is still loading
+    if (xjmkb->synth_loading.load(std::memory_order_acquire)) return;
     if(user_data !=NULL) {
         float play = adj_get_value(xjmkb->play->adj);
         //adj_set_value(xjmkb->play->adj,0.0);
@@ -1904,12 +2127,10 @@ void XKeyBoard::synth_load_response(void *w_, void* user_data) {
         }
         if(xjmkb->fs_instruments) {
             combobox_delete_entrys(xjmkb->fs_instruments);
+            xjmkb->instrument_rows.clear();
+            xjmkb->instruments_dirty = true;
         }
-        if (!xjmkb->xsynth->synth_is_active()) {
-            xjmkb->xsynth->setup(xjmkb->xjack->SampleRate);
-            xjmkb->xsynth->init_synth();
-        }
-        if (xjmkb->xsynth->load_soundfont( *(const char**)user_data)) {
+        if (xjmkb->xsynth->load(xjmkb->xjack->SampleRate, *(const char**)user_data)) {
             Widget_t *dia = open_message_dialog(xjmkb->win, ERROR_BOX, *(const char**)user_data, 
             _("Couldn't load file, is that a soundfont file?"),NULL);
             XSetTransientForHint(xjmkb->win->app->dpy, dia->widget, xjmkb->win->widget);
@@ -1925,21 +2146,7 @@ void XKeyBoard::synth_load_response(void *w_, void* user_data) {
         widget_set_title(xjmkb->synth_ui, title.c_str());
         expose_widget(xjmkb->fs_instruments);
         expose_widget(xjmkb->fs_soundfont);
-        const char **port_list = NULL;
-        port_list = jack_get_ports(xjmkb->xjack->client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput);
-        if (port_list) {
-            for (int i = 0; port_list[i] != NULL; i++) {
-                if (strstr(port_list[i], "mamba")) {
-                    if (!jack_port_connected_to(xjmkb->xjack->out_port, port_list[i])) {
-                        const char *my_port = jack_port_name(xjmkb->xjack->out_port);
-                        jack_connect(xjmkb->xjack->client, my_port,port_list[i]);
-                    }
-                    break;
-                }
-            }
-            jack_free(port_list);
-            port_list = NULL;
-        }
+        xjmkb->xjack->connect_synth();
         XWindowAttributes attrs;
         XGetWindowAttributes(xjmkb->win->app->dpy, (Window)xjmkb->synth_ui->widget, &attrs);
         if (attrs.map_state == IsViewable) {
@@ -1975,6 +2182,7 @@ void XKeyBoard::synth_callback(void *w_, void* user_data) {
     Widget_t *w = (Widget_t*)w_;
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
     int value = (int)adj_get_value(w->adj);
+    if (value && xjmkb->engine_owns()) return;
     switch (value) {
         case(0):
         {
@@ -2008,6 +2216,34 @@ void XKeyBoard::synth_callback(void *w_, void* user_data) {
 
 // static
 void XKeyBoard::info_callback(void *w_, void* user_data) {
+    Widget_t *w = (Widget_t*)w_;
+    XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
+    switch ((int)adj_get_value(w->adj)) {
+        case(1):
+        {
+            std::string info = _("Key/Button to MIDI out delay|");
+            info += xjmkb->xjack->latency.summary('|');
+            Widget_t *dia = open_message_dialog(xjmkb->win, INFO_BOX, _("Latency"), info.data(), NULL);
+            XSetTransientForHint(xjmkb->win->app->dpy, dia->widget, xjmkb->win->widget);
+        }
+        break;
+        case(2):
+            fprintf(stderr, "Key/Button to MIDI out delay\n%s", xjmkb->xjack->latency.dump().c_str());
+        break;
+        case(3):
+            xjmkb->xjack->latency.reset();
+        break;
+        case(4):
+            xjmkb->mmonitor.show(1);
+        break;
+        default:
+            show_about(w);
+        break;
+    }
+}
+
+// static
+void XKeyBoard::show_about(void *w_) {
     Widget_t *w = (Widget_t*)w_;
     Widget_t *win = get_toplevel_widget(w->app);
     std::string info = _("Mamba ");
@@ -2027,14 +2263,12 @@ void XKeyBoard::channel_callback(void *w_, void* user_data) noexcept{
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
     MidiKeyboard *keys = (MidiKeyboard*)xjmkb->wid->parent_struct;
     if (xjmkb->xjack->play>0) {
-        for (int i = 0; i<16;i++) 
-            clear_key_matrix(keys->in_key_matrix[i]);
+        clear_all_channel_matrix(&keys->in_key_matrix);
     }
     xjmkb->xjack->rec.channel = xjmkb->mmessage->channel = keys->channel = xjmkb->mchannel = (int)adj_get_value(w->adj);
+    xjmkb->to_engine(mamba::EngineCommand::CHANNEL, xjmkb->mchannel);
     if(xjmkb->xsynth->synth_is_active()) {
-        int i = xjmkb->xsynth->get_instrument_for_channel(xjmkb->mchannel);
-        if ( i >-1)
-            combobox_set_active_entry(xjmkb->fs_instruments, i);
+        xjmkb->set_active_instrument(xjmkb->xsynth->get_instrument_for_channel(xjmkb->mchannel));
     }
 }
 
@@ -2064,7 +2298,8 @@ void XKeyBoard::program_callback(void *w_, void* user_data) {
             buf >> bank;
             buf >> program;
             if (bank == xjmkb->mbank && program == xjmkb->mprogram) {
-                adj_set_value(xjmkb->fs_instruments->adj, ret);
+                xjmkb->xsynth->channel_instrument[xjmkb->mchannel] = ret;
+                xjmkb->set_active_instrument(ret);
                 xjmkb->xsynth->set_instrument_on_channel(xjmkb->mchannel,ret);
                 break;
             }
@@ -2082,6 +2317,7 @@ void XKeyBoard::bpm_callback(void *w_, void* user_data) noexcept{
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
     xjmkb->mbpm = (int)adj_get_value(w->adj);
     xjmkb->xjack->bpm_ratio = (double)xjmkb->song_bpm/(double)xjmkb->mbpm;
+    xjmkb->to_engine(mamba::EngineCommand::BPM, xjmkb->mbpm);
 }
 
 // static
@@ -2200,18 +2436,11 @@ void XKeyBoard::sostenuto_callback(void *w_, void* user_data) noexcept{
     XKeyBoard::get_instance(w)->mmessage->send_midi_cc(0xB0, 66, value*127, 3, false);
 }
 
-void XKeyBoard::find_next_beat_time(double *absoluteTime) {
-    double beat = 60.0/(double)song_bpm;
-    int beats = std::round(((*absoluteTime)/beat));
-    (*absoluteTime) = (double)beats*beat;
-}
-
 // static
 void XKeyBoard::record_callback(void *w_, void* user_data) {
     Widget_t *w = (Widget_t*)w_;
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
     int value = (int)adj_get_value(w->adj);
-    xjmkb->xjack->record = value;
     if (value > 0) {
         std::string tittle = xjmkb->client_name + _(" - Virtual Midi Keyboard");
         widget_set_title(xjmkb->win, tittle.c_str());
@@ -2219,33 +2448,23 @@ void XKeyBoard::record_callback(void *w_, void* user_data) {
         snprintf(xjmkb->songbpm->input_label, 31,_("File BPM: %d"),  (int) xjmkb->song_bpm);
         xjmkb->songbpm->label = xjmkb->songbpm->input_label;
         expose_widget(xjmkb->songbpm);
-        xjmkb->xjack->store1.clear();
-        xjmkb->xjack->store2.clear();
-        int c = xjmkb->mchannel;
-        if (xjmkb->mchannel>15) {
-            xjmkb->xjack->rec.channel = xjmkb->mmessage->channel = c = 0;
-        }
-        xjmkb->xjack->rec.play[c].clear();
-        xjmkb->xjack->fresh_take = true;
-        xjmkb->xjack->rec.start();
-        xjmkb->need_save = true;
-    } else if ( xjmkb->xjack->rec.is_running()) {
-        if (xjmkb->xjack->rec.st == &xjmkb->xjack->store1 && xjmkb->xjack->store2.size()) {
-            xjmkb->xjack->rec.st = &xjmkb->xjack->store2;
+        if (xjmkb->link) {
+            xjmkb->to_engine(xjmkb->omni ? mamba::EngineCommand::OMNI : xjmkb->overdub ?
+                mamba::EngineCommand::OVERDUB : mamba::EngineCommand::RECORD, 1);
+        } else if (xjmkb->omni) {
+            xjmkb->file_names.clear();
+            xjmkb->build_remove_menu();
+            xjmkb->load.positions.clear();
+            xjmkb->xjack->start_omni_record();
+        } else if (xjmkb->overdub) {
+            xjmkb->xjack->start_overdub(xjmkb->mchannel>15 ? 0 : xjmkb->mchannel);
         } else {
-            xjmkb->xjack->rec.st = &xjmkb->xjack->store1;
+            xjmkb->xjack->start_record(xjmkb->mchannel>15 ? 0 : xjmkb->mchannel);
         }
-        jack_nframes_t stop = jack_last_frame_time(xjmkb->xjack->client);
-        double deltaTime = (double)(((stop) - xjmkb->xjack->start)/(double)xjmkb->xjack->SampleRate); // seconds
-        double absoluteTime = (double)(((stop) - xjmkb->xjack->absoluteStart)/(double)xjmkb->xjack->SampleRate); // seconds
-        if(!xjmkb->xjack->get_max_loop_time() && !xjmkb->freewheel)
-            xjmkb->find_next_beat_time(&absoluteTime);
-        else if (xjmkb->xjack->get_max_loop_time() && !xjmkb->freewheel)
-            absoluteTime = xjmkb->xjack->get_max_loop_time();
-        mamba::MidiEvent ev = {{0x80, 0, 0}, 3, deltaTime, absoluteTime};
-        xjmkb->xjack->rec.st->push_back(ev);
-        xjmkb->xjack->rec.stop();
-        xjmkb->xjack->record_finished = 1;
+        xjmkb->need_save = true;
+    } else if (xjmkb->link) {
+        xjmkb->to_engine(mamba::EngineCommand::RECORD, 0);
+    } else if (xjmkb->xjack->finish_record(xjmkb->freewheel, xjmkb->song_bpm)) {
         snprintf(xjmkb->time_line->input_label, 31,"%.2f sec", xjmkb->xjack->get_max_loop_time());
         xjmkb->time_line->label = xjmkb->time_line->input_label;
         expose_widget(xjmkb->time_line);
@@ -2258,10 +2477,10 @@ void XKeyBoard::play_callback(void *w_, void* user_data) noexcept{
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
     int value = (int)adj_get_value(w->adj);
     xjmkb->xjack->play = value;
+    xjmkb->to_engine(mamba::EngineCommand::PLAY, value);
     if (value < 1) {
         MidiKeyboard *keys = (MidiKeyboard*)xjmkb->wid->parent_struct;
-        for (int i = 0; i<16;i++) 
-            clear_key_matrix(keys->in_key_matrix[i]);
+        clear_all_channel_matrix(&keys->in_key_matrix);
         xjmkb->mmessage->send_midi_cc(0xB0, 123, 0, 3, false);
         if (xjmkb->xsynth->synth_is_active()) xjmkb->xsynth->panic();
         xjmkb->xjack->first_play = true;
@@ -2289,6 +2508,21 @@ void XKeyBoard::freewheel_callback(void *w_, void* user_data) noexcept{
     XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
     int value = (int)adj_get_value(w->adj);
     xjmkb->xjack->freewheel = xjmkb->freewheel = xjmkb->save.freewheel = value;
+    xjmkb->to_engine(mamba::EngineCommand::FREEWHEEL, value);
+}
+
+// static
+void XKeyBoard::overdub_callback(void *w_, void* user_data) noexcept{
+    Widget_t *w = (Widget_t*)w_;
+    XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
+    xjmkb->overdub = (int)adj_get_value(w->adj);
+}
+
+// static
+void XKeyBoard::omni_callback(void *w_, void* user_data) noexcept{
+    Widget_t *w = (Widget_t*)w_;
+    XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
+    xjmkb->omni = (int)adj_get_value(w->adj);
 }
 
 // static
@@ -2301,10 +2535,9 @@ void XKeyBoard::clear_loops_callback(void *w_, void* user_data) noexcept{
         //adj_set_value(xjmkb->play->adj, 0.0);
         //set_play_label(xjmkb->play,NULL);
         //adj_set_value(xjmkb->record->adj, 0.0);
-        for (int i = 0; i<16;i++) 
-            xjmkb->xjack->rec.play[i].clear();
-        for (int i = 0; i<16;i++) 
-            clear_key_matrix(keys->in_key_matrix[i]);
+        if (!xjmkb->to_engine(mamba::EngineCommand::CLEAR, -1))
+            xjmkb->xjack->rec.keep(0xffff);
+        clear_all_channel_matrix(&keys->in_key_matrix);
         xjmkb->file_names.clear();
         xjmkb->build_remove_menu();
         xjmkb->load.positions.clear();
@@ -2327,11 +2560,72 @@ void XKeyBoard::clear_loops_callback(void *w_, void* user_data) noexcept{
             xjmkb->build_remove_menu();
             xjmkb->load.positions.clear();
         }
-        xjmkb->xjack->rec.play[xjmkb->xjack->rec.channel].clear();
-        clear_key_matrix(keys->in_key_matrix[xjmkb->xjack->rec.channel]);
-        xjmkb->mmessage->send_midi_cc(0xB0 | xjmkb->xjack->rec.channel, 123, 0, 3, true);
+        if (!xjmkb->to_engine(mamba::EngineCommand::CLEAR, xjmkb->xjack->rec.channel)) {
+            xjmkb->xjack->rec.keep(1<<xjmkb->xjack->rec.channel);
+            xjmkb->mmessage->send_midi_cc(0xB0 | xjmkb->xjack->rec.channel, 123, 0, 3, true);
+        }
+        clear_channel_matrix(&keys->in_key_matrix, xjmkb->xjack->rec.channel);
         xjmkb->need_save = true;
+    } else if ((int)adj_get_value(w->adj) == 4) {
+        if (!xjmkb->engine_owns()) xjmkb->proll.show(1);
+    } else if ((int)adj_get_value(w->adj) == 5) {
+        xjmkb->undo_loops(false);
+    } else if ((int)adj_get_value(w->adj) == 6) {
+        xjmkb->undo_loops(true);
+    } else if ((int)adj_get_value(w->adj) == 7) {
+        xjmkb->capture_loop();
+    }
+}
+
+// make a loop from what was played in, without a armed record
+void XKeyBoard::capture_loop() {
+    if (to_engine(mamba::EngineCommand::CAPTURE, 0)) return;
+    if (xjack->record) return;
+    const int c = mchannel > 15 ? 0 : mchannel;
+    // the first loop set the song tempo, later ones play along
+    const bool fresh = xjack->get_max_loop_time() <= 0.0;
+    if (fresh) {
+        song_bpm = mbpm = adj_get_value(bpm->adj);
+        xjack->bpm_ratio = 1.0;
+    }
+    if (!xjack->capture_loop(c, adj_get_value(bpm->adj), freewheel)) return;
+    if (fresh) {
+        snprintf(songbpm->input_label, 31,_("File BPM: %d"),  (int) song_bpm);
+        songbpm->label = songbpm->input_label;
+        expose_widget(songbpm);
+    }
+    if (c == 0) {
+        file_names.clear();
+        build_remove_menu();
+        load.positions.clear();
+    }
+    snprintf(time_line->input_label, 31,"%.2f sec", xjack->get_max_loop_time());
+    time_line->label = time_line->input_label;
+    expose_widget(time_line);
+    need_save = true;
+}
+
+// swap the loops with the last undo (or redo) step
+void XKeyBoard::undo_loops(bool redo) {
+    if (to_engine(redo ? mamba::EngineCommand::REDO : mamba::EngineCommand::UNDO, 0)) return;
+    unsigned int mask = redo ? xjack->rec.redo() : xjack->rec.undo();
+    if (!mask) return;
+    MidiKeyboard *keys = (MidiKeyboard*)wid->parent_struct;
+    if (mask & 1) {
+        // the file list doesn't match the loop anymore
+        file_names.clear();
+        build_remove_menu();
+        load.positions.clear();
     }
+    for (int c = 0; c < 16; c++) {
+        if (!(mask & (1<<c))) continue;
+        clear_channel_matrix(&keys->in_key_matrix, c);
+        mmessage->send_midi_cc(0xB0 | c, 123, 0, 3, true);
+    }
+    snprintf(time_line->input_label, 31,"%.2f sec", xjack->get_max_loop_time());
+    time_line->label = time_line->input_label;
+    expose_widget(time_line);
+    need_save = true;
 }
 
 // static
@@ -2365,8 +2659,7 @@ void XKeyBoard::view_channels_callback(void *w_, void* user_data) noexcept{
     xjmkb->xjack->view_channels = xjmkb->lchannels = (int)adj_get_value(w->adj);
     if (xjmkb->lchannels) {
         MidiKeyboard *keys = (MidiKeyboard*)xjmkb->wid->parent_struct;
-        for (int i = 0; i<16;i++) 
-            clear_key_matrix(keys->in_key_matrix[i]);
+        clear_all_channel_matrix(&keys->in_key_matrix);
     }
 }
 
@@ -2402,7 +2695,7 @@ void XKeyBoard::key_press(void *w_, void *key_, void *user_data) {
         switch (sym) {
             case (XK_a):
             {
-                xjmkb->info_callback(xjmkb->info,NULL);
+                xjmkb->show_about(xjmkb->info);
             }
             break;
             case (XK_c):
@@ -2479,7 +2772,8 @@ void XKeyBoard::key_press(void *w_, void *key_, void *user_data) {
             break;
             case (XK_n):
             {
-                if(!xjmkb->xsynth->synth_is_active() || !xjmkb->fs_instruments) break;
+                if(!xjmkb->xsynth->synth_is_active() || !xjmkb->fs_instruments ||
+                    xjmkb->synth_loading.load(std::memory_order_acquire)) break;
                 XWindowAttributes attrs;
                 XGetWindowAttributes(w->app->dpy, (Window)xjmkb->synth_ui->widget, &attrs);
                 if (attrs.map_state != IsViewable) {
@@ -2491,6 +2785,7 @@ void XKeyBoard::key_press(void *w_, void *key_, void *user_data) {
             break;
             case (XK_o):
             {
+                if (xjmkb->link) break;
                 Widget_t *menu = xjmkb->connection->childlist->childs[0];
                 XWindowAttributes attrs;
                 XGetWindowAttributes(w->app->dpy, (Window)menu->widget, &attrs);
@@ -2517,6 +2812,10 @@ void XKeyBoard::key_press(void *w_, void *key_, void *user_data) {
             break;
             case (XK_r):
             { 
+                if (key->state & ShiftMask) {
+                    xjmkb->capture_loop();
+                    break;
+                }
                 int value = (int)adj_get_value(xjmkb->record->adj);
                 if (value) adj_set_value(xjmkb->record->adj,0.0);
                 else adj_set_value(xjmkb->record->adj,1.0);
@@ -2558,6 +2857,11 @@ void XKeyBoard::key_press(void *w_, void *key_, void *user_data) {
                 xjmkb->xsynth->panic();
             }
             break;
+            case (XK_z):
+            {
+                xjmkb->undo_loops(key->state & ShiftMask);
+            }
+            break;
             case (XK_0):
             {
                 MidiKeyboard *keys = (MidiKeyboard*)xjmkb->wid->parent_struct;
@@ -2747,7 +3051,9 @@ void XKeyBoard::instrument_callback(void *w_, void* user_data) {
     Widget_t *w = (Widget_t*)w_;
     Widget_t *win = get_toplevel_widget(w->app);
     XKeyBoard *xjmkb = (XKeyBoard*) win->parent_struct;
-    int i = (int)adj_get_value(xjmkb->fs_instruments->adj);
+    int row = (int)adj_get_value(xjmkb->fs_instruments->adj);
+    if (row < 0 || row >= (int)xjmkb->instrument_rows.size()) return;
+    int i = xjmkb->instrument_rows[row];
     xjmkb->xsynth->channel_instrument[xjmkb->mchannel] = i;
     std::istringstream buf(xjmkb->xsynth->instruments[i]);
     buf >> xjmkb->mbank;
@@ -2756,19 +3062,69 @@ void XKeyBoard::instrument_callback(void *w_, void* user_data) {
     adj_set_value(xjmkb->program->adj,xjmkb->mprogram);
 }
 
+// static
+void XKeyBoard::instrument_filter_key(void *w_, void *key_, void *user_data) {
+    Widget_t *w = (Widget_t*)w_;
+    XKeyBoard *xjmkb = XKeyBoard::get_instance(w);
+    XKeyEvent *key = (XKeyEvent*)key_;
+    if (!key) return;
+    char buf[8] = {0};
+    KeySym sym = 0;
+    int n = XLookupString(key, buf, 7, &sym, NULL);
+    if (sym == XK_BackSpace) {
+        if (xjmkb->instrument_filter.empty()) return;
+        xjmkb->instrument_filter.pop_back();
+    } else if (sym == XK_Escape) {
+        if (xjmkb->instrument_filter.empty()) return;
+        xjmkb->instrument_filter.clear();
+    } else if (n == 1 && isprint((unsigned char)buf[0])) {
+        xjmkb->instrument_filter += buf[0];
+    } else {
+        return;
+    }
+    xjmkb->fill_instrument_list();
+}
+
+// the instrument list is only filled when the synth window is shown
 void XKeyBoard::rebuild_instrument_list() {
-    if(fs_instruments) {
-        combobox_delete_entrys(fs_instruments);
+    instruments_dirty = true;
+    instrument_filter.clear();
+    XWindowAttributes attrs;
+    XGetWindowAttributes(win->app->dpy, (Window)synth_ui->widget, &attrs);
+    if (attrs.map_state == IsViewable) fill_instrument_list();
+}
+
+void XKeyBoard::fill_instrument_list() {
+    if(!fs_instruments) return;
+    combobox_delete_entrys(fs_instruments);
+    instrument_rows.clear();
+    for (unsigned int i = 0; i < xsynth->instruments.size(); i++) {
+        if (!instrument_filter.empty() &&
+            !strcasestr(xsynth->instruments[i].c_str(), instrument_filter.c_str())) continue;
+        instrument_rows.push_back(i);
+        combobox_add_entry(fs_instruments, xsynth->instruments[i].c_str());
     }
+    instruments_dirty = false;
 
-    for(std::vector<std::string>::const_iterator
-            i = xsynth->instruments.begin();i != xsynth->instruments.end(); ++i) {
-        combobox_add_entry(fs_instruments,(*i).c_str());
+    std::string title = _("Fluidsynth - ");
+    title += soundfontname;
+    if (!instrument_filter.empty()) {
+        title += _(" - Filter: ");
+        title += instrument_filter;
     }
+    widget_set_title(synth_ui, title.c_str());
+
+    set_active_instrument(xsynth->get_instrument_for_channel(mchannel));
+}
 
-    int i = xsynth->get_instrument_for_channel(mchannel);
-    if ( i >-1)
-        combobox_set_active_entry(fs_instruments, i);
+void XKeyBoard::set_active_instrument(int i) {
+    if (i < 0 || instruments_dirty) return;
+    for (unsigned int row = 0; row < instrument_rows.size(); row++) {
+        if (instrument_rows[row] == i) {
+            combobox_set_active_entry(fs_instruments, row);
+            break;
+        }
+    }
 }
 
 //static
@@ -2786,9 +3142,15 @@ void XKeyBoard::soundfont_callback(void *w_, void* user_data) {
 }
 
 void XKeyBoard::rebuild_soundfont_list() {
-    if(fs_soundfont) {
-        combobox_delete_entrys(fs_soundfont);
-    }
+    soundfonts_dirty = true;
+    XWindowAttributes attrs;
+    XGetWindowAttributes(win->app->dpy, (Window)synth_ui->widget, &attrs);
+    if (attrs.map_state == IsViewable) fill_soundfont_list();
+}
+
+void XKeyBoard::fill_soundfont_list() {
+    if(!fs_soundfont) return;
+    combobox_delete_entrys(fs_soundfont);
     int active = 0;
     // get all soundfonts from choosen directory
     FilePicker *fp = (FilePicker*)malloc(sizeof(FilePicker));
@@ -2808,11 +3170,62 @@ void XKeyBoard::rebuild_soundfont_list() {
     }
     fp_free(fp);
     free(fp);
+    soundfonts_dirty = false;
     combobox_set_active_entry(fs_soundfont, active);
 }
 
+// set the engine threads, once they exist. the gui thread is set last,
+// so its cpus are never inherited by them
+void XKeyBoard::start_engine_sched(mamba::Reactor *midi_reactor) {
+    sched.apply(mamba::ThreadSched::JACK, jack_client_thread_id(xjack->client));
+    if (!sched.has_policy(mamba::ThreadSched::ALSA) && xjack->rt_priority() > 2)
+        xalsa->xalsa_set_priority(xjack->rt_priority());
+    sched.apply(mamba::ThreadSched::ALSA, midi_reactor->thread_id());
+    sched.apply(mamba::ThreadSched::GUI, pthread_self());
+}
+
+void XKeyBoard::start_synth() {
+    if (soundfont.empty()) return;
+    synth_loading.store(true, std::memory_order_release);
+    synth_loader = std::async(std::launch::async, [this] () {
+        sched.apply(mamba::ThreadSched::WORKER, pthread_self());
+        xsynth->load(xjack->SampleRate, soundfont.c_str());
+        uiq.post(UI_SYNTH);
+    });
+}
+
+// called from the GUI thread when start_synth() is done
+void XKeyBoard::synth_ready() {
+    synth_loader.get();
+    synth_loading.store(false, std::memory_order_release);
+    xjack->connect_synth();
+    mmessage->send_midi_cc(0xB0, 7, volume, 3, false);
+    // headless, there are no widgets to update
+    if (!win) return;
+    fs[0]->state = 0;
+    fs[1]->state = 0;
+    fs[2]->state = 0;
+    rebuild_instrument_list();
+    rebuild_soundfont_list();
+}
+
+void XKeyBoard::run_headless(xosc::OscControl *osc, const char *port, const char *midi_file) {
+    if (!osc->init(port, mchannel, song_bpm)) return;
+    osc->signal_trigger_quit_by_osc().connect(
+        sigc::mem_fun(this, &XKeyBoard::quit_by_osc));
+    if (midi_file) osc->load_file(midi_file);
+    while (true) {
+        unsigned int cmd = uiq.wait();
+        if (cmd & UI_SYNTH) synth_ready();
+        if (cmd & UI_QUIT) break;
+    }
+    osc->close();
+}
+
 void XKeyBoard::show_synth_ui(int present) {
     if(present) {
+        if (instruments_dirty) fill_instrument_list();
+        if (soundfonts_dirty) fill_soundfont_list();
         widget_show_all(synth_ui);
         int y = main_y-226;
         if (main_y < 230) y = main_y + main_h+21;
@@ -2852,6 +3265,10 @@ void XKeyBoard::init_synth_ui(Widget_t *parent) {
     Widget_t *tmp = fs_instruments->childlist->childs[0];
     tmp->func.key_press_callback = key_press;
     tmp->func.key_release_callback = key_release;
+    // type ahead filter while the instrument list is open
+    Widget_t *menu = fs_instruments->childlist->childs[1];
+    menu->func.key_press_callback = instrument_filter_key;
+    menu->childlist->childs[0]->func.key_press_callback = instrument_filter_key;
 
     fs_soundfont = add_combobox(synth_ui, _("Soundfonts"), 290, 10, 260, 30);
     fs_soundfont->flags |= NO_AUTOREPEAT | NO_PROPAGATE;
@@ -2967,10 +3384,7 @@ void XKeyBoard::init_synth_ui(Widget_t *parent) {
 void XKeyBoard::signal_handle (int sig) {
     if(xjack->client) jack_client_close (xjack->client);
     xjack->client = NULL;
-    XLockDisplay(win->app->dpy);
-    quit(win);
-    XFlush(win->app->dpy);
-    XUnlockDisplay(win->app->dpy);
+    uiq.post(UI_QUIT);
     fprintf (stderr, "\n%s: signal %i received, bye bye ...\n",client_name.c_str(), sig);
 }
 
@@ -2994,72 +3408,47 @@ void XKeyBoard::win_mem_free(void *w_, void* user_data) {
 /****************************************************************
  ** class PosixSignalHandler
  **
- ** Watch for incomming system signals in a extra thread
+ ** Watch for incomming system signals with a signalfd in the reactor,
+ ** the signals must be blocked before any other thread is created
  ** 
  */
 
-PosixSignalHandler::PosixSignalHandler()
+PosixSignalHandler::PosixSignalHandler(mamba::Reactor *reactor_)
     : sigc::trackable(),
       waitset(),
-      thread(nullptr),
-      exit(false) {
+      reactor(reactor_),
+      signal_fd(-1) {
     sigemptyset(&waitset);
 
     sigaddset(&waitset, SIGINT);
     sigaddset(&waitset, SIGQUIT);
     sigaddset(&waitset, SIGTERM);
     sigaddset(&waitset, SIGHUP);
-    sigaddset(&waitset, SIGKILL);
 
     sigprocmask(SIG_BLOCK, &waitset, NULL);
-    create_thread();
+    signal_fd = reactor->add_signals(&waitset,
+        [this] (int sig) {signal_handler(sig);});
+    if (signal_fd < 0)
+        fprintf(stderr,"Couldn't watch for posix signals\n");
 }
 
 PosixSignalHandler::~PosixSignalHandler() {
-    if (thread) {
-        exit = true;
-        pthread_kill(thread->native_handle(), SIGINT);
-        thread->join();
-        delete thread;
-    }
+    reactor->remove(signal_fd);
     sigprocmask(SIG_UNBLOCK, &waitset, NULL);
 }
 
-void PosixSignalHandler::create_thread() {
-    try {
-        thread = new std::thread(
-            sigc::mem_fun(*this, &PosixSignalHandler::signal_helper_thread));
-    } catch (std::system_error& e) {
-        fprintf(stderr,"Thread create failed (signal): %s", e.what());
-    }
-}
-
-void PosixSignalHandler::signal_helper_thread() {
-
-    pthread_sigmask(SIG_BLOCK, &waitset, NULL);
-    while (true) {
-        int sig;
-        int ret = sigwait(&waitset, &sig);
-        if (exit) {
-            break;
-        }
-        if (ret != 0) {
-            assert(errno == EINTR);
-            continue;
-        }
-        switch (sig) {
-            case SIGINT:
-            case SIGTERM:
-            case SIGQUIT:
-                trigger_quit_by_posix(sig);
-            break;
-            case SIGHUP:
-            case SIGKILL:
-                trigger_kill_by_posix(sig);
-            break;
-            default:
-            break;
-        }
+void PosixSignalHandler::signal_handler(int sig) {
+    switch (sig) {
+        case SIGINT:
+        case SIGTERM:
+        case SIGQUIT:
+            trigger_quit_by_posix(sig);
+        break;
+        case SIGHUP:
+            trigger_kill_by_posix(sig);
+        break;
+        default:
+        break;
     }
 }
 
@@ -3086,77 +3475,153 @@ int main (int argc, char *argv[]) {
     textdomain(GETTEXT_PACKAGE);
 #endif
 
-    if(0 == XInitThreads()) 
+    alloccheck::init();
+
+    bool headless = false;
+    bool export_state = false;
+    const char *osc_port = "7700";
+    const char *engine_name = NULL;
+    char **midi_file = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) headless = true;
+        else if (strcmp(argv[i], "--engine") == 0)
+            engine_name = i+1 < argc && argv[i+1][0] != '-' ? argv[++i] : "Mamba";
+        else if (strcmp(argv[i], "--export-state") == 0) export_state = true;
+        else if (strcmp(argv[i], "--osc-port") == 0 && i+1 < argc) osc_port = argv[++i];
+        else if (!midi_file) midi_file = &argv[i];
+    }
+
+    if(!headless && 0 == XInitThreads()) 
         fprintf(stderr, "Warning: XInitThreads() failed\n");
 
-    midikeyboard::PosixSignalHandler xsig;
+    // block the signals before the reactor thread is created,
+    // every later thread inherit the mask
+    mamba::Reactor reactor;
+    midikeyboard::PosixSignalHandler xsig(&reactor);
+    reactor.start();
+    // alsa midi forwarding run realtime in a reactor of its own
+    mamba::Reactor midi_reactor;
+    midi_reactor.start();
 
     Xputty app;
 
     mamba::MidiMessenger mmessage;
     nsmhandler::NsmSignalHandler nsmsig;
-    midikeyboard::AnimatedKeyBoard  animidi;
+    midikeyboard::AnimatedKeyBoard  animidi(&reactor);
 
     xalsa::XAlsa xalsa([&mmessage]
         (int _cc, int _pg, int _bgn, int _num, bool have_channel) noexcept
-        {mmessage.send_midi_cc( _cc, _pg, _bgn, _num, have_channel);});
+        {mmessage.send_midi_cc( _cc, _pg, _bgn, _num, have_channel);}, &midi_reactor);
 
     xjack::XJack xjack(&mmessage,
         [&xalsa] (const uint8_t* m ,uint8_t n ) noexcept {xalsa.xalsa_output_notify(m,n);},
-        [&xalsa] (int p ) {xalsa.xalsa_set_priority(p);});
+        &reactor);
+    xalsa.xalsa_set_monitor(&xjack.monitor);
 
     xsynth::XSynth xsynth;
     midikeyboard::XKeyBoard xjmkb(&xjack, &xalsa, &xsynth, &mmessage, nsmsig, xsig, &animidi);
-    nsmhandler::NsmHandler nsmh(&nsmsig);
+    nsmhandler::NsmHandler nsmh(&nsmsig, &reactor);
 
-    nsmsig.nsm_session_control = nsmh.check_nsm(xjmkb.client_name.c_str(), argv);
+    if (!headless)
+        nsmsig.nsm_session_control = nsmh.check_nsm(xjmkb.client_name.c_str(), argv);
 
     xjmkb.read_config();
+    xjmkb.sched.apply(mamba::ThreadSched::REACTOR, reactor.thread_id());
+
+    // no X11 at all, the looper is controlled over OSC
+    if (headless) {
+        std::vector<mamba::MidiEvent> loops[16];
+        if (xjmkb.read_loops(loops)) xjack.rec.set_loops(loops);
+        if (xalsa.xalsa_init("Mamba", "input", "output") >= 0) {
+            xalsa.xalsa_start([] (int channel, int key, bool set) {});
+        } else {
+            fprintf(stderr, _("Couldn't open a alsa port, is the alsa sequencer running?\n"));
+        }
+        if (xjack.open_jack()) {
+            if (export_state) xjack.export_state("mamba-" + xjack.client_name);
+        }
+        if (xjack.client && xjack.activate_jack()) {
+            xjmkb.start_engine_sched(&midi_reactor);
+            xjmkb.start_synth();
+            xosc::OscControl osc(&xjack, &xsynth, &mmessage, &reactor);
+            xjmkb.run_headless(&osc, osc_port, midi_file ? *midi_file : NULL);
+            xjmkb.wait_synth();
+            // the jack thread notify the alsa output until the client is gone
+            if (xjack.client) jack_client_close (xjack.client);
+            xalsa.xalsa_stop();
+            xsynth.unload_synth();
+        }
+        midi_reactor.stop();
+        reactor.stop();
+        exit (0);
+    }
+
+    // jack, alsa and the synth run in a mamba-engine process,
+    // the GUI attach to it and could be restarted while it play
+    if (engine_name) {
+        mamba::SharedLink shared;
+        mamba::EngineLink *link = shared.open(std::string("mamba-") + engine_name);
+        if (link && !link->attach_gui()) {
+            fprintf(stderr, _("A other GUI is attached to the engine %s\n"), engine_name);
+            link = NULL;
+        }
+        if (link) {
+            // attach first, the UI leave out what only the engine could show
+            xjmkb.attach_engine(link);
+            main_init(&app);
+            xjmkb.init_ui(&app);
+            xjmkb.show_ui(xjmkb.visible);
+            main_run(&app);
+            animidi.stop();
+            xjmkb.uiq.close();
+            link->detach_gui();
+            if(!nsmsig.nsm_session_control) xjmkb.save_config();
+            main_quit(&app);
+        }
+        shared.close();
+        midi_reactor.stop();
+        reactor.stop();
+        exit (link ? 0 : 1);
+    }
+
+    // start the slow parts while the UI is build
+    std::vector<mamba::MidiEvent> loops[16];
+    auto loops_ready = std::async(std::launch::async, [&xjmkb, &loops] () {
+        return xjmkb.read_loops(loops);});
+    auto alsa_ready = std::async(std::launch::async, [&xalsa] () {
+        return xalsa.xalsa_init("Mamba", "input", "output");});
+    auto jack_ready = std::async(std::launch::async, [&xjack, export_state] () {
+        int ret = xjack.open_jack();
+        if (ret && export_state) xjack.export_state("mamba-" + xjack.client_name);
+        return ret;});
 
     main_init(&app);
     
     xjmkb.init_ui(&app);
-    if (xalsa.xalsa_init("Mamba", "input", "output") >= 0) {
+    if (loops_ready.get()) {
+        xjack.rec.set_loops(loops);
+        xjmkb.uiq.post(midikeyboard::UI_TIME_LINE);
+    }
+    if (alsa_ready.get() >= 0) {
         MidiKeyboard *keys = (MidiKeyboard*)xjmkb.wid->parent_struct;
         xalsa.xalsa_start([keys] (int channel, int key, bool set)
-            {set_key_in_matrix(keys->in_key_matrix[channel], key, set);});
+            {set_key_in_channel(&keys->in_key_matrix, channel, key, set);});
     } else {
         fprintf(stderr, _("Couldn't open a alsa port, is the alsa sequencer running?\n"));
     }
-    if (xjack.init_jack()) {
-        if (!xjmkb.soundfont.empty()) {
-            xsynth.setup(xjack.SampleRate);
-            xsynth.init_synth();
-            xsynth.load_soundfont(xjmkb.soundfont.c_str());
-            const char **port_list = NULL;
-            port_list = jack_get_ports(xjack.client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput);
-            if (port_list) {
-                for (int i = 0; port_list[i] != NULL; i++) {
-                    if (strstr(port_list[i], "mamba")) {
-                        const char *my_port = jack_port_name(xjack.out_port);
-                        jack_connect(xjack.client, my_port,port_list[i]);
-                        break;
-                    }
-                }
-                jack_free(port_list);
-                port_list = NULL;
-            }
-            mmessage.send_midi_cc(0xB0, 7, xjmkb.volume, 3, false);
-            xjmkb.fs[0]->state = 0;
-            xjmkb.fs[1]->state = 0;
-            xjmkb.fs[2]->state = 0;
-            xjmkb.rebuild_instrument_list();
-            xjmkb.rebuild_soundfont_list();
-        }
+    // the process callback use the UI, so activate only now
+    if (jack_ready.get() && xjack.activate_jack()) {
+        xjmkb.start_engine_sched(&midi_reactor);
+        xjmkb.start_synth();
         
-        if (argc > 1) {
+        if (midi_file) {
 
 #ifdef __XDG_MIME_H__
-            if(strstr(xdg_mime_get_mime_type_from_file_name(argv[1]), "midi")) {
+            if(strstr(xdg_mime_get_mime_type_from_file_name(*midi_file), "midi")) {
 #else
-            if( access(argv[1], F_OK ) != -1 ) {
+            if( access(*midi_file, F_OK ) != -1 ) {
 #endif
-                xjmkb.dialog_load_response(xjmkb.win, (void*) &argv[1]);
+                xjmkb.dialog_load_response(xjmkb.win, (void*) midi_file);
             }
         }
 
@@ -3168,10 +3633,16 @@ int main (int argc, char *argv[]) {
         main_run(&app);
         
         animidi.stop();
+        xjmkb.wait_synth();
+        xjmkb.uiq.close();
+        // the jack thread notify the alsa output until the client is gone
         if (xjack.client) jack_client_close (xjack.client);
+        xalsa.xalsa_stop();
         xsynth.unload_synth();
         if(!nsmsig.nsm_session_control) xjmkb.save_config();
     }
+    midi_reactor.stop();
+    reactor.stop();
     main_quit(&app);
 
     exit (0);
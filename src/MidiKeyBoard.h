@@ -31,12 +31,14 @@
 #include <vector>
 #include <thread>
 #include <condition_variable>
+#include <mutex>
 #include <system_error>
 #include <sigc++/sigc++.h>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <queue>
+#include <future>
 
 #ifdef ENABLE_NLS
 #include <libintl.h>
@@ -54,6 +56,10 @@
 #include "xfile-dialog.h"
 #include "xmessage-dialog.h"
 #include "XSynth.h"
+#include "XPianoRoll.h"
+#include "XMidiMonitor.h"
+#include "XOsc.h"
+#include "XAllocCheck.h"
 
 #pragma once
 
@@ -86,20 +92,19 @@ typedef enum {
 /****************************************************************
  ** class PosixSignalHandler
  **
- ** Watch for incomming system signals in a extra thread
+ ** Watch for incomming system signals with a signalfd in the reactor
  ** 
  */
 
 class PosixSignalHandler : public sigc::trackable {
 private:
     sigset_t waitset;
-    std::thread *thread;
-    volatile bool exit;
-    void signal_helper_thread();
-    void create_thread();
+    mamba::Reactor *reactor;
+    int signal_fd;
+    void signal_handler(int sig);
     
 public:
-    PosixSignalHandler();
+    PosixSignalHandler(mamba::Reactor *reactor);
     ~PosixSignalHandler();
 
     sigc::signal<void, int> trigger_quit_by_posix;
@@ -112,17 +117,17 @@ public:
 /****************************************************************
  ** class AnimatedKeyBoard
  **
- ** animate midi input from jack on the keyboard in a extra thread
+ ** animate midi input from jack on the keyboard with a timer in the reactor
  ** 
  */
 
 class AnimatedKeyBoard {
 private:
-    std::atomic<bool> _execute;
-    std::thread _thd;
+    mamba::Reactor *reactor;
+    std::atomic<int> timer_fd;
 
 public:
-    AnimatedKeyBoard();
+    AnimatedKeyBoard(mamba::Reactor *reactor);
     ~AnimatedKeyBoard();
     void stop();
     void start(int interval, std::function<void(void)> func);
@@ -130,6 +135,54 @@ public:
 };
 
 
+/****************************************************************
+ ** class UiCommandQueue
+ **
+ ** post redraw commands from any thread to the GUI thread,
+ ** commands are bits in a atomic mask, so repeated posts coalesce.
+ ** The GUI thread is woken by a ClientMessage send over a extra
+ ** Display connection, so posting never takes the main Display lock.
+ ** 
+ */
+
+typedef enum {
+    UI_TRANSPORT   = 1 << 0,
+    UI_BPM         = 1 << 1,
+    UI_TIME_LINE   = 1 << 2,
+    UI_RECORD_OFF  = 1 << 3,
+    UI_KEYS        = 1 << 4,
+    UI_SHOW        = 1 << 5,
+    UI_HIDE        = 1 << 6,
+    UI_QUIT        = 1 << 7,
+    UI_PIANO_ROLL  = 1 << 8,
+    UI_MIDI_MONITOR = 1 << 9,
+    UI_SYNTH       = 1 << 10,
+} UiCommand;
+
+class UiCommandQueue {
+private:
+    std::atomic<unsigned int> pending;
+    std::mutex wake_mutex;
+    // wakes wait() when there is no GUI
+    std::condition_variable wake_cv;
+    Display *wake_dpy;
+    Display *main_dpy;
+    Window target;
+    void wake();
+
+public:
+    UiCommandQueue();
+    ~UiCommandQueue();
+    Atom frame_atom;
+    void init(Display *dpy, Window w);
+    void close();
+    void post(unsigned int cmd);
+    unsigned int take() noexcept;
+    // block until commands are pending and take them, used headless
+    unsigned int wait();
+    bool is_frame_event(XEvent *xev) const noexcept;
+};
+
 /****************************************************************
  ** class XKeyBoard
  **
@@ -160,6 +213,8 @@ private:
     Widget_t *looper;
     Widget_t *view_channels;
     Widget_t *free_wheel;
+    Widget_t *overdub_mode;
+    Widget_t *omni_mode;
     Widget_t *info;
     Widget_t *mapping;
     Widget_t *keymap;
@@ -199,6 +254,9 @@ private:
     std::vector<std::string> file_names;
     std::vector<std::string> recent_files;
     std::vector<std::string> recent_sfonts;
+    // row in the instrument combobox -> index in xsynth->instruments
+    std::vector<int> instrument_rows;
+    std::string instrument_filter;
 
     int main_x;
     int main_y;
@@ -209,11 +267,19 @@ private:
     int mprogram;
     int mbpm;
     int song_bpm;
+    // last engine state seen by the animation timer
+    mamba::EngineState last_state;
     int keylayout;
     int octave;
     int mchannel;
     int freewheel;
+    int overdub;
+    int omni;
     int run_one_more;
+    int time_line_skip;
+    // set by the animation when the engine process has quit
+    bool engine_lost;
+    vfunc win_event_loop;
     int lchannels;
     bool need_save;
     bool pitch_scroll;
@@ -223,12 +289,17 @@ private:
     int view_controls;
     int view_program;
     int width_inc;
+    bool instruments_dirty;
+    std::atomic<bool> synth_loading;
+    std::future<void> synth_loader;
+    bool soundfonts_dirty;
 
     std::string remove_sub (std::string a, std::string b);
     static void get_note(Widget_t *w, const int *key, const bool on_off) noexcept;
     static void get_all_notes_off(Widget_t *w, const int *value) noexcept;
 
     static void info_callback(void *w_, void* user_data);
+    static void show_about(void *w_);
     static void file_callback(void *w_, void* user_data);
     static void view_callback(void *w_, void* user_data);
     static void key_size_callback(void *w_, void* user_data);
@@ -263,9 +334,12 @@ private:
     static void record_callback(void *w_, void* user_data);
     static void play_callback(void *w_, void* user_data) noexcept;
     static void freewheel_callback(void *w_, void* user_data) noexcept;
+    static void overdub_callback(void *w_, void* user_data) noexcept;
+    static void omni_callback(void *w_, void* user_data) noexcept;
     static void clear_loops_callback(void *w_, void* user_data) noexcept;
     static void view_channels_callback(void *w_, void* user_data) noexcept;
     static void animate_midi_keyboard(void *w_);
+    static void win_event_callback(void *w_, void* event, Xputty *main, void* user_data);
     static void dialog_save_response(void *w_, void* user_data);
     static void dnd_load_response(void *w_, void* user_data);
 
@@ -307,6 +381,7 @@ private:
     static void channel_pressure_callback(void *w_, void* user_data);
     static void instrument_callback(void *w_, void* user_data);
     static void soundfont_callback(void *w_, void* user_data);
+    static void instrument_filter_key(void *w_, void *key_, void *user_data);
 
     Widget_t *add_keyboard_knob(Widget_t *parent, const char * label,
                                 int x, int y, int width, int height);
@@ -318,19 +393,33 @@ private:
     void rounded_rectangle(cairo_t *cr,float x, float y, float width, float height);
     void pattern_in(Widget_t *w, Color_state st, int height);
     void pattern_out(Widget_t *w, int height);
-    void find_next_beat_time(double *absoluteTime);
     void get_alsa_port_menu();
     void nsm_show_ui();
     void nsm_hide_ui();
+    void render_frame();
+    void synth_ready();
     void signal_handle (int sig);
     void exit_handle (int sig);
     void quit_by_jack();
-    void get_midi_in(int c, int n, bool on);
+    void quit_by_osc();
+    void quit_by_engine();
+    // send a looper command to the engine process, false when not attached
+    bool to_engine(int type, int value) noexcept;
+    // files, synth and connections belong to the engine process,
+    // tell so and return true when attached to one
+    bool engine_owns();
+    // take the notes the engine has posted into the key matrix
+    void get_midi_in();
     void recent_file_manager(const char* file_);
     void build_remove_menu();
+    void undo_loops(bool redo);
+    void capture_loop();
     void build_recent_menu();
     void recent_sfont_manager(const char* file_);
     void build_sfont_menu();
+    void fill_instrument_list();
+    void fill_soundfont_list();
+    void set_active_instrument(int i);
 public:
     XKeyBoard(xjack::XJack *xjack, xalsa::XAlsa *xalsa, xsynth::XSynth *xsynth,
         mamba::MidiMessenger *mmessage, nsmhandler::NsmSignalHandler& nsmsig,
@@ -348,8 +437,15 @@ public:
     Widget_t *win;
     Widget_t *wid;
     Widget_t *fs[3];
+    UiCommandQueue uiq;
+    // per thread class scheduling from the config
+    mamba::ThreadSched sched;
+    xpianoroll::XPianoRoll proll;
+    xmidimonitor::XMidiMonitor mmonitor;
     int visible;
     int volume;
+    // the engine process the GUI is attached to, NULL when it run the engine itself
+    mamba::EngineLink *link;
 
     void init_ui(Xputty *app);
     void init_synth_ui(Widget_t *win);
@@ -358,7 +454,17 @@ public:
     void show_ui(int present);
     void show_synth_ui(int present);
     void read_config();
+    bool read_loops(std::vector<mamba::MidiEvent> *play);
+    // apply the thread settings once jack is active
+    void start_engine_sched(mamba::Reactor *midi_reactor);
+    // load the soundfont in a worker thread, the GUI is updated when done
+    void start_synth();
+    void wait_synth() { if (synth_loader.valid()) synth_loader.wait(); }
+    // drive the engine from OSC until quit, without any window
+    void run_headless(xosc::OscControl *osc, const char *port, const char *midi_file);
     void save_config();
+    // drive the engine process behind link instead of the own XJack
+    void attach_engine(mamba::EngineLink *link);
     void set_config(const char *name, const char *client_id, bool op_gui);
 
     static void dialog_load_response(void *w_, void* user_data);
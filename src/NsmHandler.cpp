@@ -28,44 +28,33 @@ namespace nsmhandler {
 /****************************************************************
  ** class NsmWatchDog
  **
- ** Watch for incomming messages from NSM server in a extra timeout thread
+ ** Watch for incomming messages from NSM server in the reactor thread,
+ ** call func when the OSC socket is readable
  ** 
  */
 
-NsmWatchDog::NsmWatchDog() 
-    :_execute(false) {
+NsmWatchDog::NsmWatchDog(mamba::Reactor *reactor_)
+    : reactor(reactor_),
+    watch_fd(-1) {
 }
 
 NsmWatchDog::~NsmWatchDog() {
-    if( _execute.load(std::memory_order_acquire) ) {
-        stop();
-    };
+    stop();
 }
 
 void NsmWatchDog::stop() {
-    _execute.store(false, std::memory_order_release);
-    if (_thd.joinable()) {
-        _thd.join();
-    }
+    reactor->remove(watch_fd);
+    watch_fd = -1;
 }
 
-void NsmWatchDog::start(int interval, std::function<void(void)> func) {
-    if( _execute.load(std::memory_order_acquire) ) {
-        stop();
-    };
-    _execute.store(true, std::memory_order_release);
-    _thd = std::thread([this, interval, func]() {
-        while (_execute.load(std::memory_order_acquire)) {
-            func();                   
-            std::this_thread::sleep_for(
-                std::chrono::milliseconds(interval));
-        }
-    });
+void NsmWatchDog::start(int fd, std::function<void(void)> func) {
+    stop();
+    if (reactor->add_fd(fd, EPOLLIN, [func] (uint32_t) {func();}))
+        watch_fd = fd;
 }
 
 bool NsmWatchDog::is_running() const noexcept {
-    return ( _execute.load(std::memory_order_acquire) && 
-             _thd.joinable() );
+    return watch_fd >= 0;
 }
 
 
@@ -76,8 +65,8 @@ bool NsmWatchDog::is_running() const noexcept {
  ** and signal the UI thread to set up the variables
  */
 
-NsmHandler::NsmHandler(NsmSignalHandler *nsmsig_)
-    : poll(),
+NsmHandler::NsmHandler(NsmSignalHandler *nsmsig_, mamba::Reactor *reactor)
+    : poll(reactor),
     nsmsig(nsmsig_),
     nsm(0),
     wait_id(true),
@@ -91,6 +80,7 @@ NsmHandler::NsmHandler(NsmSignalHandler *nsmsig_)
 }
 
 NsmHandler::~NsmHandler() {
+    poll.stop();
     if (nsm) {
         nsm_free(nsm);
         nsm = 0;
@@ -133,7 +123,9 @@ void NsmHandler::_poll_nsm(void* arg) {
 }
 
 void NsmHandler::_nsm_start_poll() {
-    poll.start(200, std::bind(_poll_nsm,this));
+    // the OSC messages are handled as soon as they arrive
+    poll.start(lo_server_get_socket_fd(((struct _nsm_client_t*)nsm)->_server),
+                                                std::bind(_poll_nsm,this));
 }
 
 int NsmHandler::_nsm_open (const char *name, const char *display_name,
@@ -26,7 +26,10 @@
 #include <future>
 #include <sigc++/sigc++.h>
 
+#include <sys/epoll.h>
+
 #include "nsm.h"
+#include "Mamba.h"
 
 #pragma once
 
@@ -78,20 +81,21 @@ public:
 /****************************************************************
  ** class NsmWatchDog
  **
- ** Watch for incomming messages from NSM server in a extra thread
+ ** Watch for incomming messages from NSM server in the reactor thread,
+ ** which is woken up when the OSC socket is readable
  ** 
  */
 
 class NsmWatchDog {
 private:
-    std::atomic<bool> _execute;
-    std::thread _thd;
+    mamba::Reactor *reactor;
+    int watch_fd;
 
 public:
-    NsmWatchDog();
+    NsmWatchDog(mamba::Reactor *reactor);
     ~NsmWatchDog();
     void stop();
-    void start(int interval, std::function<void(void)> func);
+    void start(int fd, std::function<void(void)> func);
     bool is_running() const noexcept;
 };
 
@@ -126,7 +130,7 @@ class NsmHandler {
     static int nsm_save ( char **out_msg, void *userdata );
     static void nsm_show ( void *userdata );
     static void nsm_hide ( void *userdata );
-    NsmHandler(NsmSignalHandler *nsmsig);
+    NsmHandler(NsmSignalHandler *nsmsig, mamba::Reactor *reactor);
     ~NsmHandler();
 };
 
@@ -0,0 +1,142 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "XAllocCheck.h"
+
+#ifdef RT_ALLOC_CHECK
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <execinfo.h>
+
+// the glibc implementations behind malloc and friends
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+}
+
+
+namespace alloccheck {
+
+typedef enum {
+    MALLOC,
+    CALLOC,
+    REALLOC,
+    FREE,
+} Kind;
+
+typedef struct {
+    Kind kind;
+    size_t size;
+    int depth;
+    void *frames[24];
+} Hit;
+
+static const char *kind_names[] = {"malloc", "calloc", "realloc", "free"};
+
+// all storage is static, so logging never allocate
+static const int max_hits = 256;
+static Hit hits[max_hits];
+static std::atomic<int> hit_count(0);
+static std::atomic<long> total_count(0);
+static thread_local bool in_rt = false;
+static thread_local bool in_hook = false;
+
+static void log_hit(Kind kind, size_t size) noexcept {
+    if (!in_rt || in_hook) return;
+    in_hook = true;
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    int i = hit_count.fetch_add(1, std::memory_order_relaxed);
+    if (i < max_hits) {
+        hits[i].kind = kind;
+        hits[i].size = size;
+        hits[i].depth = backtrace(hits[i].frames, 24);
+    }
+    in_hook = false;
+}
+
+void init() {
+    // the first backtrace() call loads libgcc and allocate
+    void *frames[4];
+    backtrace(frames, 4);
+    atexit(report);
+}
+
+void enter_rt() noexcept {
+    in_rt = true;
+}
+
+void leave_rt() noexcept {
+    in_rt = false;
+}
+
+void report() {
+    const long total = total_count.load(std::memory_order_relaxed);
+    if (!total) {
+        fprintf(stderr, "alloccheck: no allocation in the realtime thread\n");
+        return;
+    }
+    const int n = hit_count.load(std::memory_order_relaxed);
+    fprintf(stderr, "alloccheck: %ld allocator calls in the realtime thread\n", total);
+    for (int i = 0; i < n && i < max_hits; i++) {
+        fprintf(stderr, "alloccheck: #%d %s %zu bytes\n", i, kind_names[hits[i].kind], hits[i].size);
+        fflush(stderr);
+        // skip log_hit() and the interposed function
+        if (hits[i].depth > 2)
+            backtrace_symbols_fd(hits[i].frames + 2, hits[i].depth - 2, STDERR_FILENO);
+    }
+    if (n > max_hits)
+        fprintf(stderr, "alloccheck: only the first %d calls were recorded\n", max_hits);
+}
+
+} // namespace alloccheck
+
+
+extern "C" {
+
+void *malloc(size_t size) {
+    alloccheck::log_hit(alloccheck::MALLOC, size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    alloccheck::log_hit(alloccheck::CALLOC, n * size);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    alloccheck::log_hit(alloccheck::REALLOC, size);
+    return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+    if (p) alloccheck::log_hit(alloccheck::FREE, 0);
+    __libc_free(p);
+}
+
+} // extern "C"
+
+#endif // RT_ALLOC_CHECK
@@ -0,0 +1,67 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#pragma once
+
+#ifndef XALLOCCHECK_H
+#define XALLOCCHECK_H
+
+
+namespace alloccheck {
+
+
+/****************************************************************
+ ** allocation detector for the realtime thread
+ **
+ ** build with -DRT_ALLOC_CHECK (make alloccheck) to interpose
+ ** malloc/calloc/realloc/free, every call made while a RtScope
+ ** is alive on the calling thread is logged with a backtrace
+ ** into a preallocated buffer and reported on exit.
+ ** Without RT_ALLOC_CHECK everything here compiles to nothing.
+ */
+
+#ifdef RT_ALLOC_CHECK
+
+// warm up backtrace() and register the exit report
+void init();
+void enter_rt() noexcept;
+void leave_rt() noexcept;
+void report();
+
+#else
+
+inline void init() {}
+inline void enter_rt() noexcept {}
+inline void leave_rt() noexcept {}
+inline void report() {}
+
+#endif
+
+// mark the scope of the jack process callback
+class RtScope {
+public:
+    RtScope() noexcept { enter_rt(); }
+    ~RtScope() { leave_rt(); }
+};
+
+} // namespace alloccheck
+
+#endif //XALLOCCHECK_H_
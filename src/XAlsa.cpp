@@ -21,6 +21,9 @@
 
 #include "XAlsa.h"
 
+#include <poll.h>
+#include <sys/epoll.h>
+
 namespace xalsa {
 
 
@@ -83,7 +86,7 @@ bool XAlsaMidiMessenger::send_midi_cc(const uint8_t *midi_get,
 
 XAlsa::XAlsa(std::function<void(
         int _cc, int _pg, int _bgn, int _num, bool have_channel) > 
-        send_to_jack_) 
+        send_to_jack_, mamba::Reactor *reactor_) 
     :send_to_jack(send_to_jack_),
     xamessage(),
     _execute(false),
@@ -91,12 +94,13 @@ XAlsa::XAlsa(std::function<void(
     sequencer = -1;
     in_port = -1;
     out_port = -1;
+    monitor = NULL;
+    reactor = reactor_;
+    out_event.store(-1, std::memory_order_release);
 }
 
 XAlsa::~XAlsa() {
-    if( _execute.load(std::memory_order_acquire) ) {
-        xalsa_stop();
-    };
+    xalsa_stop();
     if (in_port < 0)
         snd_seq_delete_simple_port(seq_handle, in_port);
     if (out_port < 0)
@@ -122,11 +126,8 @@ int XAlsa::xalsa_init(const char *client_name, const char *input, const char *ou
     return sequencer;
 }
 
-void XAlsa::xalsa_set_priority(int priority) {
-    sched_param sch;
-    sch.sched_priority = priority/2;
-    pthread_setschedparam(_thd_out.native_handle(), SCHED_FIFO, &sch);
-    pthread_setschedparam(_thd.native_handle(), SCHED_FIFO, &sch);
+void XAlsa::xalsa_set_monitor(mamba::MidiMonitor *monitor_) {
+    monitor = monitor_;
 }
 
 void XAlsa::xalsa_get_ports(std::vector<std::string> *iports, std::vector<std::string> *oports) {
@@ -253,13 +254,10 @@ void XAlsa::xalsa_odisconnect(int client, int port) {
 
 void XAlsa::xalsa_stop() {
     _execute.store(false, std::memory_order_release);
-    if (_thd.joinable()) {
-        _thd.join();
-    }
+    for (auto fd : in_fds) reactor->remove(fd);
+    in_fds.clear();
     _execute_out.store(false, std::memory_order_release);
-    if (_thd_out.joinable()) {
-        _thd_out.join();
-    }
+    reactor->remove(out_event.exchange(-1, std::memory_order_acq_rel));
 }
 
 void XAlsa::xalsa_start(std::function<void(int,int,bool)> set_key) {
@@ -267,10 +265,18 @@ void XAlsa::xalsa_start(std::function<void(int,int,bool)> set_key) {
     xalsa_start_output();
 }
 
+void XAlsa::xalsa_set_priority(int priority) {
+    sched_param sch;
+    sch.sched_priority = priority/2;
+    if (pthread_setschedparam(reactor->thread_id(), SCHED_FIFO, &sch))
+        fprintf(stderr, "alsa: couldn't set realtime priority %i\n", sch.sched_priority);
+}
+
 void XAlsa::xalsa_output_notify(const uint8_t *midi_get, uint8_t num) noexcept {
     if (is_running()) {
-        if (xamessage.send_midi_cc(midi_get, num))
-            cv_out.notify_one();
+        const int efd = out_event.load(std::memory_order_acquire);
+        if (xamessage.send_midi_cc(midi_get, num) && efd >= 0)
+            mamba::Reactor::notify(efd);
     }
 }
 
@@ -278,99 +284,125 @@ void XAlsa::xalsa_start_output() {
     if( _execute_out.load(std::memory_order_acquire) ) {
         xalsa_stop();
     };
-    _execute_out.store(true, std::memory_order_release);
-    _thd_out = std::thread([this]() {
-        snd_seq_event_t ev;
-        uint8_t event[3] = {0};
-        while (_execute_out.load(std::memory_order_acquire)) {
-            std::unique_lock<std::mutex> lk(m);
-            cv_out.wait(lk);
-            //do output
-            if (_execute_out.load(std::memory_order_acquire)) {
-                int i = xamessage.next();
-                while ( i>=0) {
-                    xamessage.fill(event, i);
-                    uint8_t channel = event[0]&0x0f;
-                    uint8_t num = event[0] & 0xf0;
+    const int efd = reactor->add_event([this] () {xalsa_output();});
+    out_event.store(efd, std::memory_order_release);
+    _execute_out.store(efd >= 0, std::memory_order_release);
+}
+
+// send all queued jack midi events to the alsa output, reactor thread
+void XAlsa::xalsa_output() {
+    if (!_execute_out.load(std::memory_order_acquire)) return;
+    snd_seq_event_t ev;
+    uint8_t event[3] = {0};
+    int i = xamessage.next();
+    while ( i>=0) {
+        xamessage.fill(event, i);
+        if (monitor) monitor->log(mamba::MidiMonitor::ALSA_OUT, event, xamessage.size(i));
+        uint8_t channel = event[0]&0x0f;
+        uint8_t num = event[0] & 0xf0;
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_subs(&ev);
+        snd_seq_ev_set_direct(&ev);
+
+        if (num == 0x90) {
+            snd_seq_ev_set_noteon(&ev, channel, event[1], event[2]);
+        } else if (num == 0x80) {
+            snd_seq_ev_set_noteoff(&ev, channel, event[1], event[2]);
+        } else if (num == 0xB0) {
+            if (event[1] == 120 || event[1] == 123) {
+                // send ALL_NOTES_OFF and ALL_SOUND_OFF to all channels
+                for(int i = 0; i<16;i++) {
                     snd_seq_ev_clear(&ev);
                     snd_seq_ev_set_subs(&ev);
                     snd_seq_ev_set_direct(&ev);
-
-                    if (num == 0x90) {
-                        snd_seq_ev_set_noteon(&ev, channel, event[1], event[2]);
-                    } else if (num == 0x80) {
-                        snd_seq_ev_set_noteoff(&ev, channel, event[1], event[2]);
-                    } else if (num == 0xB0) {
-                        if (event[1] == 120 || event[1] == 123) {
-                            // send ALL_NOTES_OFF and ALL_SOUND_OFF to all channels
-                            for(int i = 0; i<16;i++) {
-                                snd_seq_ev_clear(&ev);
-                                snd_seq_ev_set_subs(&ev);
-                                snd_seq_ev_set_direct(&ev);
-                                snd_seq_ev_set_controller(&ev, i, event[1], event[2]);
-                                snd_seq_event_output(seq_handle, &ev);
-                                snd_seq_drain_output(seq_handle);
-                            }
-                        } else {
-                            snd_seq_ev_set_controller(&ev, channel, event[1], event[2]);
-                        }
-                    } else if (num == 0xC0) {
-                        snd_seq_ev_set_pgmchange(&ev, channel, event[1]);
-                    } else if (num == 0xE0) {
-                        snd_seq_ev_set_pitchbend(&ev, channel, ((event[2] <<7 | event[1]) -8192));
-                    }
-
-                    // send now
+                    snd_seq_ev_set_controller(&ev, i, event[1], event[2]);
                     snd_seq_event_output(seq_handle, &ev);
                     snd_seq_drain_output(seq_handle);
-                    i = xamessage.next();
                 }
+            } else {
+                snd_seq_ev_set_controller(&ev, channel, event[1], event[2]);
             }
-        } 
-    });
-}            
+        } else if (num == 0xC0) {
+            snd_seq_ev_set_pgmchange(&ev, channel, event[1]);
+        } else if (num == 0xE0) {
+            snd_seq_ev_set_pitchbend(&ev, channel, ((event[2] <<7 | event[1]) -8192));
+        }
+
+        // send now
+        snd_seq_event_output(seq_handle, &ev);
+        snd_seq_drain_output(seq_handle);
+        i = xamessage.next();
+    }
+}
 
-void XAlsa::xalsa_start_input(std::function<void(int,int,bool)> set_key) {
+void XAlsa::xalsa_start_input(std::function<void(int,int,bool)> set_key_) {
     if( _execute.load(std::memory_order_acquire) ) {
         xalsa_stop();
     };
-    _execute.store(true, std::memory_order_release);
-    _thd = std::thread([this, set_key]() {
-        while (_execute.load(std::memory_order_acquire)) {
-            if (sequencer < 0) {
-                _execute.store(false, std::memory_order_release);
-                continue;
-            }
-            snd_seq_event_t *ev = NULL;
-            snd_seq_event_input(seq_handle, &ev);
-            if (ev->type == SND_SEQ_EVENT_NOTEON) {
-                send_to_jack(0x90 | ev->data.control.channel, ev->data.note.note,ev->data.note.velocity, 3, true);
-                if (ev->data.note.velocity)
-                    set_key(ev->data.control.channel, ev->data.note.note, true);
-                else
-                    set_key(ev->data.control.channel, ev->data.note.note, false);
-            } else if (ev->type == SND_SEQ_EVENT_NOTEOFF) {
-                send_to_jack(0x80 | ev->data.control.channel, ev->data.note.note,ev->data.note.velocity, 3, true);
+    if (sequencer < 0) return;
+    set_key = set_key_;
+    // read without blocking, the reactor watch the sequencer descriptors
+    snd_seq_nonblock(seq_handle, 1);
+    int n = snd_seq_poll_descriptors_count(seq_handle, POLLIN);
+    std::vector<struct pollfd> pfds(n);
+    n = snd_seq_poll_descriptors(seq_handle, pfds.data(), n, POLLIN);
+    for (int i = 0; i < n; i++) {
+        if (reactor->add_fd(pfds[i].fd, EPOLLIN, [this] (uint32_t) {xalsa_input();}))
+            in_fds.push_back(pfds[i].fd);
+    }
+    _execute.store(!in_fds.empty(), std::memory_order_release);
+}
+
+// forward all pending alsa midi input to jack, reactor thread
+void XAlsa::xalsa_input() {
+    if (!_execute.load(std::memory_order_acquire)) return;
+    snd_seq_event_t *ev = NULL;
+    while (snd_seq_event_input(seq_handle, &ev) >= 0 && ev) {
+        uint8_t midi[3] = {0};
+        uint8_t num = 0;
+        if (ev->type == SND_SEQ_EVENT_NOTEON) {
+            midi[0] = 0x90 | ev->data.control.channel;
+            midi[1] = ev->data.note.note;
+            midi[2] = ev->data.note.velocity;
+            num = 3;
+            if (ev->data.note.velocity)
+                set_key(ev->data.control.channel, ev->data.note.note, true);
+            else
                 set_key(ev->data.control.channel, ev->data.note.note, false);
-            } else if(ev->type == SND_SEQ_EVENT_CONTROLLER) {
-                send_to_jack(0xB0 | ev->data.control.channel, ev->data.control.param, ev->data.control.value, 3, true);
-            } else if(ev->type == SND_SEQ_EVENT_PGMCHANGE) {
-                send_to_jack( 0xC0| ev->data.control.channel, ev->data.control.value, 0, 2, true);
-            } else if(ev->type == SND_SEQ_EVENT_PITCHBEND) {
-                unsigned int change = (unsigned int)(ev->data.control.value);
-                unsigned int low = change & 0x7f;  // Low 7 bits
-                unsigned int high = (change >> 7) & 0x7f;  // High 7 bits
-                send_to_jack(0xE0| ev->data.control.channel,  low, high, 3, true);
-            }
-            snd_seq_free_event(ev);
-        } 
-    });
+        } else if (ev->type == SND_SEQ_EVENT_NOTEOFF) {
+            midi[0] = 0x80 | ev->data.control.channel;
+            midi[1] = ev->data.note.note;
+            midi[2] = ev->data.note.velocity;
+            num = 3;
+            set_key(ev->data.control.channel, ev->data.note.note, false);
+        } else if(ev->type == SND_SEQ_EVENT_CONTROLLER) {
+            midi[0] = 0xB0 | ev->data.control.channel;
+            midi[1] = ev->data.control.param;
+            midi[2] = ev->data.control.value;
+            num = 3;
+        } else if(ev->type == SND_SEQ_EVENT_PGMCHANGE) {
+            midi[0] = 0xC0 | ev->data.control.channel;
+            midi[1] = ev->data.control.value;
+            num = 2;
+        } else if(ev->type == SND_SEQ_EVENT_PITCHBEND) {
+            unsigned int change = (unsigned int)(ev->data.control.value);
+            midi[0] = 0xE0 | ev->data.control.channel;
+            midi[1] = change & 0x7f;  // Low 7 bits
+            midi[2] = (change >> 7) & 0x7f;  // High 7 bits
+            num = 3;
+        }
+        if (num) {
+            send_to_jack(midi[0], midi[1], midi[2], num, true);
+            if (monitor) monitor->log(mamba::MidiMonitor::ALSA_IN, midi, num);
+        }
+        snd_seq_free_event(ev);
+        ev = NULL;
+    }
 }
 
 bool XAlsa::is_running() const noexcept {
-    return ( _execute.load(std::memory_order_acquire) && 
-             _thd.joinable() && _execute_out.load(std::memory_order_acquire)
-             && _thd_out.joinable());
+    return ( _execute.load(std::memory_order_acquire) &&
+             _execute_out.load(std::memory_order_acquire));
 }
 
 } // namespace xalsa
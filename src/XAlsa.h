@@ -20,12 +20,12 @@
 
 #include <atomic>
 #include <vector>
-#include <thread>
-#include <condition_variable>
 #include <functional>
 
 #include <alsa/asoundlib.h>
 
+#include "Mamba.h"
+
 
 #pragma once
 
@@ -81,27 +81,34 @@ private:
     int in_port;
     // output port number
     int out_port;
-    // control the midi input loop
+    // midi input is handled
     std::atomic<bool> _execute;
-    // thread running the midi input loop
-    std::thread _thd;
-    // control the midi output loop
+    // midi output is handled
     std::atomic<bool> _execute_out;
-    // wait for notify in the midi output loop
-    std::condition_variable cv_out;
-    // thread running the midi output loop
-    std::thread _thd_out;
-    // the mutex for the lock in the midi output loop
-    std::mutex m;
-    // start the thread for midi input handling
+    // run the midi in/output handlers, a reactor of its own
+    // so the forwarding never wait behind the housekeeping
+    mamba::Reactor *reactor;
+    // sequencer poll descriptors watched by the reactor
+    std::vector<int> in_fds;
+    // wake up the midi output handler, read by the jack thread
+    std::atomic<int> out_event;
+    // update the keyboard for midi input
+    std::function<void(int,int,bool)> set_key;
+    // log the alsa midi traffic when set
+    mamba::MidiMonitor *monitor;
+    // watch the sequencer for midi input
     void xalsa_start_input(std::function<void(int,int,bool)> set_key);
-    // start the port for midi output handling
+    // register the midi output handler
     void xalsa_start_output();
+    // forward pending midi input to jack
+    void xalsa_input();
+    // send queued midi events to the alsa output
+    void xalsa_output();
 
 public:
     XAlsa(std::function<void(
         int _cc, int _pg, int _bgn, int _num, bool have_channel)>
-        send_to_jack);
+        send_to_jack, mamba::Reactor *reactor);
     ~XAlsa();
     // get all available ports for alsa midi in/output
     void xalsa_get_ports(std::vector<std::string> *ports,
@@ -120,14 +127,16 @@ public:
     void xalsa_odisconnect(int client, int port);
     // init the sequencer and create ports
     int  xalsa_init(const char *client_name, const char *input, const char *output);
-    // start the threads for alsa midi handling
+    // start the alsa midi handling in the reactor
     void xalsa_start(std::function<void(int,int,bool)> set_key);
-    // stop the threads for alsa midi handling
+    // stop the alsa midi handling
     void xalsa_stop();
+    // run the alsa reactor with a realtime priority below jack
+    void xalsa_set_priority(int priority);
     // push mdi message from jack into 'queue' and inform output thread that work is to do
     void xalsa_output_notify(const uint8_t *midi_get, uint8_t num) noexcept;
-    // set the priority for the I/O threads
-    void xalsa_set_priority(int priority);
+    // tap the alsa midi in/output into the monitor
+    void xalsa_set_monitor(mamba::MidiMonitor *monitor);
     // check if the sequencer is running
     bool is_running() const noexcept;
 };
@@ -19,6 +19,8 @@
  */
 
 #include "XJack.h"
+#include "XAllocCheck.h"
+#include <cstring>
 #include <jack/thread.h>
 
 namespace xjack {
@@ -86,26 +88,28 @@ bool MidiClockToBpm::time_to_bpm(double time, unsigned int* bpm_) {
 
 XJack::XJack(mamba::MidiMessenger *mmessage_,
         std::function<void(const uint8_t*,uint8_t) >  send_to_alsa_,
-        std::function<void(int)>  set_alsa_priority_)
+        mamba::Reactor *reactor)
     : sigc::trackable(),
      mmessage(mmessage_),
      mp(),
      send_to_alsa(send_to_alsa_),
-     set_alsa_priority(set_alsa_priority_),
      event_count(0),
      stop(0),
      deltaTime(0),
      client(NULL),
      rec() {
-        transport_state_changed.store(false, std::memory_order_release);
-        transport_set.store(0, std::memory_order_release);
         transport_state = JackTransportStopped;
-        bpm_changed.store(false, std::memory_order_release);
-        bpm_set.store(0, std::memory_order_release);
+        state.store(&local_state, std::memory_order_release);
+        link.store(NULL, std::memory_order_release);
+        cycle = 0;
+        bpm = 0;
         record_off.store(false, std::memory_order_release);
         start = 0;
         NotOn = 0;
+        cycle_usec = 0;
+        pending_count = 0;
         absoluteStart = 0;
+        dubStart = 0;
         record = 0;
         record_finished = 0;
         play = 0;
@@ -115,13 +119,14 @@ XJack::XJack(mamba::MidiMessenger *mmessage_,
         freewheel = 0;
         view_channels = 0;
         max_loop_time = 0;
-        playPosTime = 0.0;
+        playPosTick = 0;
         fresh_take = true;
         first_play = true;
         store1.reserve(256);
         store2.reserve(256);
         st = &store1;
         rec.st = &store1;
+        rec.set_reactor(reactor);
         client_name = "Mamba";
         bpm_ratio = 1.0;
         stPlay = 0;
@@ -131,18 +136,34 @@ XJack::XJack(mamba::MidiMessenger *mmessage_,
         for ( int i = 0; i < 16; i++) posPlay[i] = 0;
         for ( int i = 0; i < 16; i++) startPlay[i] = 0;
         for ( int i = 0; i < 16; i++) stopPlay[i] = 0;
+        for ( int i = 0; i < 16; i++) {
+            playLoop[i] = rec.live_loop(i);
+            playGen[i] = rec.generation[i].load(std::memory_order_acquire);
+            loopLen[i] = 0;
+            prevTick[i] = 0;
+            sameTick[i] = 0;
+        }
 }
 
 XJack::~XJack() {
     if (client) jack_client_close (client);
+    rec.set_realtime(false);
     if (rec.is_running()) rec.stop();
 }
 
 int XJack::init_jack() {
+    return open_jack() && activate_jack();
+}
+
+// connect to the server and register the ports, the process callback
+// isn't called before activate_jack()
+int XJack::open_jack() {
     if ((client = jack_client_open (client_name.c_str(), JackNullOption, NULL)) == 0) {
         fprintf (stderr, "jack server not running?\n");
         return 0;
     }
+    SampleRate = jack_get_sample_rate(client);
+    srms = SampleRate/1000;
 
     in_port = jack_port_register(
                   client, "in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
@@ -154,8 +175,30 @@ int XJack::init_jack() {
     jack_set_buffer_size_callback(client, jack_buffersize_callback, this);
     jack_set_process_callback(client, jack_process, this);
     jack_on_shutdown (client, jack_shutdown, this);
+    return 1;
+}
 
+// lock and touch the memory used by the process callback
+void XJack::prepare_rt() {
+    mamba::lock_memory();
+    // capture buffers, resize/clear writes them without changing the capacity
+    store1.resize(store1.capacity());
+    store1.clear();
+    store2.resize(store2.capacity());
+    store2.clear();
+    // loops, and the rings and stats inside this
+    for (int i = 0; i < 16; i++) {
+        mamba::LoopBuffer loop = rec.loop(i);
+        mamba::prefault((void*)loop->data(), loop->capacity() * sizeof(mamba::MidiEvent));
+    }
+    mamba::prefault(this, sizeof(XJack));
+}
+
+int XJack::activate_jack() {
+    prepare_rt();
+    rec.set_realtime(true);
     if (jack_activate (client)) {
+        rec.set_realtime(false);
         fprintf (stderr, "cannot activate client");
         return 0;
     }
@@ -165,9 +208,6 @@ int XJack::init_jack() {
     } else {
         fprintf (stderr, "jack running with realtime priority\n");
         priority = jack_client_real_time_priority(client);
-        if (priority > 2) {
-            set_alsa_priority(priority);
-        }
     }
     return 1;
 }
@@ -175,159 +215,307 @@ int XJack::init_jack() {
 // record MIDI events 
 inline void XJack::record_midi(unsigned char* midi_send, unsigned int n, int i) noexcept {
     stop = jack_last_frame_time(client)+n;
-    deltaTime = (double)(((stop) - start)/(double)SampleRate); // seconds
-    absoluteTime = (double)(((stop) - absoluteStart)/(double)SampleRate); // seconds
-    absoluteRecordTime = (double)(((stop) - absoluteRecordStart)/(double)SampleRate); // seconds
     start = jack_last_frame_time(client)+n;
-    if (((midi_send[0] & 0xf0) == 0x90) && midi_send[2] > 0) NotOn++;
-    else if (((midi_send[0] & 0xf0) == 0x90) && midi_send[2] == 0) NotOn--;
-    else if ((midi_send[0] & 0xf0) == 0x80) NotOn--;
-    if (absoluteRecordTime >= max_loop_time && !NotOn && (get_max_time_loop() > -1)) {
-        record_off.store(true, std::memory_order_release);
+    if (rec.overdub.load(std::memory_order_relaxed)) {
+        // time in the pass, the overdub run until it is stopped
+        absoluteTime = (double)(((stop) - dubStart)/(double)SampleRate); // seconds
+    } else {
+        absoluteTime = (double)(((stop) - absoluteStart)/(double)SampleRate); // seconds
+        absoluteRecordTime = (double)(((stop) - absoluteRecordStart)/(double)SampleRate); // seconds
+        if (((midi_send[0] & 0xf0) == 0x90) && midi_send[2] > 0) NotOn++;
+        else if (((midi_send[0] & 0xf0) == 0x90) && midi_send[2] == 0) NotOn--;
+        else if ((midi_send[0] & 0xf0) == 0x80) NotOn--;
+        // a omni take fill the loops itself, so it has no master loop
+        if (absoluteRecordTime >= max_loop_time && !NotOn &&
+                !rec.omni.load(std::memory_order_relaxed) && (get_max_time_loop() > -1)) {
+            record_off.store(true, std::memory_order_release);
+        }
     }
     unsigned char d = i > 2 ? midi_send[2] : 0;
-    const mamba::MidiEvent ev = {{midi_send[0], midi_send[1], d}, i, deltaTime, absoluteTime};
+    const mamba::MidiEvent ev = {{midi_send[0], midi_send[1], d}, (uint8_t)i,
+                                            mamba::MidiEvent::to_tick(absoluteTime)};
+    if (rec.omni.load(std::memory_order_relaxed)) {
+        rec.lane_push(ev);
+        return;
+    }
     st->push_back(ev);
     if (store1.size() >= 256) {
         st = &store2;
         rec.st = &store1;
-        rec.cv.notify_one();
+        rec.notify();
     } else if (store2.size() >= 256) {
         st = &store1;
         rec.st = &store2;
-        rec.cv.notify_one();
+        rec.notify();
     }
 }
 
-// get the master loop
+// get the master loop, from the loop lengths kept by take_loops()
 inline int XJack::get_max_time_loop() noexcept {
     int v = -1;
-     max_loop_time = 0.0;
+    uint32_t len = 0;
     for (int j = 0; j<16;j++) {
-        if (!rec.play[j].size()) continue;
-        const mamba::MidiEvent ev = rec.play[j][rec.play[j].size()-1];
-        if (ev.absoluteTime > max_loop_time) {
-            max_loop_time = ev.absoluteTime;
+        if (loopLen[j] > len) {
+            len = loopLen[j];
             v = j;
         }
     }
+    max_loop_time = (double)len / mamba::MidiEvent::ticks_per_second;
     return v;
 }
 
 // sync fresh recorded vector to play position
 inline int XJack::find_pos_for_playtime() noexcept {
     int pos = 0;
-    for(std::vector<mamba::MidiEvent>::const_iterator i = rec.play[mmessage->channel].begin();
-                                    i != rec.play[mmessage->channel].end(); ++i) {
-        if ((*i).absoluteTime >= playPosTime) return pos;
+    const std::vector<mamba::MidiEvent>& loop = *playLoop[mmessage->channel];
+    for(std::vector<mamba::MidiEvent>::const_iterator i = loop.begin();
+                                    i != loop.end(); ++i) {
+        if ((*i).tick >= playPosTick) return pos;
         pos++;
     }
     return pos;
 }
 
-// play all MIDI loops
-inline void XJack::play_midi(void *buf, unsigned int n) {
-    if (first_play) {
-        first_play = false;
+// take the loops published since the last cycle, the play position
+// in a replaced loop follows from the events played already
+inline void XJack::take_loops() noexcept {
+    for (int c = 0; c < 16; c++) {
+        const unsigned int g = rec.generation[c].load(std::memory_order_acquire);
+        const std::vector<mamba::MidiEvent> *loop = rec.live_loop(c);
+        if (loop == playLoop[c] && g == playGen[c]) continue;
+        playLoop[c] = loop;
+        playGen[c] = g;
+        loopLen[c] = loop->empty() ? 0 : loop->back().tick;
+        if (!posPlay[c]) continue;
+        auto first = std::lower_bound(loop->begin(), loop->end(), prevTick[c],
+            [] (const mamba::MidiEvent& ev, uint32_t tick) {
+                return ev.tick < tick;
+        });
+        auto last = std::upper_bound(first, loop->end(), prevTick[c],
+            [] (uint32_t tick, const mamba::MidiEvent& ev) {
+                return tick < ev.tick;
+        });
+        posPlay[c] = (first + std::min<ptrdiff_t>(sameTick[c], last - first)) - loop->begin();
+    }
+}
+
+// move the play position on channel c to pos
+inline void XJack::seek(int c, unsigned int pos) noexcept {
+    const std::vector<mamba::MidiEvent>& loop = *playLoop[c];
+    posPlay[c] = pos;
+    prevTick[c] = 0;
+    sameTick[c] = 0;
+    if (!pos || pos > loop.size()) return;
+    prevTick[c] = loop[pos-1].tick;
+    while (sameTick[c] < pos && loop[pos-1-sameTick[c]].tick == prevTick[c]) sameTick[c]++;
+}
+
+// play all MIDI loops, specialized on the mode flags of the current cycle
+template <bool RECORD, bool FREEWHEEL, bool FILTER>
+inline void XJack::play_midi(void *buf, unsigned int n, jack_nframes_t cycle_start, int channel, unsigned int skip) {
+    const jack_nframes_t now = cycle_start + n;
+    if (first_play.load(std::memory_order_relaxed) &&
+            first_play.exchange(false, std::memory_order_acq_rel)) {
         get_max_time_loop();
         pos = 0;
-        for (int i = 0; i < 16; i++) posPlay[i] = 0;
-        for (int i = 0; i < 16; i++) startPlay[i] = jack_last_frame_time(client)+n;
-        start = jack_last_frame_time(client)+n;
-        absoluteStart = jack_last_frame_time(client)+n;
-        stStart = jack_last_frame_time(client)+n;
+        for (int i = 0; i < 16; i++) seek(i, 0);
+        for (int i = 0; i < 16; i++) startPlay[i] = now;
+        start = now;
+        absoluteStart = now;
+        stStart = now;
     }
 
+    stPlay = now;
     for ( int i = 0; i < 16; i++) {
-        stPlay = jack_last_frame_time(client)+n;
-        if (!rec.play[i].size()) continue;
-        if (record && i == mmessage->channel) continue;
-        stopPlay[i] = jack_last_frame_time(client)+n;
-        if (posPlay[i] >= rec.play[i].size()) {
+        const std::vector<mamba::MidiEvent>& loop = *playLoop[i];
+        if (loop.empty()) continue;
+        if (RECORD && (skip & (1u<<i))) continue;
+        stopPlay[i] = now;
+        if (posPlay[i] >= loop.size()) {
             
             // this will sync all loops to the first recorded one
-            if (!freewheel) {
+            if (!FREEWHEEL) {
                 int ml = get_max_time_loop();
                 if (i != ml) continue;
-                for (int i = 0; i < 16; i++) posPlay[i] = 0;
-                for (int i = 0; i < 16; i++) startPlay[i] = jack_last_frame_time(client)+n;
-                start = jack_last_frame_time(client)+n;
-                absoluteStart = jack_last_frame_time(client)+n;
-                stStart = jack_last_frame_time(client)+n;
+                for (int i = 0; i < 16; i++) seek(i, 0);
+                for (int i = 0; i < 16; i++) startPlay[i] = now;
+                start = now;
+                absoluteStart = now;
+                stStart = now;
+                if (RECORD && rec.overdub.load(std::memory_order_relaxed)) dub_pass(now);
             } else {
-                posPlay[i] = 0;
-                startPlay[i] = jack_last_frame_time(client)+n;
+                seek(i, 0);
+                startPlay[i] = now;
+                if (RECORD && i == rec.dub_channel &&
+                    rec.overdub.load(std::memory_order_relaxed)) dub_pass(now);
             }
         }
         deltaTime = (double)(((stopPlay[i]) - startPlay[i])/(double)SampleRate); // seconds
-        const mamba::MidiEvent ev = rec.play[i][posPlay[i]];
-        if (deltaTime >= ev.deltaTime * bpm_ratio) {
-            playPosTime = ev.absoluteTime;
+        // walk the packed loop in order, the delta follows from the previous event
+        const mamba::MidiEvent ev = loop[posPlay[i]];
+        if (deltaTime >= (ev.tick - prevTick[i]) * bpm_ratio / mamba::MidiEvent::ticks_per_second) {
+            playPosTick = ev.tick;
             unsigned char* midi_send = jack_midi_event_reserve(buf, n, ev.num);
             if (midi_send) {
                 midi_send[0] = ev.buffer[0];
                 midi_send[1] = ev.buffer[1];
                 if(ev.num > 2)
                     midi_send[2] = ev.buffer[2];
-                bool ch = true;
-                if (mmessage->channel < 16 && view_channels) {
-                    if ((mmessage->channel) != (int(ev.buffer[0]&0x0f))) {
-                        ch = false;
-                    }
-                }
+                const bool ch = !FILTER || channel == int(ev.buffer[0]&0x0f);
                 send_to_alsa(midi_send, ev.num);
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
+                monitor.log(mamba::MidiMonitor::JACK_OUT, midi_send, ev.num);
                 if ((ev.buffer[0] & 0xf0) == 0x90 && ch) {   // Note On
                     if (ev.buffer[2] > 0) // velocity 0 treaded as Note Off
-                        std::async(std::launch::async, trigger_get_midi_in, (int(ev.buffer[0]&0x0f)), ev.buffer[1], true);
+                        post_key(mamba::EngineEvent::KEY_ON, ev.buffer[0], ev.buffer[1]);
                     else 
-                        std::async(std::launch::async, trigger_get_midi_in, (int(ev.buffer[0]&0x0f)), ev.buffer[1], false);
+                        post_key(mamba::EngineEvent::KEY_OFF, ev.buffer[0], ev.buffer[1]);
                 } else if ((ev.buffer[0] & 0xf0) == 0x80 && ch) {   // Note Off
-                    std::async(std::launch::async, trigger_get_midi_in, (int(ev.buffer[0]&0x0f)), ev.buffer[1], false);
+                    post_key(mamba::EngineEvent::KEY_OFF, ev.buffer[0], ev.buffer[1]);
                 }
-#pragma GCC diagnostic pop
             }
-            startPlay[i] = jack_last_frame_time(client)+n;
+            startPlay[i] = now;
             posPlay[i]++;
+            sameTick[i] = ev.tick == prevTick[i] ? sameTick[i] + 1 : 1;
+            prevTick[i] = ev.tick;
             return;
         }
     }
 }
 
-// jack process callback for the midi output
-inline void XJack::process_midi_out(void *buf, jack_nframes_t nframes) {
+// move the scheduled events into the sorted pending list,
+// the midi from the GUI of a engine process is due at now
+inline void XJack::take_scheduled(jack_nframes_t now) noexcept {
+    mamba::ScheduledMidi e;
+    mamba::EngineLink *l = link.load(std::memory_order_relaxed);
+    while (pending_count < max_pending) {
+        if (!scheduled.pop(&e)) {
+            if (!l || !l->midi.pop(&e)) break;
+            e.frame = now;
+        }
+        int j = pending_count++;
+        while (j > 0 && (int32_t)(pending[j-1].frame - e.frame) > 0) {
+            pending[j] = pending[j-1];
+            j--;
+        }
+        pending[j] = e;
+    }
+}
+
+// send all pending events due at frame, late events go out now
+template <bool RECORD>
+inline void XJack::send_scheduled(void *buf, unsigned int n, jack_nframes_t frame) noexcept {
+    int done = 0;
+    while (done < pending_count && (int32_t)(pending[done].frame - frame) <= 0) {
+        const mamba::ScheduledMidi& e = pending[done++];
+        unsigned char* midi_send = jack_midi_event_reserve(buf, n, e.num);
+        if (!midi_send) continue;
+        for (int k = 0; k < e.num; k++) midi_send[k] = e.buffer[k];
+        send_to_alsa(midi_send, e.num);
+        monitor.log(mamba::MidiMonitor::JACK_OUT, midi_send, e.num);
+        if (RECORD) record_midi(midi_send, n, e.num);
+    }
+    if (!done) return;
+    pending_count -= done;
+    for (int k = 0; k < pending_count; k++) pending[k] = pending[k+done];
+}
+
+// midi output for one cycle, the mode flags are fixed for the whole cycle
+// so the per frame loop carries no mode branches
+template <bool RECORD, bool PLAY, bool FREEWHEEL, bool FILTER>
+void XJack::process_midi_out_t(void *buf, jack_nframes_t nframes) {
     int i = mmessage->next();
+    const jack_nframes_t cycle_start = jack_last_frame_time(client);
+    take_scheduled(cycle_start);
+    const int channel = mmessage->channel;
+    // the channels being recorded are not played, the overdubbed one keeps playing
+    unsigned int skip = 0;
+    if (RECORD) {
+        if (rec.omni.load(std::memory_order_relaxed)) skip = 0xffff;
+        else if (!rec.overdub.load(std::memory_order_relaxed)) skip = 1u<<channel;
+    }
     for (unsigned int n = event_count; n < nframes; n++) {
+        if (pending_count) send_scheduled<RECORD>(buf, n, cycle_start + n);
         if (i >= 0) {
             unsigned char* midi_send = jack_midi_event_reserve(buf, n, mmessage->size(i));
             if (midi_send) {
+                if (mmessage->posted(i)) {
+                    // the buffer written now is played out one period later
+                    latency.add(mmessage->ui_delay(i),
+                        std::max<int64_t>(0, cycle_usec - mmessage->posted(i)),
+                        (int64_t)(nframes + n) * 1000000 / SampleRate);
+                }
                 mmessage->fill(midi_send, i);
+                if (midi_send[0] < 0xf8) capture.push(cycle_start + n, midi_send, mmessage->size(i));
                 send_to_alsa(midi_send, mmessage->size(i));
-                if (record) record_midi(midi_send, n, mmessage->size(i));
+                monitor.log(mamba::MidiMonitor::JACK_OUT, midi_send, mmessage->size(i));
+                if (RECORD) record_midi(midi_send, n, mmessage->size(i));
             }
             i = mmessage->next(i);
-        } else if (play) {
-            play_midi(buf, n);
+        } else if (PLAY) {
+            play_midi<RECORD, FREEWHEEL, FILTER>(buf, n, cycle_start, channel, skip);
         }
     }
 }
 
+template <int MODE>
+void XJack::process_midi_out_mode(void *buf, jack_nframes_t nframes) {
+    process_midi_out_t<(MODE & OUT_RECORD) != 0, (MODE & OUT_PLAY) != 0,
+        (MODE & OUT_FREEWHEEL) != 0, (MODE & OUT_FILTER) != 0>(buf, nframes);
+}
+
+// jack process callback for the midi output, pick the specialization once per cycle
+inline void XJack::process_midi_out(void *buf, jack_nframes_t nframes) {
+    typedef void (XJack::*OutPath)(void *buf, jack_nframes_t nframes);
+    static const OutPath out_path[16] = {
+        &XJack::process_midi_out_mode<0>,  &XJack::process_midi_out_mode<1>,
+        &XJack::process_midi_out_mode<2>,  &XJack::process_midi_out_mode<3>,
+        &XJack::process_midi_out_mode<4>,  &XJack::process_midi_out_mode<5>,
+        &XJack::process_midi_out_mode<6>,  &XJack::process_midi_out_mode<7>,
+        &XJack::process_midi_out_mode<8>,  &XJack::process_midi_out_mode<9>,
+        &XJack::process_midi_out_mode<10>, &XJack::process_midi_out_mode<11>,
+        &XJack::process_midi_out_mode<12>, &XJack::process_midi_out_mode<13>,
+        &XJack::process_midi_out_mode<14>, &XJack::process_midi_out_mode<15>,
+    };
+    int mode = 0;
+    if (record) mode |= OUT_RECORD;
+    // freewheel and the channel filter only matter while the loops play
+    if (play) {
+        mode |= OUT_PLAY;
+        if (freewheel) mode |= OUT_FREEWHEEL;
+        if (mmessage->channel < 16 && view_channels) mode |= OUT_FILTER;
+    }
+    (this->*out_path[mode])(buf, nframes);
+}
+
 // jack process callback for the midi input
 inline void XJack::process_midi_in(void* buf, void* out_buf) {
-    if (record && fresh_take) {
+    if (record && fresh_take && rec.overdub.load(std::memory_order_relaxed)) {
+        // the pass start where the playing loop started
+        const int c = rec.dub_channel;
+        if (!play) {
+            dubStart = jack_last_frame_time(client);
+        } else if (!freewheel) {
+            dubStart = absoluteStart;
+        } else {
+            dubStart = startPlay[c] - (jack_nframes_t)(prevTick[c] * (SampleRate / mamba::MidiEvent::ticks_per_second));
+        }
+        start = jack_last_frame_time(client);
+        fresh_take = false;
+    } else if (record && fresh_take) {
         start = jack_last_frame_time(client);
         absoluteStart = jack_last_frame_time(client);
         absoluteRecordStart = jack_last_frame_time(client);
         rcStart = jack_last_frame_time(client);
         fresh_take = false;
         NotOn = 0;
-        int b = 0xB0 | mmessage->channel;
-        int p = 0xC0 | mmessage->channel;
-        const mamba::MidiEvent evb = {{(unsigned char)b, 32, (unsigned char)bank}, 3, 0, 0};
-        st->push_back(evb);
-        const mamba::MidiEvent evp = {{(unsigned char)p, (unsigned char)program, 0}, 2, 0, 0};
-        st->push_back(evp);
+        if (!rec.omni.load(std::memory_order_relaxed)) {
+            int b = 0xB0 | mmessage->channel;
+            int p = 0xC0 | mmessage->channel;
+            const mamba::MidiEvent evb = {{(unsigned char)b, 32, (unsigned char)bank}, 3, 0};
+            st->push_back(evb);
+            const mamba::MidiEvent evp = {{(unsigned char)p, (unsigned char)program, 0}, 2, 0};
+            st->push_back(evp);
+        }
 
         if (!freewheel && play && (get_max_time_loop() > -1)) {
             start = startPlay[mmessage->channel];
@@ -336,10 +524,10 @@ inline void XJack::process_midi_in(void* buf, void* out_buf) {
     } else if (record_finished && !freewheel && (get_max_time_loop() > -1)) {
         record_finished = 0;
         if (rec.is_sorted.load(std::memory_order_acquire)) {
-            posPlay[mmessage->channel] = find_pos_for_playtime();
+            seek(mmessage->channel, find_pos_for_playtime());
             rec.is_sorted.store(false, std::memory_order_release);
         } else {
-            posPlay[mmessage->channel] = posPlay[get_max_time_loop()];
+            seek(mmessage->channel, posPlay[get_max_time_loop()]);
         }
         stStart = jack_last_frame_time(client);
     }
@@ -348,6 +536,7 @@ inline void XJack::process_midi_in(void* buf, void* out_buf) {
     unsigned int i;
     for (i = 0; i < event_count; i++) {
         jack_midi_event_get(&in_event, buf, i);
+        monitor.log(mamba::MidiMonitor::JACK_IN, in_event.buffer, in_event.size);
         unsigned char* midi_send = jack_midi_event_reserve(out_buf, i, in_event.size);
         midi_send[0] = in_event.buffer[0];
         midi_send[1] = in_event.buffer[1];
@@ -355,41 +544,239 @@ inline void XJack::process_midi_in(void* buf, void* out_buf) {
             midi_send[2] = in_event.buffer[2];
         if (record)
             record_midi(midi_send, i, in_event.size);
+        if (in_event.buffer[0] < 0xf8)
+            capture.push(jack_last_frame_time(client) + in_event.time, in_event.buffer, in_event.size);
         send_to_alsa(midi_send, in_event.size);
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
+        monitor.log(mamba::MidiMonitor::JACK_OUT, midi_send, in_event.size);
         if ((in_event.buffer[0] & 0xf0) == 0x90) {   // Note On
-            std::async(std::launch::async, trigger_get_midi_in, (int(in_event.buffer[0]&0x0f)), in_event.buffer[1], true);
+            post_key(mamba::EngineEvent::KEY_ON, in_event.buffer[0], in_event.buffer[1]);
         } else if ((in_event.buffer[0] & 0xf0) == 0x80) {   // Note Off
-            std::async(std::launch::async, trigger_get_midi_in, (int(in_event.buffer[0]&0x0f)), in_event.buffer[1], false);
+            post_key(mamba::EngineEvent::KEY_OFF, in_event.buffer[0], in_event.buffer[1]);
         } else if ((in_event.buffer[0] ) == 0xf8) {   // midi beat clock
             clock_gettime(CLOCK_MONOTONIC, &ts1);
             double time0 = (ts1.tv_sec*1000000000.0)+(ts1.tv_nsec)+
                     (1000000000.0/(double)(SampleRate/(double)in_event.time));
-            if (mp.time_to_bpm(time0, &bpm)) {
-                bpm_changed.store(true, std::memory_order_release);
-                bpm_set.store((int)bpm, std::memory_order_release);
-            }
+            mp.time_to_bpm(time0, &bpm);
         }
-#pragma GCC diagnostic pop
     }
 }
 
-float XJack::get_max_loop_time() noexcept {
-    max_loop_time = 0.0;
-    for (int j = 0; j<16;j++) {
-        if (!rec.play[j].size()) continue;
-        const mamba::MidiEvent ev = rec.play[j][rec.play[j].size()-1];
-        if (ev.absoluteTime > max_loop_time) {
-            max_loop_time = ev.absoluteTime;
+// one consistent state snapshot per cycle for the UI and monitors
+inline void XJack::publish_state() noexcept {
+    mamba::EngineState s;
+    s.layout = mamba::engine_state_layout;
+    s.sample_rate = SampleRate;
+    s.cycle = ++cycle;
+    s.frame = jack_last_frame_time(client);
+    s.transport = (int32_t)transport_state;
+    s.bpm = bpm;
+    s.record = record;
+    s.play = play;
+    s.stPlay = stPlay;
+    s.stStart = stStart;
+    s.rcStart = rcStart;
+    get_max_time_loop();
+    s.loop_time = max_loop_time;
+    state.load(std::memory_order_relaxed)->write(s);
+}
+
+bool XJack::export_state(const std::string& name) {
+    mamba::SeqLock<mamba::EngineState> *shm = state_export.open(name);
+    if (!shm) return false;
+    mamba::EngineState s;
+    local_state.read(&s);
+    shm->write(s);
+    state.store(shm, std::memory_order_release);
+    return true;
+}
+
+void XJack::attach_link(mamba::EngineLink *l) noexcept {
+    state.store(&l->state, std::memory_order_release);
+    link.store(l, std::memory_order_release);
+}
+
+void XJack::start_omni_record() {
+    store1.clear();
+    store2.clear();
+    rec.start_omni();
+    fresh_take = true;
+    record = 1;
+}
+
+bool XJack::start_overdub(int channel) {
+    store1.clear();
+    store2.clear();
+    rec.channel = mmessage->channel = channel;
+    // in sync mode the loops wrap with the master loop
+    const double loop_time = get_max_loop_time();
+    const uint32_t length = freewheel || loop_time <= 0.0 ? 0 :
+                    mamba::MidiEvent::to_tick(loop_time);
+    if (!rec.start_overdub(length)) {
+        start_record(channel);
+        return false;
+    }
+    fresh_take = true;
+    record = 1;
+    return true;
+}
+
+// the overdubbed loop wrapped, hand the takes of the pass to the record thread
+inline void XJack::dub_pass(jack_nframes_t now) noexcept {
+    dubStart = now;
+    std::vector<mamba::MidiEvent> *other = st == &store1 ? &store2 : &store1;
+    if (st->size() && other->empty()) {
+        rec.st = st;
+        st = other;
+    }
+    rec.dub_pass();
+}
+
+void XJack::start_record(int channel) {
+    store1.clear();
+    store2.clear();
+    rec.channel = mmessage->channel = channel;
+    rec.keep(1<<channel);
+    fresh_take = true;
+    rec.start();
+    record = 1;
+}
+
+bool XJack::finish_record(bool freewheel_, double song_bpm) {
+    record = 0;
+    if (!rec.is_running()) return false;
+    if (rec.st == &store1 && store2.size()) {
+        rec.st = &store2;
+    } else {
+        rec.st = &store1;
+    }
+    if (rec.overdub.load(std::memory_order_acquire)) {
+        // the loop keep its length, the last pass is folded in
+        rec.stop();
+        return true;
+    }
+    jack_nframes_t stop = jack_last_frame_time(client);
+    double absoluteTime = (double)(((stop) - absoluteStart)/(double)SampleRate); // seconds
+    if (rec.omni.load(std::memory_order_acquire)) {
+        // the loops were all cleared, so the take is the first loop,
+        // start all new loops together
+        // snap up, so the end follow all events played before
+        if (!freewheel_) {
+            double beat = 60.0/song_bpm;
+            absoluteTime = std::max<double>(1.0, std::ceil(absoluteTime/beat))*beat;
         }
+        rec.omni_end = mamba::MidiEvent::to_tick(absoluteTime);
+        rec.stop();
+        first_play = true;
+        return true;
     }
-    return max_loop_time;
+    if(!get_max_loop_time() && !freewheel_) {
+        // snap the first loop to the next beat
+        double beat = 60.0/song_bpm;
+        int beats = std::round((absoluteTime/beat));
+        absoluteTime = (double)beats*beat;
+    } else if (get_max_loop_time() && !freewheel_) {
+        absoluteTime = get_max_loop_time();
+    }
+    mamba::MidiEvent ev = {{0x80, 0, 0}, 3, mamba::MidiEvent::to_tick(absoluteTime)};
+    rec.st->push_back(ev);
+    rec.stop();
+    record_finished = 1;
+    return true;
+}
+
+bool XJack::capture_loop(int channel, double bpm, bool freewheel_) {
+    if (record || channel < 0 || channel > 15 || bpm <= 0.0) return false;
+    const jack_nframes_t now = jack_frame_time(client);
+    std::vector<mamba::CapturedMidi> in;
+    capture.copy(&in, now, capture_seconds * SampleRate);
+    if (in.empty()) return false;
+
+    std::vector<mamba::MidiEvent> loop;
+    loop.reserve(in.size() + 3);
+    const unsigned char b = 0xB0 | channel;
+    const unsigned char p = 0xC0 | channel;
+    loop.push_back({{b, 32, (unsigned char)bank}, 3, 0});
+    loop.push_back({{p, (unsigned char)program, 0}, 2, 0});
+
+    const bool master = get_max_loop_time() > 0.0 && !freewheel_;
+    // the loops play stretched by bpm_ratio, the input is in real time
+    const double ratio = bpm_ratio > 0.0 ? bpm_ratio : 1.0;
+    double length = 0.0;
+    if (master) {
+        // fold the last loop length of input into the master loop, in phase
+        length = get_max_loop_time();
+        const int64_t len = (int64_t)(length * ratio * SampleRate);
+        if (len <= 0) return false;
+        for (auto const& e : in) {
+            if (now - e.frame > len) continue;
+            int64_t d = (int32_t)(e.frame - absoluteStart) % len;
+            if (d < 0) d += len;
+            loop.push_back({{e.buffer[0], e.buffer[1], e.buffer[2]}, e.num,
+                                mamba::MidiEvent::to_tick((double)d / SampleRate / ratio)});
+        }
+    } else {
+        // the phrase start after the last pause longer than a bar
+        const jack_nframes_t bar = (jack_nframes_t)(4.0 * 60.0 / bpm * SampleRate);
+        size_t s = in.size() - 1;
+        while (s > 0 && in[s].frame - in[s-1].frame <= bar) s--;
+        const jack_nframes_t first = in[s].frame;
+        length = (double)(now - first) / SampleRate;
+        if (!freewheel_) {
+            // snap the loop to the beats
+            const double beat = 60.0 / bpm;
+            length = beat * (std::max<double>(1.0, std::round(length / beat)));
+        }
+        for (size_t i = s; i < in.size(); i++) {
+            const double t = (double)(in[i].frame - first) / SampleRate;
+            if (t >= length) break;
+            loop.push_back({{in[i].buffer[0], in[i].buffer[1], in[i].buffer[2]}, in[i].num,
+                                                            mamba::MidiEvent::to_tick(t / ratio)});
+        }
+        length /= ratio;
+    }
+    std::stable_sort(loop.begin(), loop.end(),
+        [] (const mamba::MidiEvent& lhs, const mamba::MidiEvent& rhs) {
+            return lhs.tick < rhs.tick;
+    });
+    // the loop end, like a finished take
+    loop.push_back({{0x80, 0, 0}, 3, mamba::MidiEvent::to_tick(length)});
+    rec.replace(channel, loop);
+    if (master) {
+        // let the jack thread sync the play position of the new loop,
+        // like at the end of a take
+        if (channel == mmessage->channel) {
+            rec.is_sorted.store(true, std::memory_order_release);
+            record_finished = 1;
+        }
+    } else {
+        first_play = true;
+    }
+    return true;
+}
+
+void XJack::connect_synth() {
+    const char **port_list = jack_get_ports(client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput);
+    if (!port_list) return;
+    for (int i = 0; port_list[i] != NULL; i++) {
+        if (strstr(port_list[i], "mamba")) {
+            if (!jack_port_connected_to(out_port, port_list[i])) {
+                const char *my_port = jack_port_name(out_port);
+                jack_connect(client, my_port,port_list[i]);
+            }
+            break;
+        }
+    }
+    jack_free(port_list);
+}
+
+float XJack::get_max_loop_time() noexcept {
+    return rec.max_loop_time();
 }
 
 // static
 void XJack::jack_shutdown (void *arg) {
     XJack *xjack = (XJack*)arg;
+    xjack->rec.set_realtime(false);
     xjack->trigger_quit_by_jack();
 }
 
@@ -417,21 +804,21 @@ int XJack::jack_buffersize_callback(jack_nframes_t nframes, void* arg) {
 // static
 int XJack::jack_process(jack_nframes_t nframes, void *arg) {
     XJack *xjack = (XJack*)arg;
-    if (xjack->transport_state != jack_transport_query (xjack->client, &xjack->current)) {
-        xjack->transport_state = jack_transport_query (xjack->client, &xjack->current);
-        xjack->transport_state_changed.store(true, std::memory_order_release);
-        xjack->transport_set.store((int)xjack->transport_state, std::memory_order_release);
-    }
+    alloccheck::RtScope rt;
+    xjack->cycle_usec = mamba::now_usec();
+    xjack->transport_state = jack_transport_query (xjack->client, &xjack->current);
     if (xjack->current.valid && xjack->current.beats_per_minute != (double)xjack->bpm) {
         xjack->bpm = (unsigned int)xjack->current.beats_per_minute;
-        xjack->bpm_changed.store(true, std::memory_order_release);
-        xjack->bpm_set.store((int)xjack->bpm, std::memory_order_release);
     } 
     void *in = jack_port_get_buffer (xjack->in_port, nframes);
     void *out = jack_port_get_buffer (xjack->out_port, nframes);
     jack_midi_clear_buffer(out);
+    xjack->take_loops();
     xjack->process_midi_in(in, out);
     xjack->process_midi_out(out,nframes);
+    xjack->publish_state();
+    xjack->rec.cycle_done();
+    xjack->latency.add_process(mamba::now_usec() - xjack->cycle_usec);
     return 0;
 }
 
@@ -19,7 +19,6 @@
  */
 
 #include <sigc++/sigc++.h>
-#include <future>
 #include <functional>
 
 #include <jack/jack.h>
@@ -75,7 +74,6 @@ private:
     mamba::MidiMessenger *mmessage;
     MidiClockToBpm mp;
     std::function<void(const uint8_t*,uint8_t) > send_to_alsa;
-    std::function<void(int)> set_alsa_priority;
     timespec ts1;
     jack_nframes_t event_count;
     jack_nframes_t stop;
@@ -85,20 +83,58 @@ private:
     double deltaTime;
     double absoluteTime;
     double absoluteRecordTime;
-    double playPosTime;
+    uint32_t playPosTick;
     jack_position_t current;
     jack_transport_state_t transport_state;
     unsigned int pos;
     unsigned int posPlay[16];
+    // the loops played in this cycle, taken from rec at the cycle start
+    const std::vector<mamba::MidiEvent> *playLoop[16];
+    unsigned int playGen[16];
+    // tick of the last event in each loop, 0 for a empty one
+    uint32_t loopLen[16];
+    // tick of the last played event and how many were played at that tick,
+    // to find the position again in a replaced loop
+    uint32_t prevTick[16];
+    unsigned int sameTick[16];
     int NotOn;
     int priority;
+    int64_t cycle_usec;
+    // scheduled events taken from the ring, sorted by frame
+    static const int max_pending = 256;
+    mamba::ScheduledMidi pending[max_pending];
+    int pending_count;
+    uint64_t cycle;
+    mamba::SeqLock<mamba::EngineState> local_state;
+    std::atomic<mamba::SeqLock<mamba::EngineState>*> state;
+    mamba::StateExport state_export;
+    std::atomic<mamba::EngineLink*> link;
 
     inline int find_pos_for_playtime() noexcept;
+    inline void take_loops() noexcept;
+    inline void seek(int c, unsigned int pos) noexcept;
     inline int get_max_time_loop() noexcept;
     inline void record_midi(unsigned char* midi_send, unsigned int n, int i) noexcept;
-    inline void play_midi(void *buf, unsigned int n);
+    enum {
+        OUT_RECORD    = 1<<0,
+        OUT_PLAY      = 1<<1,
+        OUT_FREEWHEEL = 1<<2,
+        OUT_FILTER    = 1<<3,
+    };
+    template <bool RECORD, bool FREEWHEEL, bool FILTER>
+    inline void play_midi(void *buf, unsigned int n, jack_nframes_t cycle_start, int channel, unsigned int skip);
+    inline void take_scheduled(jack_nframes_t now) noexcept;
+    template <bool RECORD>
+    inline void send_scheduled(void *buf, unsigned int n, jack_nframes_t frame) noexcept;
+    template <bool RECORD, bool PLAY, bool FREEWHEEL, bool FILTER>
+    void process_midi_out_t(void *buf, jack_nframes_t nframes);
+    template <int MODE>
+    void process_midi_out_mode(void *buf, jack_nframes_t nframes);
     inline void process_midi_out(void *buf, jack_nframes_t nframes);
     inline void process_midi_in(void* buf, void* out_buf);
+    inline void dub_pass(jack_nframes_t now) noexcept;
+    inline void publish_state() noexcept;
+    void prepare_rt();
     static void jack_shutdown (void *arg);
     static int jack_xrun_callback(void *arg);
     static int jack_srate_callback(jack_nframes_t samplerate, void* arg);
@@ -108,12 +144,8 @@ private:
 public:
     XJack(mamba::MidiMessenger *mmessage,
         std::function<void(const uint8_t*,uint8_t) > send_to_alsa,
-        std::function<void(int)> set_alsa_priority);
+        mamba::Reactor *reactor);
     ~XJack();
-    std::atomic<bool> transport_state_changed;
-    std::atomic<int> transport_set;
-    std::atomic<bool> bpm_changed;
-    std::atomic<int> bpm_set;
     std::atomic<bool> record_off;
     jack_client_t *client;
     jack_port_t *in_port;
@@ -123,9 +155,21 @@ public:
     jack_nframes_t rcStart;
     jack_nframes_t start;
     jack_nframes_t absoluteStart;
+    jack_nframes_t dubStart;
     std::string client_name;
     int init_jack();
+    int open_jack();
+    int activate_jack();
     mamba::MidiRecord rec;
+    mamba::LatencyHistogram latency;
+    mamba::MidiMonitor monitor;
+    // played and incoming notes for the keyboard, drained by the GUI
+    mamba::SpscRing<mamba::EngineEvent, 1024> ui_events;
+    // events to send sample accurate, from the OSC control
+    mamba::SpscRing<mamba::ScheduledMidi, 1024> scheduled;
+    // everything played in, kept for capture_loop
+    static const int capture_seconds = 300;
+    mamba::CaptureRing<32768> capture;
     std::vector<mamba::MidiEvent> store1;
     std::vector<mamba::MidiEvent> store2;
     std::vector<mamba::MidiEvent> *st;
@@ -138,7 +182,8 @@ public:
     int freewheel;
     int view_channels;
     bool fresh_take;
-    bool first_play;
+    // restart all loops at the next frame, set from any thread
+    std::atomic<bool> first_play;
     unsigned int SampleRate;
     double srms;
     double bpm_ratio;
@@ -146,11 +191,48 @@ public:
     float max_loop_time;
 
     float get_max_loop_time() noexcept;
+    // priority of the jack process thread, -1 when it isn't realtime
+    int rt_priority() const noexcept { return priority; }
+    // consistent copy of the state the jack thread published last
+    inline void get_state(mamba::EngineState *s) const noexcept {
+        state.load(std::memory_order_acquire)->read(s);
+    }
+    // publish the state in POSIX shared memory as well
+    bool export_state(const std::string& name);
+    // share state, notes and midi with the other side of a engine process,
+    // set before the jack client is activated
+    void attach_link(mamba::EngineLink *l) noexcept;
+    // begin a fresh take on channel, called from a non realtime thread
+    void start_record(int channel);
+    // overdub the loop on channel, it keeps playing and the takes are merged
+    // in at each loop end. false when there was no loop, then it record
+    bool start_overdub(int channel);
+    // record all input channels at once, each into its own loop
+    void start_omni_record();
+    // close the take with a note off at the loop end,
+    // return false when no take was running
+    bool finish_record(bool freewheel, double song_bpm);
+    // turn the input of the last minutes into a loop on channel, without a
+    // armed record. it is folded into the master loop when there is one,
+    // else the last phrase is snapped to the beats of bpm
+    bool capture_loop(int channel, double bpm, bool freewheel);
+    // connect the out port to the fluidsynth input when it exists
+    void connect_synth();
+    inline void post_key(const uint8_t type, const uint8_t status, const uint8_t key) noexcept {
+        const mamba::EngineEvent ev{type, uint8_t(status & 0x0f), key};
+        mamba::EngineLink *l = link.load(std::memory_order_relaxed);
+        if (l) l->jack_keys.push(ev);
+        else ui_events.push(ev);
+    }
+    // next note for the keyboard, from the jack and the alsa thread of the
+    // engine process when linked
+    inline bool pop_key(mamba::EngineEvent *ev) noexcept {
+        mamba::EngineLink *l = link.load(std::memory_order_relaxed);
+        if (!l) return ui_events.pop(ev);
+        return l->jack_keys.pop(ev) || l->alsa_keys.pop(ev);
+    }
     sigc::signal<void > trigger_quit_by_jack;
     sigc::signal<void >& signal_trigger_quit_by_jack() { return trigger_quit_by_jack; }
-
-    sigc::signal<void, int, int, bool> trigger_get_midi_in;
-    sigc::signal<void, int, int, bool>& signal_trigger_get_midi_in() { return trigger_get_midi_in; }
 };
 
 
@@ -0,0 +1,258 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "XMidiMonitor.h"
+
+#include <cstdio>
+
+#ifdef ENABLE_NLS
+#include <libintl.h>
+#define _(S) gettext(S)
+#else
+#define _(S) S
+#endif
+
+
+namespace xmidimonitor {
+
+static const char *source_names[mamba::MidiMonitor::SOURCES] = {
+    "Jack In", "Jack Out", "Alsa In", "Alsa Out"
+};
+
+
+/****************************************************************
+ ** class XMidiMonitor
+ **
+ ** show the newest midi events logged by the MidiMonitor
+ */
+
+XMidiMonitor::XMidiMonitor()
+    : monitor(NULL),
+    list(NULL),
+    list_size({0, 0}),
+    scroll(NULL),
+    history(history_size),
+    newest(0),
+    start_usec(0),
+    draw_usec(0),
+    rate_usec(0),
+    visible(false),
+    win(NULL) {
+    for (int i = 0; i < mamba::MidiMonitor::SOURCES; i++) {
+        last_events[i] = 0;
+        last_bytes[i] = 0;
+        event_rate[i] = 0.0;
+        byte_rate[i] = 0.0;
+    }
+}
+
+XMidiMonitor::~XMidiMonitor() {
+}
+
+void XMidiMonitor::update_rates(int64_t now) {
+    const double secs = (now - rate_usec) / 1000000.0;
+    for (int i = 0; i < mamba::MidiMonitor::SOURCES; i++) {
+        const uint64_t ev = monitor->events(i);
+        const uint64_t by = monitor->bytes(i);
+        event_rate[i] = rate_usec ? (ev - last_events[i]) / secs : 0.0;
+        byte_rate[i] = rate_usec ? (by - last_bytes[i]) / secs : 0.0;
+        last_events[i] = ev;
+        last_bytes[i] = by;
+    }
+    rate_usec = now;
+}
+
+void XMidiMonitor::update() {
+    if (!win || !is_visible()) return;
+    const int64_t now = mamba::now_usec();
+    // never redraw more then 10 times a second, however much traffic there is
+    if (now - draw_usec < 100000) return;
+    draw_usec = now;
+    bool changed = false;
+    pending.clear();
+    if (monitor->take(&pending)) {
+        if (!start_usec) start_usec = pending.front().usec;
+        for (auto const& e : pending) {
+            history[newest % history_size] = e;
+            newest++;
+        }
+        changed = true;
+    }
+    if (now - rate_usec >= 1000000) {
+        update_rates(now);
+        changed = true;
+    }
+    if (changed) expose_widget(list);
+}
+
+// static
+void XMidiMonitor::describe(const mamba::MidiMonitor::Entry& e, char *s, size_t len) {
+    const int status = e.buffer[0] & 0xF0;
+    const int ch = (e.buffer[0] & 0x0F) + 1;
+    switch (status) {
+        case (0x80):
+            snprintf(s, len, _("Note Off  ch %2i  key %3i  vel %3i"), ch, e.buffer[1], e.buffer[2]);
+        break;
+        case (0x90):
+            if (e.buffer[2])
+                snprintf(s, len, _("Note On   ch %2i  key %3i  vel %3i"), ch, e.buffer[1], e.buffer[2]);
+            else
+                snprintf(s, len, _("Note Off  ch %2i  key %3i  vel %3i"), ch, e.buffer[1], e.buffer[2]);
+        break;
+        case (0xA0):
+            snprintf(s, len, _("Aftertouch ch %2i  key %3i  val %3i"), ch, e.buffer[1], e.buffer[2]);
+        break;
+        case (0xB0):
+            snprintf(s, len, _("Control   ch %2i  num %3i  val %3i"), ch, e.buffer[1], e.buffer[2]);
+        break;
+        case (0xC0):
+            snprintf(s, len, _("Program   ch %2i  num %3i"), ch, e.buffer[1]);
+        break;
+        case (0xD0):
+            snprintf(s, len, _("Pressure  ch %2i  val %3i"), ch, e.buffer[1]);
+        break;
+        case (0xE0):
+            snprintf(s, len, _("Pitchbend ch %2i  val %5i"), ch, ((e.buffer[2] << 7) | e.buffer[1]) - 8192);
+        break;
+        default:
+            switch (e.buffer[0]) {
+                case (0xF0): snprintf(s, len, _("SysEx     %i bytes"), e.num); break;
+                case (0xF8): snprintf(s, len, _("Clock")); break;
+                case (0xFA): snprintf(s, len, _("Start")); break;
+                case (0xFB): snprintf(s, len, _("Continue")); break;
+                case (0xFC): snprintf(s, len, _("Stop")); break;
+                case (0xFE): snprintf(s, len, _("Active Sensing")); break;
+                default: snprintf(s, len, _("System    %02X"), e.buffer[0]); break;
+            }
+        break;
+    }
+}
+
+// static
+void XMidiMonitor::draw_list(void *w_, void* user_data) {
+    Widget_t *w = (Widget_t*)w_;
+    XMidiMonitor *mon = (XMidiMonitor*)w->parent_struct;
+    if (!mon->is_visible()) return;
+    const int width = mon->list_size.width;
+    const int height = mon->list_size.height;
+    const int row_h = 14;
+    char s[128];
+
+    cairo_set_source_rgb(w->crb, 0.1, 0.1, 0.1);
+    cairo_paint(w->crb);
+    cairo_set_font_size (w->crb, 11);
+
+    use_text_color_scheme(w, NORMAL_);
+    int y = row_h;
+    for (int i = 0; i < mamba::MidiMonitor::SOURCES; i++) {
+        snprintf(s, 127, _("%-8s %9.0f ev/s %10.0f B/s   dropped %llu"), _(source_names[i]),
+            mon->event_rate[i], mon->byte_rate[i],
+            (unsigned long long)mon->monitor->dropped(i));
+        cairo_move_to (w->crb, 5, y);
+        cairo_show_text(w->crb, s);
+        y += row_h;
+    }
+    cairo_set_source_rgba(w->crb, 1.0, 1.0, 1.0, 0.2);
+    cairo_rectangle(w->crb, 0, y - row_h + 4, width, 1);
+    cairo_fill(w->crb);
+    y += 4;
+
+    // draw only the rows which fit, starting with the newest one
+    const uint64_t available = min(mon->newest, (uint64_t)history_size);
+    const int rows = max(0, (height - y) / row_h + 1);
+    const uint64_t back = available > (uint64_t)rows ? available - rows : 0;
+    const uint64_t offset = (uint64_t)(adj_get_value(mon->scroll->adj) * back);
+    use_text_color_scheme(w, NORMAL_);
+    for (int r = 0; r < rows && offset + r < available; r++) {
+        const mamba::MidiMonitor::Entry& e = mon->history[(mon->newest - 1 - offset - r) % history_size];
+        char d[64];
+        describe(e, d, 63);
+        snprintf(s, 127, "%10.3f  %-8s  %02X %02X %02X  %s",
+            (e.usec - mon->start_usec) / 1000000.0, _(source_names[e.source]),
+            e.buffer[0], e.buffer[1], e.buffer[2], d);
+        cairo_move_to (w->crb, 5, y);
+        cairo_show_text(w->crb, s);
+        y += row_h;
+    }
+}
+
+// static
+void XMidiMonitor::scroll_callback(void *w_, void* user_data) {
+    Widget_t *w = (Widget_t*)w_;
+    XMidiMonitor *mon = (XMidiMonitor*)w->parent_struct;
+    expose_widget(mon->list);
+}
+
+// static
+void XMidiMonitor::map_callback(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    XMidiMonitor *mon = (XMidiMonitor*)w->parent_struct;
+    mon->visible.store(true, std::memory_order_release);
+    mon->monitor->enabled.store(true, std::memory_order_release);
+}
+
+// static
+void XMidiMonitor::unmap_callback(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    XMidiMonitor *mon = (XMidiMonitor*)w->parent_struct;
+    mon->visible.store(false, std::memory_order_release);
+    mon->monitor->enabled.store(false, std::memory_order_release);
+}
+
+// static
+void XMidiMonitor::mem_free_callback(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    XMidiMonitor *mon = (XMidiMonitor*)w->parent_struct;
+    mon->visible.store(false, std::memory_order_release);
+    mon->monitor->enabled.store(false, std::memory_order_release);
+    mon->win = NULL;
+}
+
+void XMidiMonitor::show(int present) {
+    if (!win) return;
+    if (present) {
+        widget_show_all(win);
+        visible.store(true, std::memory_order_release);
+        monitor->enabled.store(true, std::memory_order_release);
+        rate_usec = 0;
+        update_rates(mamba::now_usec());
+    } else {
+        widget_hide(win);
+    }
+}
+
+void XMidiMonitor::init(Widget_t *parent, mamba::MidiMonitor *monitor_) {
+    monitor = monitor_;
+    win = xtoolwindow::create_tool_window(parent, _("Mamba - MIDI Monitor"), 560, 440, this);
+    win->func.map_notify_callback = map_callback;
+    win->func.unmap_notify_callback = unmap_callback;
+    win->func.mem_free_callback = mem_free_callback;
+
+    list = xtoolwindow::add_tool_view(win, 10, 10, 540, 370, &list_size, draw_list);
+
+    scroll = add_hslider(win, _("History"), 10, 390, 540, 40);
+    set_adjustment(scroll->adj, 0.0, 0.0, 0.0, 1.0, 0.001, CL_CONTINUOS);
+    scroll->scale.gravity = SOUTHWEST;
+    scroll->flags |= NO_AUTOREPEAT | NO_PROPAGATE;
+    scroll->parent_struct = this;
+    scroll->func.value_changed_callback = scroll_callback;
+}
+
+} // namespace xmidimonitor
@@ -0,0 +1,91 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include "Mamba.h"
+#include "xwidgets.h"
+#include "XToolWindow.h"
+
+#pragma once
+
+#ifndef XMIDIMONITOR_H
+#define XMIDIMONITOR_H
+
+
+namespace xmidimonitor {
+
+
+/****************************************************************
+ ** class XMidiMonitor
+ **
+ ** show the newest midi events logged by the MidiMonitor,
+ ** with event and byte rates per source. Only the rows fitting
+ ** in the window are drawn, at most 10 times a second
+ */
+
+class XMidiMonitor {
+private:
+    mamba::MidiMonitor *monitor;
+    Widget_t *list;
+    xtoolwindow::ViewSize list_size;
+    Widget_t *scroll;
+    // the last history_size entries, history[newest % history_size] is the newest
+    static const size_t history_size = 16384;
+    std::vector<mamba::MidiMonitor::Entry> history;
+    std::vector<mamba::MidiMonitor::Entry> pending;
+    uint64_t newest;
+    int64_t start_usec;
+    int64_t draw_usec;
+    int64_t rate_usec;
+    uint64_t last_events[mamba::MidiMonitor::SOURCES];
+    uint64_t last_bytes[mamba::MidiMonitor::SOURCES];
+    double event_rate[mamba::MidiMonitor::SOURCES];
+    double byte_rate[mamba::MidiMonitor::SOURCES];
+    std::atomic<bool> visible;
+
+    void update_rates(int64_t now);
+    static void describe(const mamba::MidiMonitor::Entry& e, char *s, size_t len);
+
+    static void draw_list(void *w_, void* user_data);
+    static void scroll_callback(void *w_, void* user_data);
+    static void map_callback(void *w_, void* user_data) noexcept;
+    static void unmap_callback(void *w_, void* user_data) noexcept;
+    static void mem_free_callback(void *w_, void* user_data) noexcept;
+
+public:
+    XMidiMonitor();
+    ~XMidiMonitor();
+
+    Widget_t *win;
+
+    void init(Widget_t *parent, mamba::MidiMonitor *monitor);
+    void show(int present);
+    // take the logged events and redraw, called from the GUI thread
+    void update();
+    bool is_visible() const noexcept { return visible.load(std::memory_order_acquire); }
+};
+
+} // namespace xmidimonitor
+
+#endif //XMIDIMONITOR_H_
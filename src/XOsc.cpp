@@ -0,0 +1,502 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "XOsc.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#ifdef ENABLE_NLS
+#include <libintl.h>
+#define _(S) gettext(S)
+#else
+#define _(S) S
+#endif
+
+
+namespace xosc {
+
+
+/****************************************************************
+ ** class OscControl
+ **
+ ** control the looper over OSC when running headless
+ */
+
+OscControl::OscControl(xjack::XJack *xjack_, xsynth::XSynth *xsynth_,
+        mamba::MidiMessenger *mmessage_, mamba::Reactor *reactor_)
+    : sigc::trackable(),
+    xjack(xjack_),
+    xsynth(xsynth_),
+    mmessage(mmessage_),
+    reactor(reactor_),
+    load(),
+    save(),
+    library(),
+    server(NULL),
+    osc_fd(-1),
+    timer_fd(-1),
+    link_fd(-1),
+    channel(0),
+    song_bpm(120),
+    mbpm(120),
+    sf_loading(false) {
+}
+
+OscControl::~OscControl() {
+    close();
+    if (sf_loader.valid()) sf_loader.wait();
+}
+
+bool OscControl::init(const char *port, int channel_, int song_bpm_) {
+    channel = channel_ > 15 ? 0 : channel_;
+    xjack->rec.channel = mmessage->channel = channel;
+    song_bpm = mbpm = song_bpm_;
+    server = lo_server_new_with_proto(port, LO_UDP, error_handler);
+    if (!server) {
+        fprintf(stderr, _("Couldn't open OSC port %s\n"), port);
+        return false;
+    }
+    // bundles are scheduled by XJack, so liblo must not delay them
+    lo_server_enable_queue(server, 0, 1);
+    lo_server_add_method(server, "/mamba/record", "i", record_handler, this);
+    lo_server_add_method(server, "/mamba/overdub", "i", overdub_handler, this);
+    lo_server_add_method(server, "/mamba/omni", "i", omni_handler, this);
+    lo_server_add_method(server, "/mamba/play", "i", play_handler, this);
+    lo_server_add_method(server, "/mamba/clear", "i", clear_handler, this);
+    lo_server_add_method(server, "/mamba/bpm", "i", bpm_handler, this);
+    lo_server_add_method(server, "/mamba/bpm", "f", bpm_handler, this);
+    lo_server_add_method(server, "/mamba/channel", "i", channel_handler, this);
+    lo_server_add_method(server, "/mamba/soundfont", "s", soundfont_handler, this);
+    lo_server_add_method(server, "/mamba/load", "s", load_handler, this);
+    lo_server_add_method(server, "/mamba/save", "s", save_handler, this);
+    lo_server_add_method(server, "/mamba/midi", "m", midi_handler, this);
+    lo_server_add_method(server, "/mamba/note", "iii", note_handler, this);
+    lo_server_add_method(server, "/mamba/take/store", "i", take_store_handler, this);
+    lo_server_add_method(server, "/mamba/take/recall", "ii", take_recall_handler, this);
+    lo_server_add_method(server, "/mamba/scene/store", "", scene_store_handler, this);
+    lo_server_add_method(server, "/mamba/scene/recall", "i", scene_recall_handler, this);
+    lo_server_add_method(server, "/mamba/capture", "", capture_handler, this);
+    lo_server_add_method(server, "/mamba/undo", "", undo_handler, this);
+    lo_server_add_method(server, "/mamba/redo", "", undo_handler, this);
+    lo_server_add_method(server, "/mamba/quit", "", quit_handler, this);
+
+    osc_fd = lo_server_get_socket_fd(server);
+    reactor->add_fd(osc_fd, EPOLLIN, [this] (uint32_t) {
+        while (lo_server_recv_noblock(server, 0) > 0) {}
+    });
+    // a take ends by itself when the master loop is full
+    timer_fd = reactor->add_timer(30, [this] () {check_record_off();});
+    fprintf(stderr, _("OSC control on port %i\n"), lo_server_get_port(server));
+    return true;
+}
+
+void OscControl::close() {
+    reactor->remove(link_fd);
+    link_fd = -1;
+    reactor->remove(timer_fd);
+    timer_fd = -1;
+    reactor->remove(osc_fd);
+    osc_fd = -1;
+    if (server) lo_server_free(server);
+    server = NULL;
+}
+
+// map the bundle time of msg to a jack frame, the events written
+// in a cycle are heard one period later, so send them one period earlier
+jack_nframes_t OscControl::frame_for(lo_message msg) noexcept {
+    jack_nframes_t now = jack_frame_time(xjack->client);
+    lo_timetag tt = lo_message_get_timestamp(msg);
+    if (tt.sec == 0 && tt.frac <= 1) return now;
+    lo_timetag tnow;
+    lo_timetag_now(&tnow);
+    double diff = lo_timetag_diff(tt, tnow);
+    if (diff <= 0.0) return now;
+    return now + (jack_nframes_t)(diff * xjack->SampleRate) -
+                    jack_get_buffer_size(xjack->client);
+}
+
+void OscControl::schedule(const uint8_t *midi, uint8_t num, lo_message msg) noexcept {
+    mamba::ScheduledMidi e;
+    e.frame = frame_for(msg);
+    e.num = num;
+    for (int i = 0; i < 3; i++) e.buffer[i] = i < num ? midi[i] : 0;
+    if (!xjack->scheduled.push(e))
+        fprintf(stderr, "OSC: schedule queue full, drop event\n");
+}
+
+// the loops are published to the jack thread, so they get replaced
+// while playing, the jack thread restart them at the next frame
+bool OscControl::load_file(const char *file) {
+    xjack->finish_record(xjack->freewheel, song_bpm);
+    std::vector<mamba::MidiEvent> loops[16];
+    if (!load.load_from_file(&loops[0], &song_bpm, file)) {
+        fprintf(stderr, _("Couldn't load file %s, is that a MIDI file?\n"), file);
+        return false;
+    }
+    xjack->rec.replace(0xffff, loops);
+    mbpm = song_bpm;
+    xjack->bpm_ratio = 1.0;
+    xjack->first_play = true;
+    return true;
+}
+
+void OscControl::stop_play() {
+    xjack->play = 0;
+    mmessage->send_midi_cc(0xB0, 123, 0, 3, false);
+    if (xsynth->synth_is_active()) xsynth->panic();
+    xjack->first_play = true;
+}
+
+void OscControl::check_record_off() {
+    if (!xjack->record_off.load(std::memory_order_acquire)) return;
+    xjack->record_off.store(false, std::memory_order_release);
+    if (xjack->record) xjack->finish_record(xjack->freewheel, song_bpm);
+}
+
+// expand a stored take (or a scene when channel is 16) into the playing loops
+void OscControl::recall(int take, int c) {
+    xjack->finish_record(xjack->freewheel, song_bpm);
+    bool ok = false;
+    if (c == 16) {
+        ok = take >= 0 && take < (int)library.num_scenes();
+        if (ok) {
+            std::vector<mamba::MidiEvent> loops[16];
+            library.recall_scene(take, loops);
+            xjack->rec.replace(0xffff, loops);
+            load.positions.clear();
+        }
+    } else {
+        if (c < 0) c = library.take_channel(take);
+        ok = c >= 0 && c < 16 && library.take_channel(take) >= 0;
+        if (ok) {
+            std::vector<mamba::MidiEvent> loops[16];
+            library.recall_take(take, c, loops);
+            xjack->rec.replace(c, loops[c]);
+            if (c == 0) load.positions.clear();
+        }
+    }
+    if (!ok) fprintf(stderr, "OSC: no stored %s %i\n", c == 16 ? "scene" : "take", take);
+    mmessage->send_midi_cc(0xB0, 123, 0, 3, false);
+    xjack->first_play = true;
+}
+
+void OscControl::attach_link(mamba::EngineLink *l) {
+    reactor->remove(link_fd);
+    // the GUI thread doesn't wake the engine, so poll the ring
+    link_fd = reactor->add_timer(5, [this, l] () {
+        mamba::EngineCommand c;
+        while (l->commands.pop(&c)) command(c);
+    });
+}
+
+void OscControl::command(const mamba::EngineCommand& c) {
+    switch (c.type) {
+        case mamba::EngineCommand::RECORD:
+            if (c.value > 0) {
+                song_bpm = mbpm;
+                xjack->bpm_ratio = 1.0;
+                xjack->start_record(channel);
+            } else {
+                xjack->finish_record(xjack->freewheel, song_bpm);
+            }
+        break;
+        case mamba::EngineCommand::OVERDUB:
+            if (c.value > 0) xjack->start_overdub(channel);
+            else xjack->finish_record(xjack->freewheel, song_bpm);
+        break;
+        case mamba::EngineCommand::OMNI:
+            if (c.value > 0) {
+                song_bpm = mbpm;
+                xjack->bpm_ratio = 1.0;
+                load.positions.clear();
+                xjack->start_omni_record();
+            } else {
+                xjack->finish_record(xjack->freewheel, song_bpm);
+            }
+        break;
+        case mamba::EngineCommand::PLAY:
+            if (c.value > 0) xjack->play = 1;
+            else stop_play();
+        break;
+        case mamba::EngineCommand::CLEAR:
+            if (c.value < 0) {
+                xjack->play = 0;
+                xjack->rec.keep(0xffff);
+                load.positions.clear();
+                song_bpm = mbpm = 120;
+                xjack->bpm_ratio = 1.0;
+            } else if (c.value < 16) {
+                if (c.value == 0) load.positions.clear();
+                xjack->rec.keep(1<<c.value);
+                mmessage->send_midi_cc(0xB0 | c.value, 123, 0, 3, true);
+            }
+        break;
+        case mamba::EngineCommand::BPM:
+            if (c.value < 1) break;
+            mbpm = c.value;
+            xjack->bpm_ratio = (double)song_bpm/(double)mbpm;
+        break;
+        case mamba::EngineCommand::CHANNEL:
+            if (c.value < 0 || c.value > 15 || xjack->record) break;
+            xjack->rec.channel = mmessage->channel = channel = c.value;
+        break;
+        case mamba::EngineCommand::FREEWHEEL:
+            xjack->freewheel = c.value > 0;
+        break;
+        case mamba::EngineCommand::CAPTURE:
+            if (xjack->record) break;
+            // the first loop set the song tempo, later ones play along
+            if (xjack->get_max_loop_time() <= 0.0) {
+                song_bpm = mbpm;
+                xjack->bpm_ratio = 1.0;
+            }
+            if (!xjack->capture_loop(channel, mbpm, xjack->freewheel)) {
+                fprintf(stderr, "OSC: nothing to capture\n");
+            } else if (channel == 0) {
+                load.positions.clear();
+            }
+        break;
+        case mamba::EngineCommand::UNDO:
+        case mamba::EngineCommand::REDO:
+        {
+            unsigned int mask = c.type == mamba::EngineCommand::UNDO ?
+                        xjack->rec.undo() : xjack->rec.redo();
+            if (mask & 1) load.positions.clear();
+            for (int k = 0; k < 16; k++) {
+                if (mask & (1<<k)) mmessage->send_midi_cc(0xB0 | k, 123, 0, 3, true);
+            }
+        }
+        break;
+        default:
+        break;
+    }
+}
+
+// static
+void OscControl::error_handler(int num, const char *msg, const char *path) {
+    fprintf(stderr, "OSC server error %d in path %s: %s\n", num, path ? path : "", msg);
+}
+
+// static
+int OscControl::record_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({mamba::EngineCommand::RECORD, argv[0]->i});
+    return 0;
+}
+
+// static
+int OscControl::overdub_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({mamba::EngineCommand::OVERDUB, argv[0]->i});
+    return 0;
+}
+
+// static
+int OscControl::omni_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({mamba::EngineCommand::OMNI, argv[0]->i});
+    return 0;
+}
+
+// static
+int OscControl::play_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({mamba::EngineCommand::PLAY, argv[0]->i});
+    return 0;
+}
+
+// static
+int OscControl::clear_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({mamba::EngineCommand::CLEAR, argv[0]->i});
+    return 0;
+}
+
+// static
+int OscControl::bpm_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    int bpm = types[0] == 'f' ? (int)argv[0]->f : argv[0]->i;
+    osc->command({mamba::EngineCommand::BPM, bpm});
+    return 0;
+}
+
+// static
+int OscControl::channel_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({mamba::EngineCommand::CHANNEL, argv[0]->i});
+    return 0;
+}
+
+// static
+int OscControl::soundfont_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    // loading take seconds, so don't block the reactor
+    if (osc->sf_loading.exchange(true, std::memory_order_acq_rel)) {
+        fprintf(stderr, "OSC: soundfont still loading\n");
+        return 0;
+    }
+    std::string file = &argv[0]->s;
+    if (access(file.c_str(), F_OK) == -1 || strstr(file.c_str(), ".sfz")) {
+        fprintf(stderr, _("Couldn't load soundfont %s\n"), file.c_str());
+        osc->sf_loading.store(false, std::memory_order_release);
+        return 0;
+    }
+    if (osc->sf_loader.valid()) osc->sf_loader.get();
+    osc->sf_loader = std::async(std::launch::async, [osc, file] () {
+        // wait for a load from the config, the synth serialize them
+        if (osc->xsynth->load(osc->xjack->SampleRate, file.c_str())) {
+            fprintf(stderr, _("Couldn't load soundfont %s\n"), file.c_str());
+        } else {
+            osc->xjack->connect_synth();
+        }
+        osc->sf_loading.store(false, std::memory_order_release);
+    });
+    return 0;
+}
+
+// static
+int OscControl::load_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->load_file(&argv[0]->s);
+    return 0;
+}
+
+// static
+int OscControl::save_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    std::string filename = &argv[0]->s;
+    if (filename.find(".mid") == std::string::npos) filename += ".midi";
+    osc->stop_play();
+    osc->xjack->finish_record(osc->xjack->freewheel, osc->song_bpm);
+    std::vector<mamba::MidiEvent> loops[16];
+    osc->xjack->rec.snapshot(loops);
+    osc->save.save_to_file(loops, filename.c_str());
+    return 0;
+}
+
+// static
+int OscControl::midi_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    // OSC midi is port id, status, data1, data2
+    const uint8_t *m = argv[0]->m;
+    uint8_t num = 3;
+    if ((m[1] & 0xf0) == 0xC0 || (m[1] & 0xf0) == 0xD0) num = 2;
+    else if (m[1] >= 0xF0) num = 1;
+    osc->schedule(&m[1], num, msg);
+    return 0;
+}
+
+// static
+int OscControl::note_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    int c = argv[0]->i;
+    int key = argv[1]->i;
+    int vel = argv[2]->i;
+    if (c < 0 || c > 15 || key < 0 || key > 127 || vel < 0 || vel > 127) return 0;
+    const uint8_t midi[3] = {(uint8_t)((vel ? 0x90 : 0x80) | c), (uint8_t)key, (uint8_t)vel};
+    osc->schedule(midi, 3, msg);
+    return 0;
+}
+
+// static
+int OscControl::take_store_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    int c = argv[0]->i < 0 ? osc->channel : argv[0]->i;
+    if (c > 15 || osc->xjack->record) return 0;
+    int take = osc->library.store_take(c, *osc->xjack->rec.loop(c));
+    fprintf(stderr, "OSC: stored take %i from channel %i, library use %zu bytes\n",
+                                            take, c, osc->library.bytes());
+    return 0;
+}
+
+// static
+int OscControl::take_recall_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    int c = argv[1]->i;
+    if (c > 15) return 0;
+    osc->recall(argv[0]->i, c);
+    return 0;
+}
+
+// static
+int OscControl::scene_store_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    if (osc->xjack->record) return 0;
+    std::vector<mamba::MidiEvent> loops[16];
+    osc->xjack->rec.snapshot(loops);
+    int scene = osc->library.store_scene(loops);
+    fprintf(stderr, "OSC: stored scene %i, library use %zu bytes\n",
+                                            scene, osc->library.bytes());
+    return 0;
+}
+
+// static
+int OscControl::scene_recall_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->recall(argv[0]->i, 16);
+    return 0;
+}
+
+// static
+int OscControl::capture_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({mamba::EngineCommand::CAPTURE, 0});
+    return 0;
+}
+
+// static
+int OscControl::undo_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->command({strcmp(path, "/mamba/redo") ?
+        mamba::EngineCommand::UNDO : mamba::EngineCommand::REDO, 0});
+    return 0;
+}
+
+// static
+int OscControl::quit_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data) {
+    OscControl *osc = (OscControl*)user_data;
+    osc->trigger_quit_by_osc();
+    return 0;
+}
+
+} // namespace xosc
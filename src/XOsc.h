@@ -0,0 +1,159 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include <atomic>
+#include <string>
+#include <future>
+#include <sigc++/sigc++.h>
+
+#include <lo/lo.h>
+
+#include "Mamba.h"
+#include "XJack.h"
+#include "XSynth.h"
+
+#pragma once
+
+#ifndef XOSC_H
+#define XOSC_H
+
+
+namespace xosc {
+
+
+/****************************************************************
+ ** class OscControl
+ **
+ ** control the looper over OSC when running headless,
+ ** the OSC socket is watched by the reactor. Midi messages
+ ** in a timestamped bundle are send sample accurate by XJack.
+ ** In a engine process the looper commands of the GUI arrive
+ ** over the EngineLink and run the same way as the OSC ones
+ **
+ **   /mamba/record i       1 start a take on the channel, 0 stop it
+ **   /mamba/overdub i      1 overdub the loop on the channel, 0 stop it
+ **   /mamba/omni i         1 record all channels into their own loops, 0 stop it
+ **   /mamba/play i         1 play the loops, 0 stop
+ **   /mamba/clear i        clear the loop on channel i, -1 clear all
+ **   /mamba/bpm i|f        playback BPM
+ **   /mamba/channel i      channel to record on, 0 - 15
+ **   /mamba/soundfont s    load a soundfont into fluidsynth
+ **   /mamba/load s         load a MIDI file as loop
+ **   /mamba/save s         save the loops to a MIDI file
+ **   /mamba/midi m         send a midi message
+ **   /mamba/note iii       channel, key, velocity (0 is note off)
+ **   /mamba/take/store i   keep the loop on channel i packed in memory, -1 current
+ **   /mamba/take/recall ii take, channel (-1 the channel it was stored from)
+ **   /mamba/scene/store    keep all loops packed in memory
+ **   /mamba/scene/recall i replace all loops with the stored scene
+ **   /mamba/undo           undo the last record, clear, load or recall
+ **   /mamba/capture        make a loop on the channel from what was just played
+ **   /mamba/redo
+ **   /mamba/quit
+ */
+
+class OscControl : public sigc::trackable {
+private:
+    xjack::XJack *xjack;
+    xsynth::XSynth *xsynth;
+    mamba::MidiMessenger *mmessage;
+    mamba::Reactor *reactor;
+    mamba::MidiLoad load;
+    mamba::MidiSave save;
+    mamba::LoopLibrary library;
+    lo_server server;
+    int osc_fd;
+    int timer_fd;
+    int link_fd;
+    int channel;
+    int song_bpm;
+    int mbpm;
+    std::atomic<bool> sf_loading;
+    std::future<void> sf_loader;
+
+    jack_nframes_t frame_for(lo_message msg) noexcept;
+    void schedule(const uint8_t *midi, uint8_t num, lo_message msg) noexcept;
+    void stop_play();
+    void check_record_off();
+    void recall(int take, int channel);
+
+    static void error_handler(int num, const char *msg, const char *path);
+    static int record_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int overdub_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int omni_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int play_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int clear_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int bpm_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int channel_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int soundfont_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int load_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int save_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int midi_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int note_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int take_store_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int take_recall_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int scene_store_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int scene_recall_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int capture_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int undo_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+    static int quit_handler(const char *path, const char *types,
+                    lo_arg **argv, int argc, lo_message msg, void *user_data);
+
+public:
+    OscControl(xjack::XJack *xjack, xsynth::XSynth *xsynth,
+        mamba::MidiMessenger *mmessage, mamba::Reactor *reactor);
+    ~OscControl();
+
+    // open the OSC server on port and start to listen
+    bool init(const char *port, int channel, int song_bpm);
+    void close();
+    // load a MIDI file as loop, like /mamba/load
+    bool load_file(const char *file);
+    // run a looper command, the OSC handlers end up here as well
+    void command(const mamba::EngineCommand& c);
+    // take the commands the GUI of a engine process send
+    void attach_link(mamba::EngineLink *l);
+
+    sigc::signal<void > trigger_quit_by_osc;
+    sigc::signal<void >& signal_trigger_quit_by_osc() { return trigger_quit_by_osc; }
+};
+
+} // namespace xosc
+
+#endif //XOSC_H_
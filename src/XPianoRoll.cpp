@@ -0,0 +1,426 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "XPianoRoll.h"
+#include "xkeyboard.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+#ifdef ENABLE_NLS
+#include <libintl.h>
+#define _(S) gettext(S)
+#else
+#define _(S) S
+#endif
+
+
+namespace xpianoroll {
+
+
+/****************************************************************
+ ** class XPianoRoll
+ **
+ ** show the content of the loops in a piano roll window
+ */
+
+XPianoRoll::XPianoRoll()
+    : rec(NULL),
+    roll(NULL),
+    roll_size({0, 0}),
+    scroll(NULL),
+    zoom(NULL),
+    total_time(0.0),
+    visible(false),
+    win(NULL) {
+    for (int i = 0; i < 16; i++) {
+        view[i].generation = 0;
+        view[i].end = 0.0;
+        view[i].bin_time = 0.01;
+        view[i].bucket_time = 1.0;
+    }
+}
+
+XPianoRoll::~XPianoRoll() {
+}
+
+bool XPianoRoll::channel_changed(int c) const noexcept {
+    return !view[c].loop ||
+        view[c].generation != rec->generation[c].load(std::memory_order_acquire);
+}
+
+// the notes of v which sound in [t0, t1), in start order for each part:
+// first those carried into the bucket of t0, then those starting in it or later.
+// both use the same bucket index, so a note is never missed or passed twice
+template <typename F>
+static void for_visible_notes(const ChannelView& v, double t0, double t1, F f) {
+    if (v.notes.empty()) return;
+    const size_t k = min(v.carry_at.size() - 2, (size_t)max(0.0, t0 / v.bucket_time));
+    for (uint32_t i = v.carry_at[k]; i < v.carry_at[k+1]; i++) {
+        const NoteSpan& n = v.notes[v.carry[i]];
+        if (n.end >= t0) f(n);
+    }
+    auto first = std::lower_bound(v.notes.begin(), v.notes.end(), k,
+        [&v](const NoteSpan& n, size_t b) { return (size_t)(n.start / v.bucket_time) < b; });
+    for (auto n = first; n != v.notes.end() && n->start < t1; ++n) {
+        if (n->end >= t0) f(*n);
+    }
+}
+
+// about how many notes for_visible_notes() would pass
+static size_t count_visible_notes(const ChannelView& v, double t0, double t1) {
+    if (v.notes.empty()) return 0;
+    const size_t k = min(v.carry_at.size() - 2, (size_t)max(0.0, t0 / v.bucket_time));
+    auto first = std::lower_bound(v.notes.begin(), v.notes.end(), k,
+        [&v](const NoteSpan& n, size_t b) { return (size_t)(n.start / v.bucket_time) < b; });
+    auto last = std::lower_bound(first, v.notes.end(), t1,
+        [](const NoteSpan& n, double t) { return n.start < t; });
+    return (v.carry_at[k+1] - v.carry_at[k]) + (last - first);
+}
+
+static inline bool same_span(const NoteSpan& a, const NoteSpan& b) noexcept {
+    return a.start == b.start && a.end == b.end && a.key == b.key && a.velocity == b.velocity;
+}
+
+static inline void add_to_bin(LodBin& b, const LodBin& from) noexcept {
+    if (!from.count) return;
+    b.lo = min(b.lo, from.lo);
+    b.hi = max(b.hi, from.hi);
+    b.count = (uint16_t)min(0xFFFF, b.count + from.count);
+}
+
+// pair note on/off events to spans, sorted by start time
+void XPianoRoll::build_channel(int c) {
+    ChannelView& v = view[c];
+    v.generation = rec->generation[c].load(std::memory_order_acquire);
+    // the buffer is immutable, holding it keeps it valid while it is read
+    v.loop = rec->loop(c);
+    const std::vector<mamba::MidiEvent>& play = *v.loop;
+    std::vector<NoteSpan> prev;
+    prev.swap(v.notes);
+    v.notes.reserve(prev.size());
+    v.end = play.empty() ? 0.0 : play.back().absoluteTime();
+
+    double open[128];
+    uint8_t vel[128];
+    std::fill(open, open+128, -1.0);
+    for (auto const& ev : play) {
+        const int status = ev.buffer[0] & 0xF0;
+        const int key = ev.buffer[1] & 0x7F;
+        const bool on = status == 0x90 && ev.buffer[2] > 0;
+        const bool off = status == 0x80 || (status == 0x90 && ev.buffer[2] == 0);
+        if (!on && !off) continue;
+        if (open[key] >= 0.0) {
+            v.notes.push_back({open[key], ev.absoluteTime(), (uint8_t)key, vel[key]});
+            open[key] = -1.0;
+        }
+        if (on) {
+            open[key] = ev.absoluteTime();
+            vel[key] = ev.buffer[2];
+        }
+    }
+    for (int key = 0; key < 128; key++) {
+        if (open[key] >= 0.0)
+            v.notes.push_back({open[key], v.end, (uint8_t)key, vel[key]});
+    }
+    // order equal starts by key, so a unchanged part of the loop
+    // gives the same sequence of spans as before
+    std::sort(v.notes.begin(), v.notes.end(), [](const NoteSpan& a, const NoteSpan& b) {
+        return a.start < b.start || (a.start == b.start && a.key < b.key);
+    });
+    build_index(v);
+    // level 0 is kept at a sane size for very long loops, when that
+    // changes the bin size all levels need to be build new
+    const double bin_time = max(0.01, v.end / (double)(1 << 18));
+    if (v.lod.empty() || v.notes.empty() || bin_time != v.bin_time) {
+        v.bin_time = bin_time;
+        build_lod(v);
+    } else {
+        update_lod(v, prev);
+    }
+}
+
+// a note is carried into every bucket which starts while it sounds,
+// there are never more then 128 notes sounding on one channel at once
+void XPianoRoll::build_index(ChannelView& v) {
+    v.carry_at.clear();
+    v.carry.clear();
+    if (v.notes.empty()) return;
+    v.bucket_time = max(0.1, v.end / 4096.0);
+    const size_t nb = (size_t)(v.end / v.bucket_time) + 1;
+    v.carry_at.assign(nb + 1, 0);
+    for (auto const& n : v.notes) {
+        const size_t k1 = min(nb - 1, (size_t)(n.end / v.bucket_time));
+        for (size_t k = (size_t)(n.start / v.bucket_time) + 1; k <= k1; k++)
+            v.carry_at[k+1]++;
+    }
+    for (size_t k = 0; k < nb; k++) v.carry_at[k+1] += v.carry_at[k];
+    v.carry.resize(v.carry_at[nb]);
+    std::vector<uint32_t> fill(v.carry_at.begin(), v.carry_at.end() - 1);
+    for (uint32_t i = 0; i < v.notes.size(); i++) {
+        const NoteSpan& n = v.notes[i];
+        const size_t k1 = min(nb - 1, (size_t)(n.end / v.bucket_time));
+        for (size_t k = (size_t)(n.start / v.bucket_time) + 1; k <= k1; k++)
+            v.carry[fill[k]++] = i;
+    }
+}
+
+// level 0 bins hold the key range sounding in each bin,
+// every further level merges two bins of the level below
+void XPianoRoll::build_lod(ChannelView& v) {
+    v.lod.clear();
+    if (v.notes.empty()) return;
+    size_t nbins = (size_t)(v.end / v.bin_time) + 1;
+    v.lod.emplace_back(nbins, LodBin{127, 0, 0});
+    std::vector<LodBin>& l0 = v.lod[0];
+    for (auto const& n : v.notes) {
+        size_t b0 = min(nbins-1, (size_t)(n.start / v.bin_time));
+        size_t b1 = min(nbins-1, (size_t)(n.end / v.bin_time));
+        for (size_t b = b0; b <= b1; b++) {
+            l0[b].lo = min(l0[b].lo, n.key);
+            l0[b].hi = max(l0[b].hi, n.key);
+            if (l0[b].count < 0xFFFF) l0[b].count++;
+        }
+    }
+    while (v.lod.back().size() > 1) {
+        const std::vector<LodBin>& below = v.lod.back();
+        std::vector<LodBin> up((below.size()+1)/2, LodBin{127, 0, 0});
+        for (size_t b = 0; b < below.size(); b++) add_to_bin(up[b/2], below[b]);
+        v.lod.push_back(std::move(up));
+    }
+}
+
+// only the bins touched by spans which differ from prev are build new,
+// recording and overdub mostly change the end of a loop only
+void XPianoRoll::update_lod(ChannelView& v, const std::vector<NoteSpan>& prev) {
+    size_t i = 0;
+    while (i < prev.size() && i < v.notes.size() && same_span(prev[i], v.notes[i])) i++;
+    size_t pe = prev.size();
+    size_t ne = v.notes.size();
+    while (pe > i && ne > i && same_span(prev[pe-1], v.notes[ne-1])) {
+        pe--;
+        ne--;
+    }
+    double lo = v.end;
+    double hi = 0.0;
+    for (size_t j = i; j < pe; j++) {
+        lo = min(lo, prev[j].start);
+        hi = max(hi, prev[j].end);
+    }
+    for (size_t j = i; j < ne; j++) {
+        lo = min(lo, v.notes[j].start);
+        hi = max(hi, v.notes[j].end);
+    }
+
+    std::vector<LodBin>& l0 = v.lod[0];
+    const size_t old_bins = l0.size();
+    const size_t nbins = (size_t)(v.end / v.bin_time) + 1;
+    l0.resize(nbins, LodBin{127, 0, 0});
+    size_t b_lo = min(nbins-1, (size_t)(lo / v.bin_time));
+    size_t b_hi = min(nbins-1, (size_t)(hi / v.bin_time));
+    if (lo > hi) b_lo = b_hi = nbins-1;
+    if (nbins != old_bins) {
+        b_lo = min(b_lo, min(old_bins, nbins) - 1);
+        b_hi = nbins-1;
+    }
+    for (size_t b = b_lo; b <= b_hi; b++) l0[b] = LodBin{127, 0, 0};
+    // ask for a bin more on both sides, which bins a note fills is decided
+    // by the bin index only, like in build_lod()
+    for_visible_notes(v, (b_lo - 1.0) * v.bin_time, (b_hi + 2) * v.bin_time, [&](const NoteSpan& n) {
+        size_t b0 = max(b_lo, min(nbins-1, (size_t)(n.start / v.bin_time)));
+        size_t b1 = min(b_hi, (size_t)(n.end / v.bin_time));
+        for (size_t b = b0; b <= b1; b++) {
+            l0[b].lo = min(l0[b].lo, n.key);
+            l0[b].hi = max(l0[b].hi, n.key);
+            if (l0[b].count < 0xFFFF) l0[b].count++;
+        }
+    });
+
+    size_t l = 1;
+    for (; v.lod[l-1].size() > 1; l++) {
+        if (l == v.lod.size()) v.lod.emplace_back();
+        const std::vector<LodBin>& below = v.lod[l-1];
+        std::vector<LodBin>& up = v.lod[l];
+        up.resize((below.size()+1)/2, LodBin{127, 0, 0});
+        b_lo >>= 1;
+        b_hi = min(up.size()-1, b_hi >> 1);
+        for (size_t b = b_lo; b <= b_hi; b++) {
+            up[b] = LodBin{127, 0, 0};
+            add_to_bin(up[b], below[2*b]);
+            if (2*b+1 < below.size()) add_to_bin(up[b], below[2*b+1]);
+        }
+        // a shorter level below leaves its last bin half filled
+        LodBin& last = up.back();
+        last = LodBin{127, 0, 0};
+        add_to_bin(last, below[2*(up.size()-1)]);
+        if (2*up.size()-1 < below.size()) add_to_bin(last, below[2*up.size()-1]);
+    }
+    v.lod.resize(l);
+}
+
+void XPianoRoll::update() {
+    if (!win || !is_visible()) return;
+    bool changed = false;
+    for (int c = 0; c < 16; c++) {
+        if (!channel_changed(c)) continue;
+        build_channel(c);
+        changed = true;
+    }
+    if (!changed) return;
+    total_time = 0.0;
+    for (int c = 0; c < 16; c++) total_time = max(total_time, view[c].end);
+    expose_widget(roll);
+}
+
+void XPianoRoll::draw_notes(cairo_t *cr, const ChannelView& v, double t0, double t1,
+                                double px_per_sec, double key_h, int height) {
+    for_visible_notes(v, t0, t1, [&](const NoteSpan& n) {
+        double x = (n.start - t0) * px_per_sec;
+        double w = max(1.0, (n.end - n.start) * px_per_sec);
+        cairo_rectangle(cr, x, height - (n.key+1) * key_h, w, max(1.0, key_h));
+    });
+    cairo_fill(cr);
+}
+
+void XPianoRoll::draw_lod(cairo_t *cr, const ChannelView& v, int level, double t0, double t1,
+                                double px_per_sec, double key_h, int height) {
+    const std::vector<LodBin>& bins = v.lod[level];
+    const double bt = v.bin_time * (double)(1 << level);
+    size_t b0 = (size_t)max(0.0, t0 / bt);
+    size_t b1 = min(bins.size(), (size_t)(t1 / bt) + 1);
+    for (size_t b = b0; b < b1; b++) {
+        if (!bins[b].count) continue;
+        double x = (b * bt - t0) * px_per_sec;
+        double w = max(1.0, bt * px_per_sec);
+        double y = height - (bins[b].hi+1) * key_h;
+        cairo_rectangle(cr, x, y, w, (bins[b].hi - bins[b].lo + 1) * key_h);
+    }
+    cairo_fill(cr);
+}
+
+// static
+void XPianoRoll::draw_roll(void *w_, void* user_data) {
+    Widget_t *w = (Widget_t*)w_;
+    XPianoRoll *proll = (XPianoRoll*)w->parent_struct;
+    if (!proll->is_visible()) return;
+    const int width = proll->roll_size.width;
+    const int height = proll->roll_size.height;
+    const double key_h = height / 128.0;
+
+    cairo_set_source_rgb(w->crb, 0.1, 0.1, 0.1);
+    cairo_paint(w->crb);
+    // mark the C keys
+    cairo_set_source_rgba(w->crb, 1.0, 1.0, 1.0, 0.06);
+    for (int key = 0; key < 128; key += 12)
+        cairo_rectangle(w->crb, 0, height - (key+1) * key_h, width, key_h);
+    cairo_fill(w->crb);
+
+    if (proll->total_time <= 0.0) return;
+    const double z = std::pow(2.0, adj_get_value(proll->zoom->adj));
+    const double span = proll->total_time / z;
+    const double t0 = adj_get_value(proll->scroll->adj) * (proll->total_time - span);
+    const double t1 = t0 + span;
+    const double px_per_sec = width / span;
+
+    for (int c = 0; c < 16; c++) {
+        const ChannelView& v = proll->view[c];
+        if (v.notes.empty()) continue;
+        use_matrix_color(w, c);
+        // draw single notes only while there are not much more then pixels
+        if (count_visible_notes(v, t0, t1) <= (size_t)(4 * width) || v.lod.empty()) {
+            proll->draw_notes(w->crb, v, t0, t1, px_per_sec, key_h, height);
+        } else {
+            int level = 0;
+            const double sec_per_px = 1.0 / px_per_sec;
+            while (level < (int)v.lod.size()-1 &&
+                    v.bin_time * (double)(1 << level) < sec_per_px) level++;
+            proll->draw_lod(w->crb, v, level, t0, t1, px_per_sec, key_h, height);
+        }
+    }
+}
+
+// static
+void XPianoRoll::view_changed_callback(void *w_, void* user_data) {
+    Widget_t *w = (Widget_t*)w_;
+    XPianoRoll *proll = (XPianoRoll*)w->parent_struct;
+    expose_widget(proll->roll);
+}
+
+// static
+void XPianoRoll::map_callback(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    XPianoRoll *proll = (XPianoRoll*)w->parent_struct;
+    proll->visible.store(true, std::memory_order_release);
+}
+
+// static
+void XPianoRoll::unmap_callback(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    XPianoRoll *proll = (XPianoRoll*)w->parent_struct;
+    proll->visible.store(false, std::memory_order_release);
+}
+
+// static
+void XPianoRoll::mem_free_callback(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    XPianoRoll *proll = (XPianoRoll*)w->parent_struct;
+    proll->visible.store(false, std::memory_order_release);
+    proll->win = NULL;
+}
+
+void XPianoRoll::show(int present) {
+    if (!win) return;
+    if (present) {
+        widget_show_all(win);
+        visible.store(true, std::memory_order_release);
+        // rebuild all channels when the window comes up
+        for (int c = 0; c < 16; c++) view[c].loop.reset();
+        update();
+    } else {
+        widget_hide(win);
+    }
+}
+
+void XPianoRoll::init(Widget_t *parent, mamba::MidiRecord *rec_) {
+    rec = rec_;
+    win = xtoolwindow::create_tool_window(parent, _("Mamba - Piano Roll"), 700, 400, this);
+    win->func.map_notify_callback = map_callback;
+    win->func.unmap_notify_callback = unmap_callback;
+    win->func.mem_free_callback = mem_free_callback;
+
+    roll = xtoolwindow::add_tool_view(win, 10, 10, 680, 330, &roll_size, draw_roll);
+
+    scroll = add_hslider(win, _("Position"), 10, 350, 430, 40);
+    set_adjustment(scroll->adj, 0.0, 0.0, 0.0, 1.0, 0.001, CL_CONTINUOS);
+    scroll->scale.gravity = SOUTHWEST;
+    scroll->flags |= NO_AUTOREPEAT | NO_PROPAGATE;
+    scroll->parent_struct = this;
+    scroll->func.value_changed_callback = view_changed_callback;
+
+    zoom = add_hslider(win, _("Zoom"), 450, 350, 240, 40);
+    set_adjustment(zoom->adj, 0.0, 0.0, 0.0, 12.0, 0.1, CL_CONTINUOS);
+    zoom->scale.gravity = SOUTHWEST;
+    zoom->flags |= NO_AUTOREPEAT | NO_PROPAGATE;
+    zoom->parent_struct = this;
+    zoom->func.value_changed_callback = view_changed_callback;
+}
+
+} // namespace xpianoroll
@@ -0,0 +1,137 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include "Mamba.h"
+#include "xwidgets.h"
+#include "XToolWindow.h"
+
+#pragma once
+
+#ifndef XPIANOROLL_H
+#define XPIANOROLL_H
+
+
+namespace xpianoroll {
+
+
+/****************************************************************
+ ** struct NoteSpan
+ **
+ ** a note on/off pair from the loop, in seconds
+ */
+
+typedef struct {
+    double start;
+    double end;
+    uint8_t key;
+    uint8_t velocity;
+} NoteSpan;
+
+/****************************************************************
+ ** struct LodBin
+ **
+ ** summary of all notes sounding in a time bin
+ */
+
+typedef struct {
+    uint8_t lo;
+    uint8_t hi;
+    uint16_t count;
+} LodBin;
+
+/****************************************************************
+ ** struct ChannelView
+ **
+ ** note spans and level of detail summaries for one channel,
+ ** updated only when the loop on this channel has changed
+ */
+
+typedef struct {
+    unsigned int generation;
+    mamba::LoopBuffer loop;
+    double end;
+    double bin_time;
+    double bucket_time;
+    std::vector<NoteSpan> notes;
+    // notes already sounding at the start of bucket k, that is
+    // carry[carry_at[k]] up to carry[carry_at[k+1]], as index in notes
+    std::vector<uint32_t> carry_at;
+    std::vector<uint32_t> carry;
+    // lod[l] holds bins of bin_time * 2^l seconds
+    std::vector<std::vector<LodBin> > lod;
+} ChannelView;
+
+
+/****************************************************************
+ ** class XPianoRoll
+ **
+ ** show the content of the loops in a piano roll window,
+ ** only the visible time range is drawn, zoomed out views
+ ** use the level of detail summaries
+ */
+
+class XPianoRoll {
+private:
+    mamba::MidiRecord *rec;
+    Widget_t *roll;
+    xtoolwindow::ViewSize roll_size;
+    Widget_t *scroll;
+    Widget_t *zoom;
+    ChannelView view[16];
+    double total_time;
+    std::atomic<bool> visible;
+
+    bool channel_changed(int c) const noexcept;
+    void build_channel(int c);
+    void build_index(ChannelView& v);
+    void build_lod(ChannelView& v);
+    void update_lod(ChannelView& v, const std::vector<NoteSpan>& prev);
+    void draw_notes(cairo_t *cr, const ChannelView& v, double t0, double t1,
+                                    double px_per_sec, double key_h, int height);
+    void draw_lod(cairo_t *cr, const ChannelView& v, int level, double t0, double t1,
+                                    double px_per_sec, double key_h, int height);
+
+    static void draw_roll(void *w_, void* user_data);
+    static void view_changed_callback(void *w_, void* user_data);
+    static void map_callback(void *w_, void* user_data) noexcept;
+    static void unmap_callback(void *w_, void* user_data) noexcept;
+    static void mem_free_callback(void *w_, void* user_data) noexcept;
+
+public:
+    XPianoRoll();
+    ~XPianoRoll();
+
+    Widget_t *win;
+
+    void init(Widget_t *parent, mamba::MidiRecord *rec);
+    void show(int present);
+    // update changed channels and redraw, called from the GUI thread
+    void update();
+    bool is_visible() const noexcept { return visible.load(std::memory_order_acquire); }
+};
+
+} // namespace xpianoroll
+
+#endif //XPIANOROLL_H_
@@ -31,7 +31,8 @@ namespace xsynth {
  ** create a fluidsynth instance and load sondfont
  */
 
-XSynth::XSynth() {
+XSynth::XSynth()
+    : active(false) {
     sf_id = -1;
     adriver = NULL;
     mdriver = NULL;
@@ -80,6 +81,18 @@ void XSynth::init_synth() {
     mdriver = new_fluid_midi_driver(settings, fluid_synth_handle_midi_event, synth);
 }
 
+int XSynth::load(unsigned int SampleRate, const char *path) {
+    std::unique_lock<std::mutex> lk(loader);
+    active.store(false, std::memory_order_release);
+    if (!synth) {
+        setup(SampleRate);
+        init_synth();
+    }
+    int ret = load_soundfont(path);
+    active.store(synth != NULL, std::memory_order_release);
+    return ret;
+}
+
 int XSynth::load_soundfont(const char *path) {
     if (sf_id != -1) fluid_synth_sfunload(synth, sf_id, 0);
     sf_id = fluid_synth_sfload(synth, path, 1);
@@ -216,6 +229,8 @@ void XSynth::panic() {
 }
 
 void XSynth::unload_synth() {
+    std::unique_lock<std::mutex> lk(loader);
+    active.store(false, std::memory_order_release);
     if (sf_id != -1) {
         fluid_synth_sfunload(synth, sf_id, 0);
         sf_id = -1;
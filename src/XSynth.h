@@ -21,6 +21,8 @@
 #include <fluidsynth.h>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <mutex>
 
 #pragma once
 
@@ -44,6 +46,14 @@ private:
     fluid_audio_driver_t* adriver;
     fluid_midi_driver_t* mdriver;
     int sf_id;
+    // serialize load() and unload_synth() from all threads
+    std::mutex loader;
+    // set once a load finished, the instruments are stable then
+    std::atomic<bool> active;
+
+    void setup(unsigned int SampleRate);
+    void init_synth();
+    int load_soundfont(const char *path);
 
 public:
     XSynth();
@@ -63,10 +73,11 @@ public:
     double chorus_level;
     int chorus_voices;
 
-    void setup(unsigned int SampleRate);
-    void init_synth();
-    int synth_is_active() {return synth ? 1 : 0;}
-    int load_soundfont(const char *path);
+    // create the synth when needed and load the soundfont, from any thread.
+    // return 0 on success like load_soundfont()
+    int load(unsigned int SampleRate, const char *path);
+    // false while a load is running
+    int synth_is_active() {return active.load(std::memory_order_acquire) ? 1 : 0;}
     void print_soundfont();
     void set_default_instruments();
     void set_instrument_on_channel(int channel, int instrument);
@@ -0,0 +1,72 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "XToolWindow.h"
+
+
+namespace xtoolwindow {
+
+
+static void draw_tool_window(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    set_pattern(w,&w->app->color_scheme->selected,&w->app->color_scheme->normal,BACKGROUND_);
+    cairo_paint (w->crb);
+}
+
+static void tool_view_configure(void *w_, void* user_data) noexcept {
+    Widget_t *w = (Widget_t*)w_;
+    ViewSize *size = (ViewSize*)w->private_struct;
+    // libxputty has set the new geometry already
+    size->width = w->width;
+    size->height = w->height;
+}
+
+Widget_t *create_tool_window(Widget_t *parent, const char *title,
+                                int width, int height, void *owner) {
+    Widget_t *win = create_window(parent->app, DefaultRootWindow(parent->app->dpy), 0, 0, width, height);
+    XSelectInput(parent->app->dpy, win->widget,StructureNotifyMask|ExposureMask|KeyPressMask 
+                    |EnterWindowMask|LeaveWindowMask|ButtonReleaseMask|KeyReleaseMask
+                    |ButtonPressMask|Button1MotionMask|PointerMotionMask);
+    XSetTransientForHint(parent->app->dpy, win->widget, parent->widget);
+    widget_set_title(win, title);
+    win->flags &= ~USE_TRANSPARENCY;
+    win->flags |= NO_AUTOREPEAT | NO_PROPAGATE;
+    win->scale.gravity = CENTER;
+    win->parent = parent;
+    win->parent_struct = owner;
+    win->func.expose_callback = draw_tool_window;
+    return win;
+}
+
+Widget_t *add_tool_view(Widget_t *win, int x, int y, int width, int height,
+                                ViewSize *size, xevfunc draw) {
+    Widget_t *view = create_widget(win->app, win, x, y, width, height);
+    view->flags &= ~USE_TRANSPARENCY;
+    view->scale.gravity = NORTHWEST;
+    view->parent_struct = win->parent_struct;
+    view->private_struct = size;
+    view->func.expose_callback = draw;
+    view->func.configure_notify_callback = tool_view_configure;
+    size->width = width;
+    size->height = height;
+    return view;
+}
+
+} // namespace xtoolwindow
@@ -0,0 +1,56 @@
+/*
+ *                           0BSD 
+ * 
+ *                    BSD Zero Clause License
+ * 
+ *  Copyright (c) 2020 Hermann Meyer
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "xwidgets.h"
+
+#pragma once
+
+#ifndef XTOOLWINDOW_H
+#define XTOOLWINDOW_H
+
+
+namespace xtoolwindow {
+
+
+/****************************************************************
+ ** struct ViewSize
+ **
+ ** size of the drawing area in a tool window, kept from the
+ ** ConfigureNotify events, so a expose needs no server round trip
+ */
+
+typedef struct {
+    int width;
+    int height;
+} ViewSize;
+
+// create a window transient for parent with the events and flags
+// shared by the piano roll and the midi monitor,
+// owner is set as parent_struct
+Widget_t *create_tool_window(Widget_t *parent, const char *title,
+                                int width, int height, void *owner);
+
+// add the drawing area to win, size follows each ConfigureNotify
+Widget_t *add_tool_view(Widget_t *win, int x, int y, int width, int height,
+                                ViewSize *size, xevfunc draw);
+
+} // namespace xtoolwindow
+
+#endif //XTOOLWINDOW_H_
@@ -357,6 +357,7 @@ void save_custom_keymap(Widget_t *w) {
     }
     fclose(fp);
     read_keymap(w->label,keys->custom_keys);
+    build_keymap_table(&keys->custom_table, keys->custom_keys);
 }
 
 void save_callback(void *w_, void* user_data) {
@@ -30,420 +30,248 @@ void add_major_chords(long inkey, long *outkey[3]) {
     (*outkey[2]) = inkey + 7;
 }
 
-void keysym_azerty_to_midi_key(long inkey, float *midi_key) {
+/* built-in layouts as (keysym, note) pairs, expanded into KeyNoteTables
+   on first use, so the input path is a single table lookup */
+typedef struct {
+    long keysym;
+    signed char note;
+} KeyNote;
+
+static const KeyNote azerty_keys[] = {
     /* these keys are common to all types of azerty keyboards */
-    switch(inkey) {
-        case(XK_w) : (*midi_key) = 12.0; /* w = C0 */
-        break;
-        case(XK_s) : (*midi_key) = 13.0; /* s */
-        break;
-        case(XK_x) : (*midi_key) = 14.0; /* x */
-        break;
-        case(XK_d) : (*midi_key) = 15.0; /* d */
-        break;
-        case(XK_c) : (*midi_key) = 16.0; /* c */
-        break;
-        case(XK_v) : (*midi_key) = 17.0; /* v */
-        break;
-        case(XK_g) : (*midi_key) = 18.0; /* g */
-        break;
-        case(XK_b) : (*midi_key) = 19.0; /* b */
-        break;
-        case(XK_h) : (*midi_key) = 20.0; /* h */
-        break;
-        case(XK_n) : (*midi_key) = 21.0; /* n */
-        break;
-        case(XK_j) : (*midi_key) = 22.0; /* j */
-        break;
-        case(XK_a) : (*midi_key) = 24.0; /* a = C1 */
-        break;
-        case(XK_l) : (*midi_key) = 25.0; /* l */
-        break;
-        case(XK_z) : (*midi_key) = 26.0; /* z */
-        break;
-        case(XK_m) : (*midi_key) = 27.0; /* m */
-        break;
-        case(XK_e) : (*midi_key) = 28.0; /* e */
-        break;
-        case(XK_r) : (*midi_key) = 29.0; /* r */
-        break;
-        case(XK_t) : (*midi_key) = 31.0; /* t */
-        break;
-        case(XK_y) : (*midi_key) = 33.0; /* y */
-        break;
-        case(XK_u) : (*midi_key) = 35.0; /* u */
-        break;
-        case(XK_i) : (*midi_key) = 36.0; /* i */
-        break;
-        case(XK_o) : (*midi_key) = 38.0; /* o */
-        break;
-        case(XK_p) : (*midi_key) = 40.0; /* p */
-        break;
-    }
+    {XK_w, 12}, /* w = C0 */ {XK_s, 13}, {XK_x, 14}, {XK_d, 15}, {XK_c, 16},
+    {XK_v, 17}, {XK_g, 18}, {XK_b, 19}, {XK_h, 20}, {XK_n, 21}, {XK_j, 22},
+    {XK_a, 24}, /* a = C1 */ {XK_l, 25}, {XK_z, 26}, {XK_m, 27}, {XK_e, 28},
+    {XK_r, 29}, {XK_t, 31}, {XK_y, 33}, {XK_u, 35}, {XK_i, 36}, {XK_o, 38},
+    {XK_p, 40},
+};
+
+static const KeyNote azerty_fr_keys[] = {
+    /* common azerty keyboards sell in France */
+    {XK_less, 11}, /* "<" = B-1 */ {XK_comma, 23}, {XK_semicolon, 24}, /* ; = C1 */
+    {XK_eacute, 25}, {XK_colon, 26}, {XK_quotedbl, 27}, {XK_exclam, 28},
+    {XK_ugrave, 29}, /* ù = F1 */ {XK_asterisk, 30}, {XK_parenleft, 30},
+    {XK_minus, 32}, {XK_egrave, 34}, {XK_ccedilla, 37}, {XK_agrave, 39},
+    {XK_parenright, 41}, /* ) = F2 */ {XK_equal, 42}, {XK_dollar, 43},
+};
+
+static const KeyNote azerty_be_keys[] = {
+    /* common azerty keyboards sell in Belgium (Wallonia) */
+    {XK_less, 11}, /* "<" = B-1 */ {XK_comma, 23}, {XK_semicolon, 24}, /* ; = C1 */
+    {XK_eacute, 25}, {XK_colon, 26}, {XK_quotedbl, 27}, {XK_equal, 28},
+    {XK_ugrave, 29}, /* ù = F1 */ {XK_mu, 30}, {XK_parenleft, 30},
+    {XK_section, 32}, {XK_egrave, 34}, {XK_ccedilla, 37}, {XK_agrave, 39},
+    {XK_parenright, 41}, /* ) = F2 */ {XK_minus, 42}, {XK_dollar, 43},
+};
+
+static const KeyNote qwertz_keys[] = {
+    {XK_y, 12}, /* y = C0 */ {XK_s, 13}, {XK_x, 14}, {XK_d, 15}, {XK_c, 16},
+    {XK_v, 17}, {XK_g, 18}, {XK_b, 19}, {XK_h, 20}, {XK_n, 21}, {XK_j, 22},
+    {XK_m, 23}, {XK_q, 24}, {XK_2, 25}, {XK_w, 26}, {XK_3, 27}, {XK_e, 28},
+    {XK_r, 29}, {XK_5, 30}, {XK_t, 31}, {XK_6, 32}, {XK_z, 33}, {XK_7, 34},
+    {XK_u, 35}, {XK_i, 36}, {XK_9, 37}, {XK_o, 38}, {XK_0, 39}, {XK_p, 40},
+    {XK_udiaeresis, 41}, /* ü */ {XK_plus, 42},
+};
+
+/* qwerty is qwertz with y and z swapped */
+static const KeyNote qwerty_swap_keys[] = {
+    {XK_z, 12}, /* z = C0 */ {XK_y, 33},
+};
+
+#define N_KEYS(a) (sizeof(a)/sizeof(a[0]))
+
+static KeyNoteTable layout_tables[LAYOUT_TABLES];
+static bool layout_tables_done = false;
+
+static void clear_keymap_table(KeyNoteTable *table) {
+    memset(table->latin1, 0, sizeof table->latin1);
+    memset(table->misc, 0, sizeof table->misc);
+    table->n_other = 0;
 }
 
-void keysym_azerty_fr_to_midi_key(long inkey, float *midi_key) {
-    /* common azerty keyboards sell in France */
-    switch(inkey) {
-        case(XK_less) : (*midi_key) = 11.0; /* "<" = B-1 */
-        break;
-        case(XK_comma) : (*midi_key) = 23.0; /* , */
-        break;
-        case(XK_semicolon) : (*midi_key) = 24.0; /* ; = C1 */
-        break;
-        case(XK_eacute) : (*midi_key) = 25.0; /* é */
-        break;
-        case(XK_colon) : (*midi_key) = 26.0; /* : */
-        break;
-        case(XK_quotedbl) : (*midi_key) = 27.0; /* " */
-        break;
-        case(XK_exclam) : (*midi_key) = 28.0; /* ! */
-        break;
-        case(XK_ugrave) : (*midi_key) = 29.0; /* ù = F1 */
-        break;
-        case(XK_asterisk) : (*midi_key) = 30.0; /* * */
-        break;
-        case(XK_parenleft) : (*midi_key) = 30.0; /* ( */
-        break;
-        case(XK_minus) : (*midi_key) = 32.0; /* - */
-        break;
-        case(XK_egrave) : (*midi_key) = 34.0; /* è */
-        break;
-        case(XK_ccedilla) : (*midi_key) = 37.0; /* ç */
-        break;
-        case(XK_agrave) : (*midi_key) = 39.0; /* à */
-        break;
-        case (XK_parenright) : (*midi_key) = 41.0; /* ) = F2 */
-        break;
-        case (XK_equal) : (*midi_key) = 42.0; /* = */
-        break;
-        case (XK_dollar) : (*midi_key) = 43.0; /* $ */
-        break;
-        default: keysym_azerty_to_midi_key(inkey, midi_key);
+/* later entries override earlier ones, like the old switch fall through */
+static void add_to_keymap_table(KeyNoteTable *table, long keysym, int note) {
+    if (keysym <= 0 || note < 0 || note > 127) return;
+    if (keysym < 0x100) {
+        table->latin1[keysym] = (signed char)note;
+    } else if ((keysym >> 8) == 0xff) {
+        table->misc[keysym & 0xff] = (signed char)note;
+    } else {
+        int i = 0;
+        for(;i<table->n_other;i++) {
+            if (table->other[i].keysym == keysym) {
+                table->other[i].note = (signed char)note;
+                return;
+            }
+        }
+        if (table->n_other >= 256) return;
+        /* keep sorted for the binary search in keymap_lookup */
+        i = table->n_other;
+        while (i > 0 && table->other[i-1].keysym > keysym) {
+            table->other[i] = table->other[i-1];
+            i--;
+        }
+        table->other[i].keysym = keysym;
+        table->other[i].note = (signed char)note;
+        table->n_other++;
     }
 }
 
-void keysym_azerty_be_to_midi_key(long inkey, float *midi_key) {
-    /* common azerty keyboards sell in Belgium (Wallonia) */
-    switch(inkey) {
-        case(XK_less) : (*midi_key) = 11.0; /* "<" = B-1 */
-        break;
-        case(XK_comma) : (*midi_key) = 23.0; /* , */
-        break;
-        case(XK_semicolon) : (*midi_key) = 24.0; /* ; = C1 */
-        break;
-        case(XK_eacute) : (*midi_key) = 25.0; /* é */
-        break;
-        case(XK_colon) : (*midi_key) = 26.0; /* : */
-        break;
-        case(XK_quotedbl) : (*midi_key) = 27.0; /* " */
-        break;
-        case(XK_equal) : (*midi_key) = 28.0; /* = */
-        break;
-        case(XK_ugrave) : (*midi_key) = 29.0; /* ù = F1 */
-        break;
-        case(XK_mu) : (*midi_key) = 30.0; /* µ */
-        break;
-        case(XK_parenleft) : (*midi_key) = 30.0; /* ( */
-        break;
-        case(XK_section) : (*midi_key) = 32.0; /* § */
-        break;
-        case(XK_egrave) : (*midi_key) = 34.0; /* è */
-        break;
-        case(XK_ccedilla) : (*midi_key) = 37.0; /* ç */
-        break;
-        case(XK_agrave) : (*midi_key) = 39.0; /* à */
-        break;
-        case (XK_parenright) : (*midi_key) = 41.0; /* ) = F2 */
-        break;
-        case (XK_minus) : (*midi_key) = 42.0; /* - */
-        break;
-        case (XK_dollar) : (*midi_key) = 43.0; /* $ */
-        break;
-        default: keysym_azerty_to_midi_key(inkey, midi_key);
-    }
+static void add_keys_to_table(KeyNoteTable *table, const KeyNote *k, size_t n) {
+    size_t i = 0;
+    for(;i<n;i++) add_to_keymap_table(table, k[i].keysym, k[i].note);
 }
 
-void keysym_azerty_afnor_to_midi_key(long inkey, float *midi_key) {
-    /* probably a future standard for azerty keyboards */
-    switch(inkey) {
-        case(XK_less) : (*midi_key) = 11.0; /* "<" = B-1 */
-        break;
-        case(XK_KP_Decimal) : (*midi_key) = 23.0; /* . */
-        break;
-        case(XK_semicolon) : (*midi_key) = 24.0; /* ; = C1 */
-        break;
-        case(XK_eacute) : (*midi_key) = 25.0; /* é */
-        break;
-        case(XK_colon) : (*midi_key) = 26.0; /* : */
-        break;
-        case(XK_quotedbl) : (*midi_key) = 27.0; /* " */
-        break;
-        case(XK_exclam) : (*midi_key) = 28.0; /* ! */
-        break;
-        case(XK_ugrave) : (*midi_key) = 29.0; /* ù = F1 */
-        break;
-        case(XK_asterisk) : (*midi_key) = 30.0; /* * */
-        break;
-        case(XK_parenleft) : (*midi_key) = 30.0; /* ( */
-        break;
-        case(XK_minus) : (*midi_key) = 32.0; /* - */
-        break;
-        case(XK_egrave) : (*midi_key) = 34.0; /* è */
-        break;
-        case(XK_ccedilla) : (*midi_key) = 37.0; /* ç */
-        break;
-        case(XK_agrave) : (*midi_key) = 39.0; /* à */
-        break;
-        case (XK_parenright) : (*midi_key) = 41.0; /* ) = F2 */
-        break;
-        case (XK_equal) : (*midi_key) = 42.0; /* = */
-        break;
-        case (XK_dollar) : (*midi_key) = 43.0; /* $ */
-        break;
-        default: keysym_azerty_to_midi_key(inkey, midi_key);
-    }
+static void init_layout_tables() {
+    if (layout_tables_done) return;
+    int i = 0;
+    for(;i<LAYOUT_TABLES;i++) clear_keymap_table(&layout_tables[i]);
+    add_keys_to_table(&layout_tables[0], qwertz_keys, N_KEYS(qwertz_keys));
+    add_keys_to_table(&layout_tables[1], qwertz_keys, N_KEYS(qwertz_keys));
+    add_keys_to_table(&layout_tables[1], qwerty_swap_keys, N_KEYS(qwerty_swap_keys));
+    add_keys_to_table(&layout_tables[2], azerty_keys, N_KEYS(azerty_keys));
+    add_keys_to_table(&layout_tables[2], azerty_fr_keys, N_KEYS(azerty_fr_keys));
+    add_keys_to_table(&layout_tables[3], azerty_keys, N_KEYS(azerty_keys));
+    add_keys_to_table(&layout_tables[3], azerty_be_keys, N_KEYS(azerty_be_keys));
+    layout_tables_done = true;
 }
 
-void keysym_qwertz_to_midi_key(long inkey, float *midi_key) {
-    switch(inkey) {
-        case(XK_y) : (*midi_key) = 12.0; /* y = C0 */
-        break;
-        case(XK_s) : (*midi_key) = 13.0; /* s */
-        break;
-        case(XK_x) : (*midi_key) = 14.0; /* x */
-        break;
-        case(XK_d) : (*midi_key) = 15.0; /* d */
-        break;
-        case(XK_c) : (*midi_key) = 16.0; /* c */
-        break;
-        case(XK_v) : (*midi_key) = 17.0; /* v */
-        break;
-        case(XK_g) : (*midi_key) = 18.0; /* g */
-        break;
-        case(XK_b) : (*midi_key) = 19.0; /* b */
-        break;
-        case(XK_h) : (*midi_key) = 20.0; /* h */
-        break;
-        case(XK_n) : (*midi_key) = 21.0; /* n */
-        break;
-        case(XK_j) : (*midi_key) = 22.0; /* j */
-        break;
-        case(XK_m) : (*midi_key) = 23.0; /* m */
-        break;
-        case(XK_q) : (*midi_key) = 24.0; /* q */
-        break;
-        case(XK_2) : (*midi_key) = 25.0; /* 2 */
-        break;
-        case(XK_w) : (*midi_key) = 26.0; /* w */
-        break;
-        case(XK_3) : (*midi_key) = 27.0; /* 3 */
-        break;
-        case(XK_e) : (*midi_key) = 28.0; /* e */
-        break;
-        case(XK_r) : (*midi_key) = 29.0; /* r */
-        break;
-        case(XK_5) : (*midi_key) = 30.0; /* 5 */
-        break;
-        case(XK_t) : (*midi_key) = 31.0; /* t */
-        break;
-        case(XK_6) : (*midi_key) = 32.0; /* 6 */
-        break;
-        case(XK_z) : (*midi_key) = 33.0; /* z */
-        break;
-        case(XK_7) : (*midi_key) = 34.0; /* 7 */
-        break;
-        case(XK_u) : (*midi_key) = 35.0; /* u */
-        break;
-        case(XK_i) : (*midi_key) = 36.0; /* i */
-        break;
-        case(XK_9) : (*midi_key) = 37.0; /* 9 */
-        break;
-        case(XK_o) : (*midi_key) = 38.0; /* o */
-        break;
-        case(XK_0) : (*midi_key) = 39.0; /* 0 */
-        break;
-        case(XK_p) : (*midi_key) = 40.0; /* p */
-        break;
-        case(XK_udiaeresis) : (*midi_key) = 41.0; /* ü */
-        break;
-        case(XK_plus) : (*midi_key) = 42.0; /* + */
-        break;
+void build_keymap_table(KeyNoteTable *table, long custom_keys[128][2]) {
+    clear_keymap_table(table);
+    /* when a keysym is mapped twice, the lowest note wins */
+    int i = 127;
+    for(;i>=0;i--) {
+        int j = 1;
+        for(;j>=0;j--) {
+            add_to_keymap_table(table, custom_keys[i][j], i);
+        }
     }
 }
 
-void keysym_qwerty_to_midi_key(unsigned int inkey, float *midi_key) {
-    keysym_qwertz_to_midi_key(inkey,midi_key);
-    if ((*midi_key) == 12) (*midi_key) = 33;
-    else if ((*midi_key) == 33) (*midi_key) = 12;
+int keymap_lookup(const KeyNoteTable *table, long keysym) {
+    if (keysym <= 0) return 0;
+    if (keysym < 0x100) return table->latin1[keysym];
+    if ((keysym >> 8) == 0xff) return table->misc[keysym & 0xff];
+    int lo = 0;
+    int hi = table->n_other - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (table->other[mid].keysym == keysym) return table->other[mid].note;
+        if (table->other[mid].keysym < keysym) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return 0;
 }
 
-void custom_to_midi_key(long custom_keys[128][2], long inkey, float *midi_key) {
-    int i = 0;
-    for(;i<129;i++) {
-        int j = 0;
-        for(;j<2;j++) {
-            if (inkey == custom_keys[i][j]) {
-                (*midi_key) = (float)i;
-                return;
-            }
-        }
-    }
+static inline int key_word(int key) {
+    return (key >> 6) & 1;
 }
 
-void add_major_chord(unsigned long *key_matrix, int inkey, bool set) {
-    unsigned long *use_matrix = &key_matrix[0];
-    int key = inkey + 4;
-    
-    if(key>94) {
-        use_matrix = &key_matrix[3];
-        key -=94;
-    } else if(key>62) {
-        use_matrix = &key_matrix[2];
-        key -=62;
-    } else if(key>31) {
-        use_matrix = &key_matrix[1];
-        key -= 31;
-    }
-    if (set) {
-        (*use_matrix) |= (1 << key);
-    }else {
-        (*use_matrix) &= (~(1 << key));
-    }
+static inline uint64_t key_bit(int key) {
+    return (uint64_t)1 << (key & 63);
+}
 
-    key = inkey + 7;
-    if(key>94) {
-        use_matrix = &key_matrix[3];
-        key -=94;
-    } else if(key>62) {
-        use_matrix = &key_matrix[2];
-        key -=62;
-    } else if(key>31) {
-        use_matrix = &key_matrix[1];
-        key -= 31;
-    }
-    if (set) {
-        (*use_matrix) |= (1 << key);
-    }else {
-        (*use_matrix) &= (~(1 << key));
-    }
+void add_major_chord(KeyMatrix *key_matrix, int inkey, bool set) {
+    if (inkey+4 < 128) set_key_in_matrix(key_matrix, inkey + 4, set);
+    if (inkey+7 < 128) set_key_in_matrix(key_matrix, inkey + 7, set);
 }
 
-void add_minor_chord(unsigned long *key_matrix, int inkey, bool set) {
-    unsigned long *use_matrix = &key_matrix[0];
-    int key = inkey + 3;
-    
-    if(key>94) {
-        use_matrix = &key_matrix[3];
-        key -=94;
-    } else if(key>62) {
-        use_matrix = &key_matrix[2];
-        key -=62;
-    } else if(key>31) {
-        use_matrix = &key_matrix[1];
-        key -= 31;
-    }
-    if (set) {
-        (*use_matrix) |= (1 << key);
-    }else {
-        (*use_matrix) &= (~(1 << key));
-    }
+void add_minor_chord(KeyMatrix *key_matrix, int inkey, bool set) {
+    if (inkey+3 < 128) set_key_in_matrix(key_matrix, inkey + 3, set);
+    if (inkey+7 < 128) set_key_in_matrix(key_matrix, inkey + 7, set);
+}
 
-    key = inkey + 7;
-    if(key>94) {
-        use_matrix = &key_matrix[3];
-        key -=94;
-    } else if(key>62) {
-        use_matrix = &key_matrix[2];
-        key -=62;
-    } else if(key>31) {
-        use_matrix = &key_matrix[1];
-        key -= 31;
-    }
+void set_key_in_matrix(KeyMatrix *key_matrix, int key, bool set) {
+    if (key < 0 || key > 127) return;
     if (set) {
-        (*use_matrix) |= (1 << key);
-    }else {
-        (*use_matrix) &= (~(1 << key));
+        __atomic_fetch_or(&key_matrix->bits[key_word(key)], key_bit(key), __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_fetch_and(&key_matrix->bits[key_word(key)], ~key_bit(key), __ATOMIC_SEQ_CST);
     }
 }
 
-void set_key_in_matrix(unsigned long *key_matrix, int key, bool set) {
-    unsigned long *use_matrix = &key_matrix[0];
+bool is_key_in_matrix(KeyMatrix *key_matrix, int key) {
+    if (key < 0 || key > 127) return false;
+    return __atomic_load_n(&key_matrix->bits[key_word(key)], __ATOMIC_ACQUIRE) & key_bit(key);
+}
 
-    if(key>94) {
-        use_matrix = &key_matrix[3];
-        key -=94;
-    } else if(key>62) {
-        use_matrix = &key_matrix[2];
-        key -=62;
-    } else if(key>31) {
-        use_matrix = &key_matrix[1];
-        key -= 31;
+bool have_key_in_matrix(KeyMatrix *key_matrix) {
+    return (__atomic_load_n(&key_matrix->bits[0], __ATOMIC_ACQUIRE) |
+            __atomic_load_n(&key_matrix->bits[1], __ATOMIC_ACQUIRE)) != 0;
+}
+
+void clear_key_matrix(KeyMatrix *key_matrix) {
+    __atomic_store_n(&key_matrix->bits[0], 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&key_matrix->bits[1], 0, __ATOMIC_SEQ_CST);
+}
+
+static uint64_t channel_word_union(ChannelKeyMatrix *in_matrix, int word) {
+    uint64_t all = 0;
+    int i = 0;
+    for(;i<16;i++) {
+        all |= __atomic_load_n(&in_matrix->channel[i].bits[word], __ATOMIC_SEQ_CST);
     }
+    return all;
+}
+
+/* remove released bits from the any mask when no other channel holds them.
+   a concurrent setter always sets its channel bit before the any bit,
+   so re-checking after the clear restores bits we raced against */
+static void drop_from_any(ChannelKeyMatrix *in_matrix, int word, uint64_t released) {
+    if (!released) return;
+    uint64_t gone = released & ~channel_word_union(in_matrix, word);
+    if (!gone) return;
+    __atomic_fetch_and(&in_matrix->any.bits[word], ~gone, __ATOMIC_SEQ_CST);
+    uint64_t back = gone & channel_word_union(in_matrix, word);
+    if (back) __atomic_fetch_or(&in_matrix->any.bits[word], back, __ATOMIC_SEQ_CST);
+}
+
+void set_key_in_channel(ChannelKeyMatrix *in_matrix, int channel, int key, bool set) {
+    if (key < 0 || key > 127 || channel < 0 || channel > 15) return;
+    const int word = key_word(key);
     if (set) {
-        (*use_matrix) |= (1 << key);
-    }else {
-        (*use_matrix) &= (~(1 << key));
+        __atomic_fetch_or(&in_matrix->channel[channel].bits[word], key_bit(key), __ATOMIC_SEQ_CST);
+        __atomic_fetch_or(&in_matrix->any.bits[word], key_bit(key), __ATOMIC_SEQ_CST);
+    } else {
+        uint64_t old = __atomic_fetch_and(&in_matrix->channel[channel].bits[word],
+                                                ~key_bit(key), __ATOMIC_SEQ_CST);
+        drop_from_any(in_matrix, word, old & key_bit(key));
     }
 }
 
-bool is_key_in_matrix(unsigned long *key_matrix, int key) {
-    unsigned long *use_matrix = &key_matrix[0];
-    
-    
-    if(key>94) {
-        use_matrix = &key_matrix[3];
-        key -=94;
-    } else if(key>62) {
-        use_matrix = &key_matrix[2];
-        key -=62;
-    } else if(key>31) {
-        use_matrix = &key_matrix[1];
-        key -= 31;
-    }
-    bool ret = false;
-    if((*use_matrix) & (1<<key)) {
-        ret = true;
-    }
-    return ret;
+bool is_key_in_channel(ChannelKeyMatrix *in_matrix, int channel, int key) {
+    if (channel < 0 || channel > 15) return false;
+    return is_key_in_matrix(&in_matrix->channel[channel], key);
 }
 
-int is_key_in_in_matrix(MidiKeyboard *keys, int key) {
-    int i = 0;
-    for(;i<16;i++) {
-        if (is_key_in_matrix(keys->in_key_matrix[i], key)) {
-           return i; 
-       }
+void clear_channel_matrix(ChannelKeyMatrix *in_matrix, int channel) {
+    if (channel < 0 || channel > 15) return;
+    int word = 0;
+    for(;word<2;word++) {
+        uint64_t old = __atomic_exchange_n(&in_matrix->channel[channel].bits[word],
+                                                        0, __ATOMIC_SEQ_CST);
+        drop_from_any(in_matrix, word, old);
     }
-    return -1;
 }
 
-bool have_key_in_matrix(unsigned long *key_matrix) {
-    
-    bool ret = false;
+void clear_all_channel_matrix(ChannelKeyMatrix *in_matrix) {
     int i = 0;
-    int j = 0;
-    for(;j<4;j++) {
-        for(;i<32;i++) {
-            if(key_matrix[j] & (1<<i)) {
-                ret = true;
-                break;
-            }
-        }
-        i = 0;
-    }
-    return ret;
+    for(;i<16;i++) clear_channel_matrix(in_matrix, i);
 }
 
-void clear_key_matrix(unsigned long *key_matrix) {
+/* lowest channel holding key, or -1. the any mask rejects idle keys
+   with a single load, so only sounding keys gather the channel bits */
+int is_key_in_in_matrix(MidiKeyboard *keys, int key) {
+    if (!is_key_in_matrix(&keys->in_key_matrix.any, key)) return -1;
+    const int word = key_word(key);
+    const uint64_t bit = key_bit(key);
+    unsigned int channels = 0;
     int i = 0;
-    int j = 0;
-    for(;j<4;j++) {
-        for(;i<32;i++) {
-            key_matrix[j] &= (~(1 << i));
-        }
-        i = 0;
+    for(;i<16;i++) {
+        if (__atomic_load_n(&keys->in_key_matrix.channel[i].bits[word], __ATOMIC_ACQUIRE) & bit)
+            channels |= 1u << i;
     }
+    return channels ? __builtin_ctz(channels) : -1;
 }
 
 void use_matrix_color(Widget_t *w, int c) {
@@ -460,12 +288,10 @@ void use_matrix_color(Widget_t *w, int c) {
 
 static void draw_keyboard(void *w_, void* user_data) {
     Widget_t *w = (Widget_t*)w_;
-    XWindowAttributes attrs;
-    XGetWindowAttributes(w->app->dpy, (Window)w->widget, &attrs);
-    int width_t = attrs.width;
-    int height_t = attrs.height;
-    if (attrs.map_state != IsViewable) return;
     MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
+    if (!keys->is_mapped) return;
+    int width_t = keys->width;
+    int height_t = keys->height;
  
     int space = 2;
     int set = 0;
@@ -481,7 +307,7 @@ static void draw_keyboard(void *w_, void* user_data) {
     for(;i<width_t;i++) {
         ik = is_key_in_in_matrix(keys, k+keys->octave);
         cairo_rectangle(w->crb,i,0,keys->key_size+1,height_t);
-        if ( k+keys->octave == keys->active_key || is_key_in_matrix(keys->key_matrix,k+keys->octave)) {
+        if ( k+keys->octave == keys->active_key || is_key_in_matrix(&keys->key_matrix,k+keys->octave)) {
             //use_base_color_scheme(w, ACTIVE_);
             use_matrix_color(w, keys->channel);
             cairo_set_line_width(w->crb, 1.0);
@@ -581,7 +407,7 @@ static void draw_keyboard(void *w_, void* user_data) {
             ik = is_key_in_in_matrix(keys, k+keys->octave);
             cairo_set_line_width(w->crb, 1.0);
             cairo_rectangle(w->crb,i+keys->key_offset,0,keys->key_size-4,height_t*0.59);
-            if ( k+keys->octave == keys->active_key || is_key_in_matrix(keys->key_matrix,k+keys->octave)) {
+            if ( k+keys->octave == keys->active_key || is_key_in_matrix(&keys->key_matrix,k+keys->octave)) {
                 //use_base_color_scheme(w, ACTIVE_);
                 use_matrix_color(w, keys->channel);
                 cairo_set_line_width(w->crb, 1.0);
@@ -638,11 +464,10 @@ static void keyboard_motion(void *w_, void* xmotion_, void* user_data) {
     Widget_t *p = (Widget_t *)w->parent;
     MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
     XMotionEvent *xmotion = (XMotionEvent*)xmotion_;
-    XWindowAttributes attrs;
-    XGetWindowAttributes(w->app->dpy, (Window)w->widget, &attrs);
-    if (attrs.map_state != IsViewable) return;
-    int width = attrs.width;
-    int height = attrs.height;
+    if (!keys->is_mapped) return;
+    keys->event_time = xmotion->time;
+    int width = keys->width;
+    int height = keys->height;
 
     bool catchit = false;
 
@@ -660,8 +485,8 @@ static void keyboard_motion(void *w_, void* xmotion_, void* user_data) {
                         if (keys->active_key != keys->prelight_key) {
                             keys->send_key = keys->active_key;
                             if (keys->send_key>=0 && keys->send_key<128) {
-                                if (is_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key)) 
-                                    set_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key,false);
+                                if (is_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key)) 
+                                    set_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key,false);
                                 keys->mk_send_note(p, &keys->send_key,false);
                             }
                             keys->active_key = keys->prelight_key;
@@ -710,8 +535,8 @@ static void keyboard_motion(void *w_, void* xmotion_, void* user_data) {
                     if (keys->active_key != keys->prelight_key) {
                         keys->send_key = keys->active_key;
                         if (keys->send_key>=0 && keys->send_key<128) {
-                            if (is_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key)) 
-                                set_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key,false);
+                            if (is_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key)) 
+                                set_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key,false);
                             keys->mk_send_note(p, &keys->send_key,false);
                         }
                         keys->active_key = keys->prelight_key;
@@ -750,20 +575,13 @@ static void keyboard_motion(void *w_, void* xmotion_, void* user_data) {
     }
 }
 
-static void get_outkey(MidiKeyboard *keys, KeySym sym, float *outkey) {
+static int get_outkey(MidiKeyboard *keys, KeySym sym) {
     switch(keys->layout) {
-        case(0):keysym_qwertz_to_midi_key(sym, outkey);
-        break;
-        case(1):keysym_qwerty_to_midi_key(sym, outkey);
-        break;
-        case(2):keysym_azerty_fr_to_midi_key(sym, outkey);
-        break;
-        case(3):keysym_azerty_be_to_midi_key(sym, outkey);
-        break;
-        case(4):custom_to_midi_key(keys->custom_keys, sym, outkey);
-        break;
-        default:keysym_qwertz_to_midi_key(sym, outkey);
-        break;
+        case(1):
+        case(2):
+        case(3): return keymap_lookup(&layout_tables[keys->layout], sym);
+        case(4): return keymap_lookup(&keys->custom_table, sym);
+        default: return keymap_lookup(&layout_tables[0], sym);
     }
 }
 
@@ -774,24 +592,28 @@ static void key_press(void *w_, void *key_, void *user_data) {
     MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
     XKeyEvent *key = (XKeyEvent*)key_;
     if (!key) return;
+    keys->event_time = key->time;
     if (key->state & ControlMask) {
         p->func.key_press_callback(p, key_, user_data);
     } else {
-        float outkey = 0.0;
+        // with detectable autorepeat a held key only repeats KeyPress,
+        // so a key which is already down is ignored here
+        if (keys->pressed_note[key->keycode & 0xff] >= 0) return;
         KeySym sym = XLookupKeysym (key, 0);
-        get_outkey(keys, sym, &outkey);
+        int outkey = get_outkey(keys, sym);
 
-        if ((int)outkey && !is_key_in_matrix(keys->key_matrix, (int)outkey+keys->octave)) {
-            set_key_in_matrix(keys->key_matrix,(int)outkey+keys->octave,true);
-            keys->send_key = (int)outkey+keys->octave;
-            if (keys->send_key>=0 && keys->send_key<128)
+        if (outkey && !is_key_in_matrix(&keys->key_matrix, outkey+keys->octave)) {
+            set_key_in_matrix(&keys->key_matrix,outkey+keys->octave,true);
+            keys->send_key = outkey+keys->octave;
+            if (keys->send_key>=0 && keys->send_key<128) {
+                keys->pressed_note[key->keycode & 0xff] = keys->send_key;
                 keys->mk_send_note(p, &keys->send_key,true);
+            }
             //expose_widget(w);
         } 
         if (sym == XK_space) {
-            clear_key_matrix(&keys->key_matrix[0]);
-            int i = 0;
-            for (;i<16;i++) clear_key_matrix(&keys->in_key_matrix[i][0]);
+            clear_key_matrix(&keys->key_matrix);
+            clear_all_channel_matrix(&keys->in_key_matrix);
             keys->mk_send_all_sound_off(p, NULL);
             //expose_widget(w);
         }
@@ -805,18 +627,38 @@ static void key_release(void *w_, void *key_, void *user_data) {
     MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
     XKeyEvent *key = (XKeyEvent*)key_;
     if (!key) return;
-    float outkey = 0.0;
-    KeySym sym = XLookupKeysym (key, 0);
-    get_outkey(keys, sym, &outkey);
-    if ((int)outkey && is_key_in_matrix(keys->key_matrix, (int)outkey+keys->octave)) {
-        set_key_in_matrix(keys->key_matrix,(int)outkey+keys->octave,false);
-        keys->send_key = (int)outkey+keys->octave;
-        if (keys->send_key>=0 && keys->send_key<128)
-            keys->mk_send_note(p,&keys->send_key,false);
+    keys->event_time = key->time;
+    // release the note which was send on press, even when octave or
+    // layout have changed in between
+    int note = keys->pressed_note[key->keycode & 0xff];
+    if (note < 0) return;
+    keys->pressed_note[key->keycode & 0xff] = -1;
+    if (is_key_in_matrix(&keys->key_matrix, note)) {
+        set_key_in_matrix(&keys->key_matrix,note,false);
+        keys->send_key = note;
+        keys->mk_send_note(p,&keys->send_key,false);
         //expose_widget(w);
     }
 }
 
+void keyboard_release_keys(Widget_t *w) {
+    Widget_t *p = (Widget_t *)w->parent;
+    MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
+    // the KeyRelease for a held key goes to the window which has the
+    // focus then, so send the note off for all keys still down here
+    int i = 0;
+    for(;i<256;i++) {
+        int note = keys->pressed_note[i];
+        if (note < 0) continue;
+        keys->pressed_note[i] = -1;
+        if (is_key_in_matrix(&keys->key_matrix, note)) {
+            set_key_in_matrix(&keys->key_matrix,note,false);
+            keys->send_key = note;
+            keys->mk_send_note(p,&keys->send_key,false);
+        }
+    }
+}
+
 static void leave_keyboard(void *w_, void* user_data) {
     Widget_t *w = (Widget_t*)w_;
     MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
@@ -832,6 +674,7 @@ static void button_pressed_keyboard(void *w_, void* button_, void* user_data) {
     if (w->flags & HAS_POINTER) {
         MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
         XButtonEvent *xbutton = (XButtonEvent*)button_;
+        keys->event_time = xbutton->time;
         if(xbutton->button == Button1) {
             keys->active_key = keys->prelight_key;
             keys->send_key = keys->active_key;
@@ -842,11 +685,11 @@ static void button_pressed_keyboard(void *w_, void* button_, void* user_data) {
         } else if (xbutton->button == Button3) {
             keys->send_key = keys->prelight_key;
             if (keys->send_key>=0 && keys->send_key<128) {
-                if (is_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key)) {
-                    set_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key,false);
+                if (is_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key)) {
+                    set_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key,false);
                     keys->mk_send_note(p,&keys->send_key,false);
                 } else {
-                    set_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key,true);
+                    set_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key,true);
                     keys->mk_send_note(p,&keys->send_key,true);
                 }
             }
@@ -859,13 +702,14 @@ static void button_released_keyboard(void *w_, void* button_, void* user_data) {
     Widget_t *p = (Widget_t *)w->parent;
     MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
     XButtonEvent *xbutton = (XButtonEvent*)button_;
+    keys->event_time = xbutton->time;
     if (w->flags & HAS_POINTER) {
         if(xbutton->button == Button1) {
             keys->send_key = keys->active_key;
             if (keys->send_key>=0 && keys->send_key<128) {
                 keys->mk_send_note(p,&keys->send_key,false);
-                if (is_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key)) 
-                    set_key_in_matrix(keys->in_key_matrix[keys->channel], keys->send_key,false);
+                if (is_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key)) 
+                    set_key_in_channel(&keys->in_key_matrix, keys->channel, keys->send_key,false);
             }
             keys->active_key = -1;
             //expose_widget(w);
@@ -888,19 +732,10 @@ static void keyboard_mem_free(void *w_, void* user_data) {
 }
 
 bool need_redraw(MidiKeyboard *keys) {
-    bool have = false;
-    int i = 0;
-    for(;i<16;i++) {
-        if (have_key_in_matrix(keys->in_key_matrix[i])) {
-            have = true;
-            break;
-        }
-    }
-
     return (keys->active_key > 0 ? 1 : 0) |
     (keys->prelight_key  > 0 ? 1 : 0)  |
-    have_key_in_matrix(keys->key_matrix) |
-    have;
+    have_key_in_matrix(&keys->key_matrix) |
+    have_key_in_matrix(&keys->in_key_matrix.any);
 }
 
 void read_keymap(const char* keymapfile, long keys[128][2]) {
@@ -929,6 +764,28 @@ void add_midi_keyboard(Widget_t *parent, const char * label,
     add_keyboard(parent, label);
 }
 
+// libxputty update the widget geometry from the ConfigureNotify
+// before this is called, so take it from there
+static void keyboard_configure(void *w_, void* user_data) {
+    Widget_t *w = (Widget_t*)w_;
+    MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
+    keys->width = w->width;
+    keys->height = w->height;
+}
+
+static void keyboard_map(void *w_, void* user_data) {
+    keyboard_set_mapped((Widget_t*)w_, true);
+}
+
+static void keyboard_unmap(void *w_, void* user_data) {
+    keyboard_set_mapped((Widget_t*)w_, false);
+}
+
+void keyboard_set_mapped(Widget_t *w, bool mapped) {
+    MidiKeyboard *keys = (MidiKeyboard*)w->parent_struct;
+    keys->is_mapped = mapped;
+}
+
 Widget_t *open_midi_keyboard(Widget_t *w, const char * label) {
     Widget_t *wid = create_window(w->app, DefaultRootWindow(w->app->dpy), 0, 0, 700, 200);
     XSelectInput(wid->app->dpy, wid->widget,StructureNotifyMask|ExposureMask|KeyPressMask 
@@ -955,19 +812,25 @@ void add_keyboard(Widget_t *wid, const char * label) {
     keys->channel = 0;
     keys->key_size = 24;
     keys->key_offset = 15;
+    // geometry is tracked from ConfigureNotify/MapNotify from here on,
+    // so drawing never needs a round trip to the server
+    keys->is_mapped = false;
+    keys->width = wid->width;
+    keys->height = wid->height;
     memset(keys->custom_keys, 0, 128*2*sizeof keys->custom_keys[0][0]);
-    int j = 0;
-    for(;j<4;j++) {
-        keys->key_matrix[j] = 0;
-    }
-    int i = 0;
-    for(;i<16;i++) {
-        j = 0;
-        for(;j<4;j++) {
-            keys->in_key_matrix[i][j] = 0;
-        }
-    }
+    keys->event_time = 0;
+    memset(keys->pressed_note, -1, sizeof keys->pressed_note);
+    memset(&keys->key_matrix, 0, sizeof keys->key_matrix);
+    memset(&keys->in_key_matrix, 0, sizeof keys->in_key_matrix);
     read_keymap(label, keys->custom_keys);
+    build_keymap_table(&keys->custom_table, keys->custom_keys);
+    init_layout_tables();
+
+    // report held keys as one KeyPress stream instead of
+    // KeyRelease/KeyPress pairs, so a held key is one note on/off
+    Bool supported = False;
+    if (!XkbSetDetectableAutoRepeat(wid->app->dpy, True, &supported) || !supported)
+        fprintf(stderr, "xkeyboard: detectable autorepeat not supported by the X server\n");
 
     wid->func.expose_callback = draw_keyboard;
     wid->func.motion_callback = keyboard_motion;
@@ -978,5 +841,8 @@ void add_keyboard(Widget_t *wid, const char * label) {
     wid->func.key_press_callback = key_press;
     wid->func.key_release_callback = key_release;
     wid->func.mem_free_callback = keyboard_mem_free;
+    wid->func.configure_notify_callback = keyboard_configure;
+    wid->func.map_notify_callback = keyboard_map;
+    wid->func.unmap_notify_callback = keyboard_unmap;
 
 }
@@ -23,12 +23,43 @@
 #ifndef XMIDI_KEYBOARD_H_
 #define XMIDI_KEYBOARD_H_
 
+#include <stdint.h>
+
 #include "xwidgets.h"
+#include <X11/XKBlib.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* one bit per midi note, word 0 holds notes 0-63, word 1 notes 64-127.
+   words are only accessed with atomic builtins, as the alsa/jack threads
+   and the GUI write them concurrently */
+typedef struct {
+    uint64_t bits[2];
+} KeyMatrix;
+
+/* key state for all 16 channels, plus the OR of all channels in any */
+typedef struct {
+    KeyMatrix channel[16];
+    KeyMatrix any;
+} ChannelKeyMatrix;
+
+
+#define LAYOUT_TABLES 4
+
+/* direct keysym to note lookup, 0 means unmapped.
+   latin1 keysyms and the 0xff page (keypad, misc) index straight in,
+   everything else goes to a small sorted list */
+typedef struct {
+    signed char latin1[256];
+    signed char misc[256];
+    int n_other;
+    struct {
+        long keysym;
+        signed char note;
+    } other[256];
+} KeyNoteTable;
 
 typedef void (*midikeyfunc)(Widget_t *w, const int *key, const bool on_off);
 typedef void (*midiwheelfunc)(Widget_t *w, const int *value);
@@ -58,40 +89,48 @@ typedef struct {
     int in_motion;
     int key_size;
     int key_offset;
-    unsigned long key_matrix[4];
-    unsigned long in_key_matrix[16][4];
+    int width;
+    int height;
+    bool is_mapped;
+    unsigned long event_time;
+    signed char pressed_note[256];
+    KeyMatrix key_matrix;
+    ChannelKeyMatrix in_key_matrix;
     long custom_keys[128][2];
+    KeyNoteTable custom_table;
 
     midikeyfunc mk_send_note;
     midiwheelfunc mk_send_all_sound_off;
 } MidiKeyboard;
 
-void keysym_azerty_to_midi_key(long inkey, float *midi_key);
-
-void keysym_azerty_fr_to_midi_key(long inkey, float *midi_key);
+void build_keymap_table(KeyNoteTable *table, long custom_keys[128][2]);
 
-void keysym_azerty_be_to_midi_key(long inkey, float *midi_key);
+int keymap_lookup(const KeyNoteTable *table, long keysym);
 
-void keysym_azerty_afnor_to_midi_key(long inkey, float *midi_key);
+void read_keymap(const char* keymapfile, long keys[128][2]);
 
-void keysym_qwertz_to_midi_key(long inkey, float *midi_key);
+void set_key_in_matrix(KeyMatrix *key_matrix, int key, bool set);
 
-void keysym_qwerty_to_midi_key(unsigned int inkey, float *midi_key);
+bool is_key_in_matrix(KeyMatrix *key_matrix, int key);
 
-void custom_to_midi_key(long custom_keys[128], long inkey, float *midi_key);
+bool have_key_in_matrix(KeyMatrix *key_matrix);
 
-void read_keymap(const char* keymapfile, long keys[128][2]);
+void clear_key_matrix(KeyMatrix *key_matrix);
 
-void set_key_in_matrix(unsigned long *key_matrix, int key, bool set);
+void set_key_in_channel(ChannelKeyMatrix *in_matrix, int channel, int key, bool set);
 
-bool is_key_in_matrix(unsigned long *key_matrix, int key);
+bool is_key_in_channel(ChannelKeyMatrix *in_matrix, int channel, int key);
 
-bool have_key_in_matrix(unsigned long *key_matrix);
+void clear_channel_matrix(ChannelKeyMatrix *in_matrix, int channel);
 
-void clear_key_matrix(unsigned long *key_matrix);
+void clear_all_channel_matrix(ChannelKeyMatrix *in_matrix);
 
 void add_keyboard(Widget_t *wid, const char * label);
 
+void keyboard_set_mapped(Widget_t *w, bool mapped);
+
+void keyboard_release_keys(Widget_t *w);
+
 Widget_t *open_midi_keyboard(Widget_t *w, const char * label);
 
 void add_midi_keyboard(Widget_t *parent, const char * label,
@@ -99,6 +138,8 @@ void add_midi_keyboard(Widget_t *parent, const char * label,
 
 bool need_redraw(MidiKeyboard *keys);
 
+void use_matrix_color(Widget_t *w, int c);
+
 #ifdef __cplusplus
 }
 #endif